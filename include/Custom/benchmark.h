@@ -2,14 +2,25 @@
 
 #include "Custom/sphere.h"
 #include "Custom/bvh.h"
+#include "Custom/bvh_linear.h"
 
 
-void free_bvh(BVHNode* node);
 void create_gnuplot_script(const char* data_filename);
 void run_gnuplot();
 void save_benchmark_data(const char* filename, int sphere_count, double time_no_bvh, double time_with_bvh);
 void create_gnuplot_script(const char* data_filename);
 double benchmark_no_bvh(Sphere* spheres, int num_spheres, int num_rays);
-double benchmark_with_bvh(BVHNode* root, int num_spheres, int num_rays);
+double benchmark_with_bvh(const LinearBVH* bvh, int num_spheres, int num_rays);
+void benchmark_builders(Sphere* spheres, int num_spheres, int num_rays);
+void benchmark_wide_bvh(BVHNode* root, Sphere* spheres, const int* sphere_indices, int num_rays);
+void benchmark_node_layouts(const LinearBVH* bvh, int num_rays);
+void benchmark_numa_traversal(const LinearBVH* bvh, int num_rays);
+void benchmark_instancing(int num_spheres, float world_size, int num_rays);
+void benchmark_bvh_cache(Sphere* spheres, int num_spheres, int num_rays);
+void benchmark_out_of_core(Sphere* spheres, int num_spheres, int num_rays);
+void benchmark_dynamic_bvh(Sphere* spheres, int num_spheres, int num_rays);
+int calibrate_sah_cost_model(int num_spheres, int num_rays, BVHCostModel* model);
+void run_cost_calibration();
+void run_autotune();
 void print_sphere_info(Sphere *spheres, int num_spheres);
 void run_benchmark_with_plotting();
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stddef.h>
 #include "Custom/vec3.h"
 #include "Custom/sphere.h"
 #include "Custom/ray.h"
@@ -9,19 +10,172 @@ typedef struct AABB {
     Vec3 max;
 } AABB;
 
+// Leaves cover the range [first, first + sphere_count) of the sphere index array filled by the
+// builder, which lists the caller's sphere indices in leaf order. The spheres themselves are never
+// moved, so several trees can share one sphere array.
 typedef struct BVHNode {
     AABB bounds;
     struct BVHNode* left;
     struct BVHNode* right;
-    Sphere* sphere;
+    int first;
     int sphere_count;
 } BVHNode;
 
+// Builders selectable through build_bvh()
+typedef enum BVHBuilder {
+    BVH_BUILDER_PLANES,     // build_bvh_node(): 7 fixed planes per axis over the node bounds
+    BVH_BUILDER_BINNED,     // binned SAH over the centroid bounds
+    BVH_BUILDER_SWEEP,      // full sweep SAH: every split of the centroid-sorted primitives (slow, best trees)
+    BVH_BUILDER_LBVH,       // linear BVH from sorted Morton codes (fastest build, for scenes that change often)
+    BVH_BUILDER_HLBVH,      // LBVH clusters at the bottom, binned SAH over the clusters at the top
+    BVH_BUILDER_PLOC,       // bottom-up parallel locally-ordered clustering of Morton sorted spheres
+} BVHBuilder;
+
+#define BVH_MAX_BINS 64
+#define BVH_DEFAULT_BINS 32
+#define BVH_DEFAULT_MAX_DEPTH 64
+#define BVH_PLANES_MAX_DEPTH 40     // depth limit of build_bvh_node(), which takes no build parameters
+#define BVH_DEFAULT_MORTON_BITS 30
+#define BVH_DEFAULT_PLOC_RADIUS 16
+#define BVH_DEFAULT_MAX_LEAF_SIZE 4
+
+// Default relative costs of visiting a node and of testing a sphere, used to compare whole trees
+// and to decide when a node becomes a leaf. A node visit (slab test, stack and a likely cache miss)
+// costs about as much as a few sphere tests of a leaf that is already in cache. A profile measured
+// on the running machine (calibrate_sah_cost_model() in benchmark.c) replaces them.
+#define BVH_SAH_TRAVERSAL_COST 4.0f
+#define BVH_SAH_INTERSECT_COST 1.0f
+#define BVH_COST_PROFILE_PATH "bvh_cost_profile.txt"
+
+// Parallel build granularity. Both depend only on primitive counts, never on the thread count,
+// so the tree is identical however many threads build it.
+#define BVH_PARALLEL_GRAIN 16384    // primitives per task in parallel loops
+#define BVH_TASK_THRESHOLD 4096     // subtrees with fewer primitives are built by a single task
+
+typedef struct BVHCostModel {
+    float traversal_cost;   // one node visit: slab test and stack
+    float intersect_cost;   // one sphere test
+} BVHCostModel;
+
+typedef struct BVHBuildParams {
+    BVHBuilder builder;
+    int bin_count;          // binned builder only: 16, 32 or 64
+    int max_depth;
+    int num_threads;        // 0 = all hardware threads, 1 = serial build
+    int morton_bits;        // Morton code builders: 30 or 63
+    int ploc_radius;        // PLOC builder: clusters searched on either side for the nearest neighbour
+    int max_leaf_size;      // most spheres per leaf, unless the depth limit forces more; 1 = one sphere per leaf
+} BVHBuildParams;
+
+// Node storage of a tree, see bvh_arena.c. Every builder allocates its nodes from one and hands it
+// to the finished tree, free_bvh(root) releases it.
+typedef struct BVHNodeArena BVHNodeArena;
+
+// Per-primitive data computed once per build, so split evaluation never touches the spheres
+typedef struct BVHPrimRef {
+    AABB bounds;
+    Vec3 centroid;
+    int index;              // index into the caller's sphere array
+} BVHPrimRef;
+
 
 AABB create_empty_aabb();
-AABB create_aabb_from_sphere(Sphere* sphere);
+AABB create_aabb_from_sphere(const Sphere* sphere);
 AABB combine_aabb(AABB a, AABB b);
 float get_aabb_surface_area(AABB box);
-float evaluate_sah(Sphere* spheres, int start, int end, int axis, float split);
-BVHNode* build_bvh_node(Sphere* spheres, int start, int end, int depth);
+float evaluate_sah(const Sphere* spheres, const int* sphere_indices, int start, int end, int axis, float split);
+BVHNode* build_bvh_node(const Sphere* spheres, int* sphere_indices, int start, int end, int depth);
+
+// Inline helpers for the builders' hot loops. Plain comparisons instead of fmin()/fmax(), so they
+// compile to single min/max instructions.
+static inline float min_f(float a, float b) { return a < b ? a : b; }
+static inline float max_f(float a, float b) { return a > b ? a : b; }
+
+static inline float axis_value(Vec3 v, int axis)
+{
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+// Sphere in slot i of a tree's leaf order: sphere_indices[i], or i itself if the spheres are
+// already stored in leaf order (sphere_indices NULL, e.g. a copy from bvh_compact_spheres())
+static inline int bvh_leaf_sphere(const int* sphere_indices, int slot)
+{
+    return sphere_indices ? sphere_indices[slot] : slot;
+}
+
+static inline AABB grow_aabb(AABB a, AABB b)
+{
+    return (AABB){
+        {min_f(a.min.x, b.min.x), min_f(a.min.y, b.min.y), min_f(a.min.z, b.min.z)},
+        {max_f(a.max.x, b.max.x), max_f(a.max.y, b.max.y), max_f(a.max.z, b.max.z)}};
+}
+
+static inline AABB grow_aabb_point(AABB a, Vec3 p)
+{
+    return (AABB){
+        {min_f(a.min.x, p.x), min_f(a.min.y, p.y), min_f(a.min.z, p.z)},
+        {max_f(a.max.x, p.x), max_f(a.max.y, p.y), max_f(a.max.z, p.z)}};
+}
+
+// Cost model of every builder and cost function. The first call loads BVH_COST_PROFILE_PATH if it
+// exists, the defaults above stay otherwise. Set or load another model before building, not while
+// builds are running.
+BVHCostModel bvh_cost_model();
+void bvh_set_cost_model(BVHCostModel model);
+// Both return 1 on success, loading replaces the current model only if the file holds a valid one
+int bvh_cost_model_load(const char* path);
+int bvh_cost_model_save(const char* path, BVHCostModel model);
+
+// SAH termination: a node becomes a leaf when testing all of its spheres costs no more than
+// visiting it and testing the children of its best split. split_cost is the best split's sum of
+// sphere count times surface area over both children, INFINITY if there is no valid split. Both
+// sides are the SAH costs relative to the parent multiplied by its area, so no division is needed.
+static inline int bvh_sah_prefers_leaf(int count, float area, float split_cost, int max_leaf_size)
+{
+    if (count > max_leaf_size)
+        return 0;
+    BVHCostModel costs = bvh_cost_model();
+    return costs.intersect_cost * count * area <= costs.traversal_cost * area + costs.intersect_cost * split_cost;
+}
+
+BVHBuildParams bvh_default_build_params();
+int bvh_max_leaf_size(const BVHBuildParams* params);
+int bvh_thread_count(const BVHBuildParams* params);
+void bvh_fill_prim_refs(BVHPrimRef* refs, const Sphere* spheres, int num_spheres);
+BVHPrimRef* bvh_create_prim_refs(const Sphere* spheres, int num_spheres);
+Sphere* bvh_compact_spheres(const Sphere* spheres, const int* sphere_indices, int num_spheres);
+
+// Builders never modify the spheres. sphere_indices must hold num_spheres ints and receives the
+// caller's sphere indices in leaf order.
+BVHNode* build_bvh_binned(const Sphere* spheres, int num_spheres, const BVHBuildParams* params, int* sphere_indices);
+// Scratch of a binned build over up to count references, for callers that must not run out of
+// memory halfway through bvh_build_binned_subtrees(). NULL scratch lets the build allocate its own.
+typedef struct BVHBinnedScratch BVHBinnedScratch;
+BVHBinnedScratch* bvh_binned_scratch_create(int count);
+void bvh_binned_scratch_free(BVHBinnedScratch* scratch);
+BVHNode* bvh_build_binned_subtrees(BVHNodeArena* arena, BVHPrimRef* refs, int count, BVHNode** subtrees,
+                                   BVHBinnedScratch* scratch, const BVHBuildParams* params);
+BVHNode* build_bvh_sweep(const Sphere* spheres, int num_spheres, const BVHBuildParams* params, int* sphere_indices);
+BVHNode* build_bvh_lbvh(const Sphere* spheres, int num_spheres, const BVHBuildParams* params, int* sphere_indices);
+BVHNode* build_bvh_hlbvh(const Sphere* spheres, int num_spheres, const BVHBuildParams* params, int* sphere_indices);
+BVHNode* build_bvh_ploc(const Sphere* spheres, int num_spheres, const BVHBuildParams* params, int* sphere_indices);
+BVHNode* build_bvh(const Sphere* spheres, int num_spheres, const BVHBuildParams* params, int* sphere_indices);
+void bvh_collapse_leaves(BVHNodeArena* arena, BVHNode* root, int max_leaf_size);
+int bvh_sphere_count(const BVHNode* root);
+
+BVHNodeArena* bvh_arena_create(int num_threads);
+void bvh_arena_destroy(BVHNodeArena* arena);
+BVHNode* bvh_arena_alloc_node(BVHNodeArena* arena);
+void bvh_arena_release_node(BVHNodeArena* arena, BVHNode* node);
+void bvh_arena_attach(BVHNodeArena* arena, const BVHNode* root);
+BVHNodeArena* bvh_arena_of(const BVHNode* root);
+// Most bytes an arena of num_threads threads can hold once it has handed out node_count nodes
+size_t bvh_arena_bytes_bound(int node_count, int num_threads);
+// Takes the root a builder returned, never one of its subtrees: an arena tree's nodes are released
+// with the arena. Builds with BVH_DEBUG refuse an interior node with a message and free nothing.
+// bvh_arena_alloc_node() returns NULL when out of memory, and the builders return a NULL tree.
+void free_bvh(BVHNode* root);
+
+// Expected cost of a random ray hitting the root: node and sphere areas relative to the root's
+float bvh_sah_cost(const BVHNode* root);
 
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "Custom/bvh.h"
+#include "Custom/ray.h"
+
+#define BVH_TUNED_PARAMS_PATH "bvh_tuned_params.txt"
+
+typedef struct BVHTuneResult {
+    BVHBuildParams params;  // the fastest configuration to trace
+    double build_time;      // seconds, of that configuration
+    double rays_per_second;
+    double default_rays_per_second;  // bvh_default_build_params() on the same rays
+    int candidates;         // configurations built and traced
+} BVHTuneResult;
+
+// Searches builder, bin count, leaf size and depth limit for the tree that traces the given rays
+// fastest. base supplies the untuned fields (threads, Morton bits, PLOC radius), NULL for defaults.
+// Returns 1 on success.
+int bvh_autotune(const Sphere* spheres, int num_spheres, const Ray* rays, int num_rays,
+                 const BVHBuildParams* base, BVHTuneResult* result);
+
+// Build parameters as "name value" lines, fields missing from a loaded file keep their values.
+// Both return 1 on success.
+int bvh_build_params_save(const char* path, const BVHBuildParams* params);
+int bvh_build_params_load(const char* path, BVHBuildParams* params);
+const char* bvh_builder_name(BVHBuilder builder);
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "Custom/bvh.h"
+#include "Custom/bvh_linear.h"
+
+// Bumped whenever the file layout, LinearBVHNode or Sphere changes
+#define BVH_CACHE_VERSION 1
+
+// A flattened BVH mapped from a cache file, see bvh_cache.c. bvh points straight into the mapped
+// pages and must not be modified (no refit), its spheres are in leaf order.
+typedef struct BVHCacheMapping {
+    LinearBVH bvh;
+    int sphere_count;
+    uint64_t key;
+    void* data;             // the whole mapped file
+    size_t size;
+#ifdef _WIN32
+    void* file;
+    void* mapping;
+#endif
+} BVHCacheMapping;
+
+// Hash of everything the tree depends on: the spheres, their order, the build parameters and the
+// SAH cost model
+uint64_t bvh_cache_key(const Sphere* spheres, int num_spheres, const BVHBuildParams* params);
+// The same key over spheres streamed in chunks: begin, then append every chunk in order
+uint64_t bvh_cache_key_begin(int num_spheres, const BVHBuildParams* params);
+uint64_t bvh_cache_key_append(uint64_t key, const Sphere* spheres, int count);
+// Folds anything else the tree depends on into a key, e.g. the settings of another kind of build
+uint64_t bvh_cache_key_mix(uint64_t key, const void* data, size_t size);
+// Cache file of a key inside directory, returns 0 if it does not fit into size bytes
+int bvh_cache_path(char* path, size_t size, const char* directory, uint64_t key);
+
+// Writes a flattened BVH and its spheres in leaf order, replacing any older file atomically.
+// Returns 1 on success.
+int bvh_cache_save(const char* path, const LinearBVH* bvh, int sphere_count, uint64_t key);
+
+// Writes a cache file piece by piece: all nodes in depth-first order, then all spheres in leaf
+// order. Closing checks that the counts given to open were met and renames the file into place,
+// it returns 1 on success.
+typedef struct BVHCacheWriter BVHCacheWriter;
+BVHCacheWriter* bvh_cache_writer_open(const char* path, int node_count, int depth, int sphere_count, uint64_t key);
+int bvh_cache_write_nodes(BVHCacheWriter* writer, const LinearBVHNode* nodes, int count);
+int bvh_cache_write_spheres(BVHCacheWriter* writer, const Sphere* spheres, int count);
+int bvh_cache_writer_close(BVHCacheWriter* writer);
+
+// NULL if the file is missing, was written by another version or for another key
+BVHCacheMapping* bvh_cache_open(const char* path, uint64_t key);
+void bvh_cache_close(BVHCacheMapping* mapping);
+
+// Opens the cached tree of the scene, or builds, saves and opens it on a miss
+BVHCacheMapping* bvh_cache_load_or_build(const char* directory, const Sphere* spheres, int num_spheres,
+                                         const BVHBuildParams* params);
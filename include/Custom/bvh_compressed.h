@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include "Custom/bvh.h"
+
+#define COMPRESSED_BVH_WIDTH 8
+#define COMPRESSED_BVH_MAX_LEAF 4       // subtrees with up to this many spheres become leaves
+#define COMPRESSED_BVH_STACK_SIZE 1024
+#define COMPRESSED_BVH_EMPTY_SLOT 0xFF  // meta of an unused slot
+
+// 80 bytes per node. Child bounds are 8-bit multiples of 2^exponent above origin, rounded
+// outwards, so the decoded boxes always contain the exact ones.
+typedef struct CompressedBVHNode {
+    float origin[3];                        // minimum corner of the node bounds
+    int8_t exponent[3];
+    uint8_t interior_mask;                  // bit i set: child i is a node
+    uint32_t child_base;                    // first interior child, the others follow in slot order
+    uint32_t leaf_base;                     // first sphere index of the leaf children
+    uint8_t meta[COMPRESSED_BVH_WIDTH];     // interior child: rank after child_base, leaf child: offset << 2 | (count - 1)
+    uint8_t lo[3][COMPRESSED_BVH_WIDTH];    // unused slots have lo > hi and are never hit
+    uint8_t hi[3][COMPRESSED_BVH_WIDTH];
+} CompressedBVHNode;
+
+typedef struct CompressedBVH {
+    CompressedBVHNode* nodes;
+    int node_count;
+    int depth;
+    uint32_t* indices;      // spheres of the leaves, in leaf order
+    int index_count;
+    Sphere* spheres;
+} CompressedBVH;
+
+// sphere_indices as filled by the builder, or NULL if spheres is already in leaf order
+CompressedBVH* bvh_compress(const BVHNode* root, Sphere* spheres, const int* sphere_indices);
+size_t compressed_bvh_bytes(const CompressedBVH* bvh);
+void free_compressed_bvh(CompressedBVH* bvh);
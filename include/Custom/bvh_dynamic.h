@@ -0,0 +1,29 @@
+#pragma once
+
+#include "Custom/bvh.h"
+
+// A built tree that takes sphere insertions and removals, see bvh_dynamic.c
+typedef struct DynamicBVH {
+    BVHNode* root;          // keeps its address for the lifetime of the tree, never NULL
+    BVHNodeArena* arena;    // NULL if the nodes were allocated one by one
+    int* sphere_indices;    // sphere of every leaf slot, for bvh_flatten() and bvh_refit()
+    int slot_count;         // slots handed out so far, in use or free
+    int slot_capacity;
+    int* free_slots;        // slots given up by removals, taken again by insertions
+    int free_slot_count;
+    int sphere_count;
+    struct DynamicSearch* search;
+} DynamicBVH;
+
+// Takes over a tree from any builder, or starts an empty one for a NULL root, and copies its
+// sphere indices. free_dynamic_bvh() frees the tree as well.
+DynamicBVH* bvh_make_dynamic(BVHNode* root, const int* sphere_indices);
+void free_dynamic_bvh(DynamicBVH* tree);
+
+// spheres[sphere] must hold the sphere as it is now, and for removals as the tree last saw it
+// (built, inserted or refitted). All three return 1 on success. A failed insertion leaves the
+// tree as it was; a failed batch does too when it rebuilds the tree, smaller batches are inserted
+// one by one and keep the spheres before the one that failed.
+int bvh_insert(DynamicBVH* tree, const Sphere* spheres, int sphere);
+int bvh_insert_batch(DynamicBVH* tree, const Sphere* spheres, const int* new_spheres, int count);
+int bvh_remove(DynamicBVH* tree, const Sphere* spheres, int sphere);
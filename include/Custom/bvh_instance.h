@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stddef.h>
+#include "Custom/bvh.h"
+#include "Custom/bvh_linear.h"
+
+// Affine transform, rows of a 3x4 matrix: p' = m[.][0..2] * p + m[.][3]
+typedef struct Transform {
+    float m[3][4];
+} Transform;
+
+Transform transform_identity();
+// Uniform scale, then rotation by yaw radians about the y axis, then translation
+Transform transform_make(Vec3 translation, float yaw, float scale);
+// Identity for transforms that cannot be inverted
+Transform transform_inverse(const Transform* t);
+Vec3 transform_point(const Transform* t, Vec3 p);
+Vec3 transform_vector(const Transform* t, Vec3 v);
+// Object space normal to world space, given the world to object transform
+Vec3 transform_normal(const Transform* world_to_object, Vec3 n);
+
+// Bottom level: one cluster of spheres in its own object space, built once and shared by every
+// instance of it
+typedef struct BLAS {
+    LinearBVH* bvh;
+    Sphere* spheres;        // the cluster in leaf order, owned
+    int sphere_count;
+    AABB bounds;
+} BLAS;
+
+typedef struct BVHInstance {
+    const BLAS* blas;
+    Transform object_to_world;
+    Transform world_to_object;  // filled in by bvh_build_tlas() and bvh_update_tlas()
+    AABB bounds;                // world bounds, filled in by the same
+} BVHInstance;
+
+// Top level: a tree over the world bounds of the instances, leaf offsets index instances
+typedef struct TLAS {
+    LinearBVHNode* nodes;
+    int node_count;
+    int depth;
+    BVHInstance* instances; // the caller's array, must outlive the TLAS
+    int instance_count;
+} TLAS;
+
+BLAS* bvh_build_blas(const Sphere* spheres, int num_spheres, const BVHBuildParams* params);
+void free_blas(BLAS* blas);
+
+TLAS* bvh_build_tlas(BVHInstance* instances, int instance_count, const BVHBuildParams* params);
+// Rebuilds the top level after instances moved or were retargeted, the bottom levels are untouched.
+// Returns 1 on success.
+int bvh_update_tlas(TLAS* tlas, const BVHBuildParams* params);
+void free_tlas(TLAS* tlas);
+
+size_t bvh_blas_bytes(const BLAS* blas);
+size_t bvh_tlas_bytes(const TLAS* tlas);
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "Custom/bvh.h"
+#include "Custom/bvh_linear.h"
+
+#define BVH_LAYOUT_LINE_BYTES 64    // one sibling pair of 32 byte nodes
+#define BVH_LAYOUT_PAGE_BYTES 4096  // treelet block size
+
+// Order of the sibling pairs in memory
+typedef enum BVHNodeLayout {
+    BVH_LAYOUT_DEPTH_FIRST, // depth-first order of their parents, the linear BVH's order in pairs
+    BVH_LAYOUT_VEB,         // van Emde Boas order: recursively the top half of the levels, then every bottom subtree
+    BVH_LAYOUT_TREELET,     // page sized blocks filled greedily with the pairs most rays visit
+} BVHNodeLayout;
+
+#define BVH_LAYOUT_COUNT 3
+
+// A flattened BVH whose two children of every interior node are stored next to each other in one
+// cache line: interior nodes point at their first child, the second follows it. Node 0 is the root
+// and node 1 unused padding, so every pair starts on a line. The nodes are page aligned.
+typedef struct ClusteredBVH {
+    BVHNodeLayout layout;
+    LinearBVHNode* nodes;
+    void* node_memory;      // allocation holding the aligned nodes
+    int node_count;         // including the padding node
+    int depth;
+    Sphere* spheres;
+    int* sphere_indices;    // sphere of every leaf slot, NULL if leaf offsets index spheres directly
+} ClusteredBVH;
+
+// Keeps the flattened tree's leaves, child order and sphere slots, only the node order changes.
+// The flattened tree can be freed afterwards.
+ClusteredBVH* bvh_cluster_layout(const LinearBVH* bvh, BVHNodeLayout layout);
+void free_clustered_bvh(ClusteredBVH* bvh);
+const char* bvh_layout_name(BVHNodeLayout layout);
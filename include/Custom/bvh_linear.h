@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include "Custom/bvh.h"
+
+// Traversal stack size, bvh_flatten() rejects deeper trees
+#define LINEAR_BVH_MAX_DEPTH 128
+#define LINEAR_BVH_MAX_LEAF_SIZE 65535
+
+// 32 bytes, two nodes per cache line. Nodes are stored depth-first, so the left child of an
+// interior node always directly follows it.
+typedef struct LinearBVHNode {
+    float min[3];
+    int32_t offset;         // leaf: first sphere slot, interior node: index of the right child
+    float max[3];
+    uint16_t count;         // spheres in a leaf, 0 for interior nodes
+    uint8_t axis;           // interior node: axis along which the children are ordered
+    uint8_t pad;
+} LinearBVHNode;
+
+typedef struct LinearBVH {
+    LinearBVHNode* nodes;
+    int node_count;
+    int depth;
+    Sphere* spheres;
+    int* sphere_indices;    // sphere of every leaf slot, NULL if leaf offsets index spheres directly
+} LinearBVH;
+
+// Axis along which the two children of an interior node are ordered: the one in which their
+// centers lie furthest apart. The traversal visits the child on the ray's side of it first.
+static inline int linear_bvh_ordering_axis(AABB a, AABB b)
+{
+    float d[3] = {
+        b.min.x + b.max.x - a.min.x - a.max.x,
+        b.min.y + b.max.y - a.min.y - a.max.y,
+        b.min.z + b.max.z - a.min.z - a.max.z};
+    for (int axis = 0; axis < 3; axis++)
+    {
+        d[axis] = d[axis] < 0.0f ? -d[axis] : d[axis];
+    }
+    if (d[0] >= d[1] && d[0] >= d[2])
+        return 0;
+    return d[1] >= d[2] ? 1 : 2;
+}
+
+// 1 if child b has the smaller center along axis and has to be stored before child a
+static inline int linear_bvh_children_swapped(AABB a, AABB b, int axis)
+{
+    return axis_value(a.min, axis) + axis_value(a.max, axis) > axis_value(b.min, axis) + axis_value(b.max, axis);
+}
+
+// sphere_indices as filled by the builder, or NULL if spheres is already in leaf order
+LinearBVH* bvh_flatten(const BVHNode* root, Sphere* spheres, const int* sphere_indices);
+void free_linear_bvh(LinearBVH* bvh);
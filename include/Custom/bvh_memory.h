@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stddef.h>
+#include "Custom/bvh.h"
+#include "Custom/bvh_linear.h"
+
+#define BVH_HUGE_PAGE_BYTES (2 * 1024 * 1024)
+#define BVH_LARGE_ALLOC_MIN_BYTES BVH_HUGE_PAGE_BYTES   // smaller arrays come from malloc()
+#define BVH_MAX_NUMA_NODES 64
+
+// Page size behind large arrays
+typedef enum BVHHugePages {
+    BVH_HUGE_PAGES_OFF,         // regular 4 KiB pages
+    BVH_HUGE_PAGES_TRANSPARENT, // transparent huge pages requested with madvise()
+    BVH_HUGE_PAGES_EXPLICIT,    // reserved 2 MiB pages (MAP_HUGETLB), transparent ones if none are free
+} BVHHugePages;
+
+// Placement of large arrays over the NUMA nodes
+typedef enum BVHNumaPlacement {
+    BVH_NUMA_FIRST_TOUCH,       // the node of the thread touching a page first, the kernel default
+    BVH_NUMA_INTERLEAVE,        // pages spread round robin over all nodes
+} BVHNumaPlacement;
+
+typedef struct BVHMemoryPolicy {
+    BVHHugePages huge_pages;
+    BVHNumaPlacement placement;
+} BVHMemoryPolicy;
+
+// The policy of later allocations. Read once from the environment (BVH_HUGE_PAGES=off|thp|2mb,
+// BVH_NUMA=local|interleave), transparent huge pages interleaved over the nodes otherwise.
+BVHMemoryPolicy bvh_memory_policy();
+void bvh_set_memory_policy(BVHMemoryPolicy policy);
+
+// Arrays of the trees, the leaf ordered spheres and the framebuffer, see bvh_memory.c. Memory from
+// bvh_alloc_large() is 64 byte aligned and must go back through bvh_free_large().
+void* bvh_alloc_large(size_t bytes);
+// As bvh_alloc_large(), with the pages placed on one NUMA node
+void* bvh_alloc_large_on_node(size_t bytes, int node);
+void bvh_free_large(void* memory);
+
+// NUMA topology, a machine without NUMA support is one node
+int bvh_numa_node_count();
+int bvh_numa_current_node();
+
+// CPU affinity of the calling thread, saved by bvh_pin_thread_to_node() and put back by
+// bvh_restore_thread_affinity(). Pinning returns 1 on success.
+typedef struct BVHThreadAffinity {
+    unsigned long long cpus[16];    // a cpu_set_t
+    int saved;
+} BVHThreadAffinity;
+
+int bvh_pin_thread_to_node(int node, BVHThreadAffinity* previous);
+void bvh_restore_thread_affinity(const BVHThreadAffinity* previous);
+
+// One copy of a flattened BVH and its spheres per NUMA node, for threads to trace the copy on
+// their own node. The source can be freed afterwards.
+typedef struct BVHReplicas {
+    int count;
+    LinearBVH replicas[BVH_MAX_NUMA_NODES];
+    void* memory[BVH_MAX_NUMA_NODES];
+} BVHReplicas;
+
+BVHReplicas* bvh_replicate(const LinearBVH* bvh);
+// The replica on node, the first one for nodes without a replica
+const LinearBVH* bvh_replica_for_node(const BVHReplicas* replicas, int node);
+void free_bvh_replicas(BVHReplicas* replicas);
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "Custom/bvh.h"
+
+#define BVH_TREELET_LEAVES 7
+#define BVH_DEFAULT_TREELET_PASSES 3
+#define BVH_DEFAULT_INSERTION_PASSES 16
+#define BVH_DEFAULT_INSERTION_BATCH 0.01f
+
+typedef struct BVHInsertionParams {
+    int max_passes;         // stops earlier once a pass no longer lowers the SAH cost
+    float batch_fraction;   // share of the internal nodes removed and reinserted per pass
+    int rotations;          // 1 = tree rotations after every pass
+    int report;             // 1 = print the SAH cost before and after every pass
+} BVHInsertionParams;
+
+void bvh_optimize_treelets(BVHNode* root, int passes, int num_threads);
+BVHInsertionParams bvh_default_insertion_params();
+// Returns the SAH cost of the optimized tree, NULL params means defaults
+float bvh_optimize_insertion(BVHNode* root, const BVHInsertionParams* params);
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "Custom/bvh.h"
+
+#define BVH_OOC_MIN_BUDGET ((size_t)1 << 20)
+#define BVH_OOC_DEFAULT_BUDGET ((size_t)1 << 30)
+// Working memory of an in-memory bucket build per sphere: the sphere and its index, two primitive
+// references, up to two tree nodes and two flattened nodes, with room for the sweep builder's lists
+#define BVH_OOC_BYTES_PER_SPHERE 320
+// Resident set growth allowed above the budget for what the build cannot reserve: thread stacks,
+// code and library pages
+#define BVH_OOC_RSS_ALLOWANCE ((size_t)8 << 20)
+
+typedef struct BVHOutOfCoreParams {
+    BVHBuildParams build;           // builder of the buckets that fit into memory
+    size_t memory_budget;           // bytes of working memory the build may reserve at once
+    const char* scratch_directory;  // bucket files, NULL for the current directory
+} BVHOutOfCoreParams;
+
+typedef struct BVHOutOfCoreStats {
+    int sphere_count;
+    int bucket_count;
+    int partition_passes;   // streaming passes that split a file into Morton buckets
+    int depth;
+    size_t peak_reserved;   // most working memory reserved at once, never above the budget
+    long peak_rss_kb;       // peak resident set of the whole process, 0 where unknown
+    long rss_growth_kb;     // peak resident set during the build over the one at its start, -1 where unknown
+} BVHOutOfCoreStats;
+
+BVHOutOfCoreParams bvh_out_of_core_default_params();
+
+// Builds the tree of the spheres in sphere_path, a raw array of Sphere, without ever holding more
+// than the memory budget, and writes it as a BVH cache file to output_path. Fails, leaving no file,
+// if a reservation would exceed the budget or the resident set grew by more than the budget plus
+// BVH_OOC_RSS_ALLOWANCE. bvh_cache_open() maps the result with the returned key, which differs
+// from bvh_cache_key() of the same spheres and parameters and depends on the budget. stats may be
+// NULL. Returns 1 on success.
+int bvh_build_out_of_core(const char* sphere_path, const char* output_path, const BVHOutOfCoreParams* params,
+                          uint64_t* key, BVHOutOfCoreStats* stats);
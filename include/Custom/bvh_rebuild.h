@@ -0,0 +1,42 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+#include "Custom/bvh.h"
+#include "Custom/bvh_linear.h"
+
+// Everything a frame traces through, built together and freed together once the last reference
+// is released
+typedef struct BVHSnapshot {
+    BVHNode* root;
+    int* sphere_indices;
+    Sphere* leaf_spheres;   // the spheres in leaf order, traced by bvh
+    LinearBVH* bvh;
+    int sphere_count;
+    float build_cost;       // SAH cost right after the build
+    double build_time;      // seconds
+    SDL_atomic_t references;
+} BVHSnapshot;
+
+// Returns a snapshot holding one reference, NULL on failure
+BVHSnapshot* bvh_snapshot_build(const Sphere* spheres, int num_spheres, const BVHBuildParams* params);
+BVHSnapshot* bvh_snapshot_retain(BVHSnapshot* snapshot);
+void bvh_snapshot_release(BVHSnapshot* snapshot);
+
+// Rebuilds on a worker thread while the render loop keeps tracing the current snapshot, see
+// bvh_rebuild.c
+typedef struct BVHRebuildService BVHRebuildService;
+
+// Takes over the caller's reference to initial. params is copied, NULL means the defaults.
+BVHRebuildService* bvh_rebuild_service_create(BVHSnapshot* initial, const BVHBuildParams* params);
+// Waits for a build in flight, then releases the service's references
+void bvh_rebuild_service_destroy(BVHRebuildService* service);
+
+// Queues a rebuild over a copy of the spheres and returns at once. A request made while another
+// one is still waiting replaces it. Returns 1 if the request was queued.
+int bvh_rebuild_request(BVHRebuildService* service, const Sphere* spheres, int num_spheres);
+// 1 while a requested tree has not been swapped in yet
+int bvh_rebuild_pending(BVHRebuildService* service);
+// Called at frame boundaries: makes the newest finished tree current and returns 1 if there was one
+int bvh_rebuild_swap(BVHRebuildService* service);
+// The current snapshot with a reference for the caller, who releases it once the frame is done
+BVHSnapshot* bvh_rebuild_acquire(BVHRebuildService* service);
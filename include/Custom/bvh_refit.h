@@ -0,0 +1,24 @@
+#pragma once
+
+#include "Custom/bvh.h"
+#include "Custom/bvh_linear.h"
+
+// Rebuild once a refitted tree is expected to trace this much slower than a fresh build
+#define BVH_DEFAULT_REBUILD_RATIO 1.3f
+
+// SAH cost of a refitted tree relative to the tree it was built as
+typedef struct BVHRefitTracker {
+    float build_cost;       // SAH cost right after the last build
+    float cost;             // SAH cost after the latest refit
+    float rebuild_ratio;    // a rebuild is due once cost exceeds build_cost * rebuild_ratio
+    int refits;             // refits since the last build
+} BVHRefitTracker;
+
+// Both refits return the SAH cost of the refitted tree, as bvh_sah_cost() would
+float bvh_refit(BVHNode* root, const Sphere* spheres, const int* sphere_indices, int num_threads);
+float bvh_refit_linear(LinearBVH* bvh, int num_threads);
+
+// rebuild_ratio <= 1 means BVH_DEFAULT_REBUILD_RATIO
+BVHRefitTracker bvh_refit_tracker(float build_cost, float rebuild_ratio);
+// Records the cost of a refit, returns 1 once the tree should be rebuilt
+int bvh_refit_needs_rebuild(BVHRefitTracker* tracker, float cost);
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "Custom/bvh.h"
+
+// Pieces shared by the code that edits trees in place: the insertion optimizer (bvh_optimize.c),
+// the dynamic BVH (bvh_dynamic.c) and the treelet layout (bvh_layout.c). Nodes are plain ids here,
+// each caller maps them onto its own tree representation.
+
+typedef struct BVHHeapEntry {
+    float cost;
+    int node;
+} BVHHeapEntry;
+
+// Binary min heap by cost, the caller provides room for every entry it pushes
+void bvh_heap_push(BVHHeapEntry* heap, int* size, BVHHeapEntry entry);
+BVHHeapEntry bvh_heap_pop(BVHHeapEntry* heap, int* size);
+
+// Branch and bound search for the node whose new parent, holding it and box, adds the least area
+// to the tree: the area of the new parent plus the growth of every ancestor. Nodes are visited
+// cheapest induced area first; a subtree is skipped once the area its root has to grow by, plus the
+// area of box itself, exceeds the best cost found so far. Driven by the caller:
+//     bvh_sibling_search_start(&search, heap, root, box);
+//     while ((node = bvh_sibling_search_next(&search)) >= 0)
+//         if (bvh_sibling_search_visit(&search, node, bounds of node, node is internal))
+//             bvh_sibling_search_push() both children of node
+//     search.best is the result
+// The heap needs room for every node that can be pushed, and may be moved by the caller between
+// calls as long as search.heap follows it.
+typedef struct BVHSiblingSearch {
+    BVHHeapEntry* heap;
+    int size;
+    AABB box;
+    float box_area;
+    float cost;             // area induced above the node being visited
+    float best_cost;
+    int best;
+} BVHSiblingSearch;
+
+void bvh_sibling_search_start(BVHSiblingSearch* search, BVHHeapEntry* heap, int root, AABB box);
+// Next node to visit, -1 once no node left can beat the best one
+int bvh_sibling_search_next(BVHSiblingSearch* search);
+// Returns 1 if the children of the visited node are worth pushing
+int bvh_sibling_search_visit(BVHSiblingSearch* search, int node, AABB bounds, int internal);
+void bvh_sibling_search_push(BVHSiblingSearch* search, int child);
+
+// Tree rotation at a node whose children have the given bounds, grandchildren[c] pointing at the
+// bounds of the two children of child c, NULL if that child is a leaf. Picks the swap of a child
+// with a grandchild below the other child that shrinks the other child the most. Returns 0 if none
+// does, otherwise 1 with the side of the child (0 left, 1 right) and of the grandchild it swaps with.
+int bvh_best_rotation(const AABB children[2], const AABB* grandchildren[2], int* side, int* grandchild);
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+#include "Custom/bvh.h"
+#include "Custom/bvh_linear.h"
+
+#define BVH_STATS_MAX_DEPTH 128     // depth histogram bins, the last one counts every deeper leaf
+#define BVH_STATS_LEAF_BINS 17      // leaf occupancy bins 0 to 16 spheres, the last one counts larger leaves
+
+// Quality and memory of one tree, see bvh_stats.c. Bytes count the nodes and sphere indices of the
+// tree, not the spheres themselves.
+typedef struct BVHStats {
+    int node_count;
+    int interior_count;
+    int leaf_count;
+    int empty_leaf_count;   // leaves without spheres (build_bvh_node())
+    int sphere_count;       // sphere slots of all leaves
+    int depth;              // of the deepest leaf, the root has depth 1
+    int min_leaf_size;      // over the leaves that hold spheres
+    int max_leaf_size;
+    double mean_leaf_size;
+    double mean_leaf_depth; // weighted by sphere count, the depth an average sphere is found at
+    float sah_cost;         // as bvh_sah_cost()
+    float epo;              // end-point overlap, relative to the total sphere area
+    double overlap_volume;  // volume shared by the two children, summed over interior nodes
+    double overlap_ratio;   // overlap_volume relative to the summed volume of those nodes
+    size_t node_bytes;
+    size_t index_bytes;
+    size_t total_bytes;
+    double bytes_per_sphere;
+    int depth_histogram[BVH_STATS_MAX_DEPTH];   // leaves per depth, depth 1 in bin 0
+    int leaf_histogram[BVH_STATS_LEAF_BINS];    // leaves per sphere count
+} BVHStats;
+
+// Both return 1 on success. sphere_indices as filled by the builder, or NULL if spheres is already
+// in leaf order.
+int bvh_stats(const BVHNode* root, const Sphere* spheres, const int* sphere_indices, BVHStats* stats);
+int bvh_linear_stats(const LinearBVH* bvh, BVHStats* stats);
+
+// Human readable report, and one JSON object on a single line; label may be NULL
+void bvh_stats_print(FILE* out, const char* label, const BVHStats* stats);
+void bvh_stats_print_json(FILE* out, const char* label, const BVHStats* stats);
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include "Custom/bvh.h"
+
+#define WIDE_BVH_MAX_WIDTH 8
+#define WIDE_BVH_STACK_SIZE 512
+
+// Child slots of a wide node
+#define WIDE_BVH_INTERIOR 0     // count of an interior child, its child entry is a node index
+#define WIDE_BVH_EMPTY -1       // count of an unused slot, its bounds are inverted so no ray hits it
+
+typedef struct WideBVHSlot {
+    int32_t child;          // interior child: node index, leaf child: first sphere slot
+    int32_t count;          // leaf child: number of spheres, otherwise WIDE_BVH_INTERIOR or WIDE_BVH_EMPTY
+} WideBVHSlot;
+
+// Every node has width child slots. The child bounds of a node are stored as six rows of width
+// floats (min x, y, z, max x, y, z), so one SIMD load fetches one plane of all children.
+typedef struct WideBVH {
+    int width;              // 4 or 8
+    int node_count;
+    int depth;
+    float* bounds;          // 6 * width floats per node
+    WideBVHSlot* slots;     // width slots per node
+    Sphere* spheres;
+    int* sphere_indices;    // sphere of every leaf slot, NULL if leaf offsets index spheres directly
+} WideBVH;
+
+// sphere_indices as filled by the builder, or NULL if spheres is already in leaf order
+WideBVH* bvh_collapse_wide(const BVHNode* root, Sphere* spheres, const int* sphere_indices, int width);
+void free_wide_bvh(WideBVH* bvh);
@@ -4,6 +4,11 @@
 #include "ray.h"
 #include "sphere.h"
 #include "bvh.h"
+#include "bvh_linear.h"
+#include "bvh_wide.h"
+#include "bvh_compressed.h"
+#include "bvh_instance.h"
+#include "bvh_layout.h"
 
 typedef struct {
     float t;
@@ -13,6 +18,18 @@ typedef struct {
     Sphere *object;
 } HitRecord;
 
+// Work done by ray_bvh_intersect_counted(), accumulated over every ray traced with the same counts
+typedef struct {
+    long long node_tests;
+    long long sphere_tests;
+} BVHTraceCounts;
+
 HitRecord ray_sphere_intersect(Ray ray, Sphere *sphere);
 int ray_aabb_intersect(Ray ray, AABB box);
-HitRecord ray_bvh_intersect(Ray ray, BVHNode* node);
\ No newline at end of file
+HitRecord ray_bvh_node_intersect(Ray ray, BVHNode* node, Sphere* spheres, const int* sphere_indices);
+HitRecord ray_bvh_intersect(Ray ray, const LinearBVH* bvh);
+HitRecord ray_bvh_intersect_counted(Ray ray, const LinearBVH* bvh, BVHTraceCounts* counts);
+HitRecord ray_clustered_bvh_intersect(Ray ray, const ClusteredBVH* bvh);
+HitRecord ray_wide_bvh_intersect(Ray ray, const WideBVH* bvh);
+HitRecord ray_compressed_bvh_intersect(Ray ray, const CompressedBVH* bvh);
+HitRecord ray_tlas_intersect(Ray ray, const TLAS* tlas);
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+#include "Custom/vec3.h"
+#include "Custom/bvh.h"
+
+// Morton (Z-order) codes of points quantized to a grid over the given bounds.
+// 30-bit codes use 10 bits per axis, 63-bit codes use 21 bits per axis.
+#define MORTON_BITS_30 30
+#define MORTON_BITS_63 63
+
+uint64_t morton_encode(Vec3 point, AABB bounds, int bits);
+void morton_encode_spheres(const Sphere* spheres, int num_spheres, AABB centroid_bounds, int bits, uint64_t* codes);
+AABB sphere_centroid_bounds(const Sphere* spheres, int num_spheres);
+// Both return 0, with codes and values left as they were, if the sort scratch cannot be allocated
+int morton_radix_sort(uint64_t* codes, int* values, int count, int bits);
+int morton_sort_spheres(const Sphere* spheres, int num_spheres, int bits, uint64_t* codes, int* order);
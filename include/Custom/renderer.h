@@ -3,6 +3,6 @@
 #include <SDL2/SDL.h>
 #include "Custom/ray.h"
 #include "Custom/sphere.h"
-#include "Custom/bvh.h"
+#include "Custom/bvh_linear.h"
 
-SDL_Color trace_ray(Ray ray, Sphere *spheres, int num_spheres, int depth, BVHNode* bvh);
\ No newline at end of file
+SDL_Color trace_ray(Ray ray, Sphere *spheres, int num_spheres, int depth, const LinearBVH* bvh);
\ No newline at end of file
@@ -2,12 +2,25 @@
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <SDL2/SDL_image.h>
 #include "Custom/benchmark.h"
 #include "Custom/hit.h"
+#include "Custom/bvh_optimize.h"
+#include "Custom/bvh_dynamic.h"
+#include "Custom/bvh_cache.h"
+#include "Custom/bvh_outofcore.h"
+#include "Custom/bvh_autotune.h"
+#include "Custom/bvh_stats.h"
+#include "Custom/bvh_layout.h"
+#include "Custom/bvh_memory.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #ifndef GNUPLOT_PATH
 #define GNUPLOT_PATH "gnuplot"
@@ -78,13 +91,10 @@ void run_gnuplot(void)
     }
 }
 
-void free_bvh(BVHNode *node)
+// Wall clock time, clock() would add up the CPU time of every build thread
+static double get_wall_time(void)
 {
-    if (!node)
-        return;
-    free_bvh(node->left);
-    free_bvh(node->right);
-    free(node);
+    return (double)SDL_GetPerformanceCounter() / (double)SDL_GetPerformanceFrequency();
 }
 
 void create_gnuplot_script(const char *data_filename)
@@ -222,7 +232,7 @@ double benchmark_no_bvh(Sphere *spheres, int num_spheres, int num_rays)
     return time_spent;
 }
 
-double benchmark_with_bvh(BVHNode *root, int num_spheres, int num_rays)
+double benchmark_with_bvh(const LinearBVH *bvh, int num_spheres, int num_rays)
 {
     clock_t start = clock();
     int intersections = 0;
@@ -239,7 +249,7 @@ double benchmark_with_bvh(BVHNode *root, int num_spheres, int num_rays)
             {0, 0, 0},
             dir};
 
-        HitRecord hit = ray_bvh_intersect(ray, root);
+        HitRecord hit = ray_bvh_intersect(ray, bvh);
         if (hit.hit_something)
             intersections++;
     }
@@ -254,6 +264,914 @@ double benchmark_with_bvh(BVHNode *root, int num_spheres, int num_rays)
     return time_spent;
 }
 
+// Build time and traversal throughput of the builders on the same scene. The builders leave the
+// spheres untouched, so all of them share one array and trace through their sphere indices.
+void benchmark_builders(Sphere *spheres, int num_spheres, int num_rays)
+{
+    static const struct
+    {
+        BVHBuilder builder;
+        const char *name;
+        int treelet_passes;
+        int insertion;
+    } builders[] = {
+        {BVH_BUILDER_BINNED, "Binned SAH", 0, 0},
+        {BVH_BUILDER_PLOC, "PLOC", 0, 0},
+        {BVH_BUILDER_PLOC, "PLOC+TRBVH", BVH_DEFAULT_TREELET_PASSES, 0},
+        {BVH_BUILDER_LBVH, "LBVH+insert", 0, 1},
+    };
+
+    int *sphere_indices = malloc(num_spheres * sizeof(int));
+    printf("Builder comparison:\n");
+
+    for (int b = 0; b < sizeof(builders) / sizeof(builders[0]); b++)
+    {
+        BVHBuildParams params = bvh_default_build_params();
+        params.builder = builders[b].builder;
+
+        double start = get_wall_time();
+        BVHNode *root = build_bvh(spheres, num_spheres, &params, sphere_indices);
+        bvh_optimize_treelets(root, builders[b].treelet_passes, params.num_threads);
+        if (builders[b].insertion)
+        {
+            BVHInsertionParams insertion = bvh_default_insertion_params();
+            insertion.report = 1;
+            bvh_optimize_insertion(root, &insertion);
+        }
+        LinearBVH *bvh = bvh_flatten(root, spheres, sphere_indices);
+        double build_time = get_wall_time() - start;
+        if (!bvh)
+        {
+            printf("%-12s skipped, the tree does not flatten\n", builders[b].name);
+            free_bvh(root);
+            continue;
+        }
+
+        start = get_wall_time();
+        for (int i = 0; i < num_rays; i++)
+        {
+            Vec3 dir = {
+                (float)rand() / RAND_MAX * 2 - 1,
+                (float)rand() / RAND_MAX * 2 - 1,
+                (float)rand() / RAND_MAX * 2 - 1};
+            Ray ray = {{0, 0, 0}, vec3_normalize(dir)};
+            ray_bvh_intersect(ray, bvh);
+        }
+        double trace_time = get_wall_time() - start;
+        BVHStats stats;
+        bvh_linear_stats(bvh, &stats);
+        free_linear_bvh(bvh);
+
+        start = get_wall_time();
+        free_bvh(root);
+        double free_time = get_wall_time() - start;
+
+        printf("%-12s build: %f seconds, free: %f seconds, SAH cost: %.2f, EPO: %.2f, nodes: %d, %.1f bytes/sphere, traversal: %.0f rays/second\n",
+               builders[b].name, build_time, free_time, stats.sah_cost, stats.epo, stats.node_count,
+               stats.bytes_per_sphere, num_rays / trace_time);
+    }
+    printf("\n");
+    free(sphere_indices);
+}
+
+// Traversal throughput of the binary, 4-wide and 8-wide layouts of the same tree, on the same rays.
+// The wide and compressed layouts must find the closest hits of ray_bvh_intersect().
+void benchmark_wide_bvh(BVHNode *root, Sphere *spheres, const int *sphere_indices, int num_rays)
+{
+    Ray *rays = malloc(num_rays * sizeof(Ray));
+    HitRecord *expected = malloc(num_rays * sizeof(HitRecord));
+    for (int i = 0; i < num_rays; i++)
+    {
+        Vec3 dir = {
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1};
+        rays[i] = (Ray){{0, 0, 0}, vec3_normalize(dir)};
+    }
+
+    printf("Wide BVH traversal:\n");
+    LinearBVH *bvh = bvh_flatten(root, spheres, sphere_indices);
+    double start = get_wall_time();
+    if (bvh)
+    {
+        for (int i = 0; i < num_rays; i++)
+        {
+            expected[i] = ray_bvh_intersect(rays[i], bvh);
+        }
+        printf("BVH2: %.0f rays/second\n", num_rays / (get_wall_time() - start));
+        free_linear_bvh(bvh);
+    }
+    else
+    {
+        // The pointer tree finds the same hits, it is just not timed
+        printf("BVH2: skipped, the tree does not flatten\n");
+        for (int i = 0; i < num_rays; i++)
+        {
+            expected[i] = ray_bvh_node_intersect(rays[i], root, spheres, sphere_indices);
+        }
+    }
+
+    for (int width = 4; width <= WIDE_BVH_MAX_WIDTH; width *= 2)
+    {
+        WideBVH *wide = bvh_collapse_wide(root, spheres, sphere_indices, width);
+        if (!wide)
+        {
+            printf("BVH%d: skipped, the tree does not collapse\n", width);
+            continue;
+        }
+        int mismatches = 0;
+        start = get_wall_time();
+        for (int i = 0; i < num_rays; i++)
+        {
+            HitRecord hit = ray_wide_bvh_intersect(rays[i], wide);
+            if (hit.hit_something != expected[i].hit_something || hit.t != expected[i].t)
+                mismatches++;
+        }
+        printf("BVH%d: %.0f rays/second (%d nodes, depth %d, %d mismatches)\n", width,
+               num_rays / (get_wall_time() - start), wide->node_count, wide->depth, mismatches);
+        free_wide_bvh(wide);
+    }
+
+    CompressedBVH *compressed = bvh_compress(root, spheres, sphere_indices);
+    if (compressed)
+    {
+        int mismatches = 0;
+        start = get_wall_time();
+        for (int i = 0; i < num_rays; i++)
+        {
+            HitRecord hit = ray_compressed_bvh_intersect(rays[i], compressed);
+            if (hit.hit_something != expected[i].hit_something || hit.t != expected[i].t)
+                mismatches++;
+        }
+        printf("Compressed BVH8: %.0f rays/second (%d nodes, %.2f bytes/sphere, %d mismatches)\n",
+               num_rays / (get_wall_time() - start), compressed->node_count,
+               (double)compressed_bvh_bytes(compressed) / compressed->index_count, mismatches);
+        free_compressed_bvh(compressed);
+    }
+    else
+    {
+        printf("Compressed BVH8: skipped, the tree does not compress\n");
+    }
+    printf("\n");
+    free(expected);
+    free(rays);
+}
+
+// Depth-first flattened tree against the same tree re-laid out in sibling pairs. Every layout must
+// find the same closest hits, only the node fetches differ.
+void benchmark_node_layouts(const LinearBVH *bvh, int num_rays)
+{
+    Ray *rays = malloc(num_rays * sizeof(Ray));
+    HitRecord *expected = malloc(num_rays * sizeof(HitRecord));
+    for (int i = 0; i < num_rays; i++)
+    {
+        Vec3 dir = {
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1};
+        rays[i] = (Ray){{0, 0, 0}, vec3_normalize(dir)};
+    }
+
+    printf("Node layouts:\n");
+    double start = get_wall_time();
+    for (int i = 0; i < num_rays; i++)
+    {
+        expected[i] = ray_bvh_intersect(rays[i], bvh);
+    }
+    printf("Linear: %.0f rays/second\n", num_rays / (get_wall_time() - start));
+
+    for (int layout = 0; layout < BVH_LAYOUT_COUNT; layout++)
+    {
+        ClusteredBVH *clustered = bvh_cluster_layout(bvh, (BVHNodeLayout)layout);
+        if (!clustered)
+        {
+            printf("%s: could not lay out the nodes\n", bvh_layout_name((BVHNodeLayout)layout));
+            continue;
+        }
+        int mismatches = 0;
+        start = get_wall_time();
+        for (int i = 0; i < num_rays; i++)
+        {
+            HitRecord hit = ray_clustered_bvh_intersect(rays[i], clustered);
+            if (hit.hit_something != expected[i].hit_something || hit.t != expected[i].t)
+                mismatches++;
+        }
+        printf("%s: %.0f rays/second (%d mismatches)\n", bvh_layout_name((BVHNodeLayout)layout),
+               num_rays / (get_wall_time() - start), mismatches);
+        free_clustered_bvh(clustered);
+    }
+    printf("\n");
+    free(expected);
+    free(rays);
+}
+
+// Multithreaded traversal of the shared tree, placed by the memory policy, against one replica per
+// NUMA node traced by threads pinned to that node. On a single node machine both read the same
+// kind of memory and only the huge pages differ from the kernel defaults.
+void benchmark_numa_traversal(const LinearBVH *bvh, int num_rays)
+{
+    Ray *rays = malloc(num_rays * sizeof(Ray));
+    HitRecord *expected = malloc(num_rays * sizeof(HitRecord));
+    for (int i = 0; i < num_rays; i++)
+    {
+        Vec3 dir = {
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1};
+        rays[i] = (Ray){{0, 0, 0}, vec3_normalize(dir)};
+    }
+
+    BVHBuildParams params = bvh_default_build_params();
+    int threads = bvh_thread_count(&params);
+    int nodes = bvh_numa_node_count();
+    BVHMemoryPolicy policy = bvh_memory_policy();
+    printf("Parallel traversal (%d threads, %d NUMA nodes, %s pages, %s):\n", threads, nodes,
+           policy.huge_pages == BVH_HUGE_PAGES_OFF ? "4 KiB" : policy.huge_pages == BVH_HUGE_PAGES_EXPLICIT ? "2 MiB" : "transparent huge",
+           policy.placement == BVH_NUMA_INTERLEAVE ? "interleaved" : "first touch");
+
+    double start = get_wall_time();
+#pragma omp parallel for num_threads(threads) schedule(dynamic, 64)
+    for (int i = 0; i < num_rays; i++)
+    {
+        expected[i] = ray_bvh_intersect(rays[i], bvh);
+    }
+    printf("Shared tree: %.0f rays/second\n", num_rays / (get_wall_time() - start));
+
+    start = get_wall_time();
+    BVHReplicas *replicas = bvh_replicate(bvh);
+    double replicate_time = get_wall_time() - start;
+    if (replicas)
+    {
+        int mismatches = 0;
+        start = get_wall_time();
+#pragma omp parallel num_threads(threads) reduction(+ : mismatches)
+        {
+            // Threads are spread evenly over the nodes and trace the replica of the node they run on
+            int node = 0;
+#ifdef _OPENMP
+            node = omp_get_thread_num() * nodes / omp_get_num_threads();
+#endif
+            BVHThreadAffinity previous;
+            bvh_pin_thread_to_node(node, &previous);
+            const LinearBVH *replica = bvh_replica_for_node(replicas, bvh_numa_current_node());
+#pragma omp for schedule(dynamic, 64)
+            for (int i = 0; i < num_rays; i++)
+            {
+                HitRecord hit = ray_bvh_intersect(rays[i], replica);
+                if (hit.hit_something != expected[i].hit_something || hit.t != expected[i].t)
+                    mismatches++;
+            }
+            bvh_restore_thread_affinity(&previous);
+        }
+        printf("Replicated per node: %.0f rays/second (%d replicas in %f seconds, %d mismatches)\n",
+               num_rays / (get_wall_time() - start), replicas->count, replicate_time, mismatches);
+        free_bvh_replicas(replicas);
+    }
+    printf("\n");
+    free(expected);
+    free(rays);
+}
+
+// Two level BVH over instanced clusters against one flat BVH over the same scene with every
+// instance expanded into its own spheres. Instances only rotate and scale uniformly, so every
+// expanded sphere is exact and both find the same intersections, up to grazing rays.
+void benchmark_instancing(int num_spheres, float world_size, int num_rays)
+{
+    enum
+    {
+        CLUSTER_COUNT = 16,
+        CLUSTER_SIZE = 64
+    };
+    const float cluster_extent = 10.0f;
+
+    int instance_count = num_spheres / CLUSTER_SIZE;
+    if (instance_count <= 0)
+        return;
+
+    Sphere *cluster_spheres = malloc(CLUSTER_COUNT * CLUSTER_SIZE * sizeof(Sphere));
+    for (int j = 0; j < CLUSTER_COUNT * CLUSTER_SIZE; j++)
+    {
+        Vec3 center = {
+            (float)rand() / RAND_MAX * cluster_extent - cluster_extent / 2,
+            (float)rand() / RAND_MAX * cluster_extent - cluster_extent / 2,
+            (float)rand() / RAND_MAX * cluster_extent - cluster_extent / 2};
+        cluster_spheres[j] = create_benchmark_sphere(center);
+    }
+
+    BVHBuildParams params = bvh_default_build_params();
+    BVHInstance *instances = malloc(instance_count * sizeof(BVHInstance));
+    BLAS *clusters[CLUSTER_COUNT];
+
+    double start = get_wall_time();
+    int blas_built = 1;
+    for (int c = 0; c < CLUSTER_COUNT; c++)
+    {
+        clusters[c] = bvh_build_blas(&cluster_spheres[c * CLUSTER_SIZE], CLUSTER_SIZE, &params);
+        blas_built = blas_built && clusters[c];
+    }
+    if (!blas_built)
+    {
+        printf("Instancing: skipped, a cluster BLAS failed to build\n\n");
+        for (int c = 0; c < CLUSTER_COUNT; c++)
+        {
+            free_blas(clusters[c]);
+        }
+        free(instances);
+        free(cluster_spheres);
+        return;
+    }
+    for (int i = 0; i < instance_count; i++)
+    {
+        Vec3 offset = {
+            (float)rand() / RAND_MAX * world_size - world_size / 2,
+            (float)rand() / RAND_MAX * world_size - world_size / 2,
+            (float)rand() / RAND_MAX * world_size - world_size / 2};
+        float yaw = (float)rand() / RAND_MAX * 6.2831853f;
+        float scale = 0.5f + (float)rand() / RAND_MAX;
+        instances[i].blas = clusters[i % CLUSTER_COUNT];
+        instances[i].object_to_world = transform_make(offset, yaw, scale);
+    }
+    TLAS *tlas = bvh_build_tlas(instances, instance_count, &params);
+    double instanced_build_time = get_wall_time() - start;
+
+    // The same scene with every instance expanded
+    int expanded_count = instance_count * CLUSTER_SIZE;
+    Sphere *expanded = malloc(expanded_count * sizeof(Sphere));
+    for (int i = 0; i < instance_count; i++)
+    {
+        const BLAS *blas = instances[i].blas;
+        float scale = vec3_len(transform_vector(&instances[i].object_to_world, (Vec3){1, 0, 0}));
+        for (int j = 0; j < blas->sphere_count; j++)
+        {
+            Sphere sphere = blas->spheres[j];
+            sphere.center = transform_point(&instances[i].object_to_world, sphere.center);
+            sphere.radius *= scale;
+            expanded[i * CLUSTER_SIZE + j] = sphere;
+        }
+    }
+
+    int *sphere_indices = malloc(expanded_count * sizeof(int));
+    start = get_wall_time();
+    BVHNode *root = build_bvh(expanded, expanded_count, &params, sphere_indices);
+    Sphere *leaf_spheres = bvh_compact_spheres(expanded, sphere_indices, expanded_count);
+    LinearBVH *flat = leaf_spheres ? bvh_flatten(root, leaf_spheres, NULL) : NULL;
+    double flat_build_time = get_wall_time() - start;
+    free_bvh(root);
+    if (!tlas || !flat)
+    {
+        printf("Instancing: skipped, the %s failed to build\n\n", tlas ? "flat BVH" : "TLAS");
+        free_linear_bvh(flat);
+        bvh_free_large(leaf_spheres);
+        free(sphere_indices);
+        free(expanded);
+        free_tlas(tlas);
+        for (int c = 0; c < CLUSTER_COUNT; c++)
+        {
+            free_blas(clusters[c]);
+        }
+        free(instances);
+        free(cluster_spheres);
+        return;
+    }
+
+    size_t instanced_bytes = bvh_tlas_bytes(tlas);
+    for (int c = 0; c < CLUSTER_COUNT; c++)
+    {
+        instanced_bytes += bvh_blas_bytes(clusters[c]);
+    }
+    size_t flat_bytes = sizeof(LinearBVH) + (size_t)flat->node_count * sizeof(LinearBVHNode) +
+                        (size_t)expanded_count * sizeof(Sphere);
+
+    Ray *rays = malloc(num_rays * sizeof(Ray));
+    for (int i = 0; i < num_rays; i++)
+    {
+        Vec3 dir = {
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1};
+        rays[i] = (Ray){{0, 0, 0}, vec3_normalize(dir)};
+    }
+
+    int instanced_hits = 0, flat_hits = 0;
+    start = get_wall_time();
+    for (int i = 0; i < num_rays; i++)
+    {
+        instanced_hits += ray_tlas_intersect(rays[i], tlas).hit_something;
+    }
+    double instanced_trace_time = get_wall_time() - start;
+    start = get_wall_time();
+    for (int i = 0; i < num_rays; i++)
+    {
+        flat_hits += ray_bvh_intersect(rays[i], flat).hit_something;
+    }
+    double flat_trace_time = get_wall_time() - start;
+
+    // Moving every instance only rebuilds the top level
+    for (int i = 0; i < instance_count; i++)
+    {
+        instances[i].object_to_world.m[1][3] += 1.0f;
+    }
+    start = get_wall_time();
+    bvh_update_tlas(tlas, &params);
+    double tlas_rebuild_time = get_wall_time() - start;
+
+    printf("Instancing (%d instances of %d clusters of %d spheres):\n", instance_count, CLUSTER_COUNT, CLUSTER_SIZE);
+    printf("Flat BVH:  build: %f seconds, %.1f MB, traversal: %.0f rays/second, intersections found: %d\n",
+           flat_build_time, flat_bytes / 1048576.0, num_rays / flat_trace_time, flat_hits);
+    printf("TLAS+BLAS: build: %f seconds, %.1f MB, traversal: %.0f rays/second, intersections found: %d\n",
+           instanced_build_time, instanced_bytes / 1048576.0, num_rays / instanced_trace_time, instanced_hits);
+    printf("TLAS rebuild after moving every instance: %f seconds\n\n", tlas_rebuild_time);
+
+    free(rays);
+    free_linear_bvh(flat);
+    bvh_free_large(leaf_spheres);
+    free(sphere_indices);
+    free(expanded);
+    free_tlas(tlas);
+    for (int c = 0; c < CLUSTER_COUNT; c++)
+    {
+        free_blas(clusters[c]);
+    }
+    free(instances);
+    free(cluster_spheres);
+}
+
+// Cold start with an empty cache directory against a warm start that maps the cached tree, and the
+// traversal of the mapped tree against a freshly built one on the same rays
+void benchmark_bvh_cache(Sphere *spheres, int num_spheres, int num_rays)
+{
+    BVHBuildParams params = bvh_default_build_params();
+    char path[1024];
+    bvh_cache_path(path, sizeof(path), ".", bvh_cache_key(spheres, num_spheres, &params));
+    remove(path);
+
+    double start = get_wall_time();
+    BVHCacheMapping *built = bvh_cache_load_or_build(".", spheres, num_spheres, &params);
+    double miss_time = get_wall_time() - start;
+    bvh_cache_close(built);
+
+    start = get_wall_time();
+    BVHCacheMapping *cached = bvh_cache_load_or_build(".", spheres, num_spheres, &params);
+    double hit_time = get_wall_time() - start;
+    if (!built || !cached)
+    {
+        printf("BVH cache: failed to build or map %s\n\n", path);
+        bvh_cache_close(cached);
+        remove(path);
+        return;
+    }
+
+    int *sphere_indices = malloc(num_spheres * sizeof(int));
+    BVHNode *root = build_bvh(spheres, num_spheres, &params, sphere_indices);
+    LinearBVH *bvh = bvh_flatten(root, spheres, sphere_indices);
+    if (!bvh)
+    {
+        printf("BVH cache: skipped, the in-memory tree does not flatten\n\n");
+        free_bvh(root);
+        free(sphere_indices);
+        bvh_cache_close(cached);
+        remove(path);
+        return;
+    }
+
+    int mismatches = 0;
+    double fresh_time = 0.0, mapped_time = 0.0;
+    for (int i = 0; i < num_rays; i++)
+    {
+        Vec3 dir = {
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1};
+        Ray ray = {{0, 0, 0}, vec3_normalize(dir)};
+
+        start = get_wall_time();
+        HitRecord fresh = ray_bvh_intersect(ray, bvh);
+        fresh_time += get_wall_time() - start;
+        start = get_wall_time();
+        HitRecord mapped = ray_bvh_intersect(ray, &cached->bvh);
+        mapped_time += get_wall_time() - start;
+
+        if (fresh.hit_something != mapped.hit_something || (fresh.hit_something && fresh.t != mapped.t))
+            mismatches++;
+    }
+
+    printf("BVH cache (%.1f MB file):\n", cached->size / 1048576.0);
+    printf("Cold start (build, save, map): %f seconds\n", miss_time);
+    printf("Warm start (hash, map): %f seconds\n", hit_time);
+    printf("Traversal: built %.0f rays/second, mapped %.0f rays/second, mismatches: %d\n\n",
+           num_rays / fresh_time, num_rays / mapped_time, mismatches);
+
+    free_linear_bvh(bvh);
+    free_bvh(root);
+    free(sphere_indices);
+    bvh_cache_close(cached);
+    remove(path);
+}
+
+// Out-of-core build under a budget of a sixteenth of what an in-memory build would take, against
+// the in-memory build of the same spheres on the same rays
+void benchmark_out_of_core(Sphere *spheres, int num_spheres, int num_rays)
+{
+    const char *sphere_path = "bvh_ooc_spheres.bin";
+    const char *tree_path = "bvh_ooc_tree.bvhcache";
+    FILE *file = fopen(sphere_path, "wb");
+    if (!file || fwrite(spheres, sizeof(Sphere), num_spheres, file) != (size_t)num_spheres)
+    {
+        printf("Out-of-core build: cannot write %s\n\n", sphere_path);
+        if (file)
+            fclose(file);
+        remove(sphere_path);
+        return;
+    }
+    fclose(file);
+
+    BVHOutOfCoreParams params = bvh_out_of_core_default_params();
+    params.memory_budget = (size_t)num_spheres * BVH_OOC_BYTES_PER_SPHERE / 16;
+    if (params.memory_budget < BVH_OOC_MIN_BUDGET)
+        params.memory_budget = BVH_OOC_MIN_BUDGET;
+
+    uint64_t key = 0;
+    BVHOutOfCoreStats stats;
+    double start = get_wall_time();
+    int built = bvh_build_out_of_core(sphere_path, tree_path, &params, &key, &stats);
+    double ooc_time = get_wall_time() - start;
+    BVHCacheMapping *mapped = built ? bvh_cache_open(tree_path, key) : NULL;
+    remove(sphere_path);
+    if (!mapped)
+    {
+        printf("Out-of-core build: failed to build or map %s\n\n", tree_path);
+        remove(tree_path);
+        return;
+    }
+
+    int *sphere_indices = malloc(num_spheres * sizeof(int));
+    start = get_wall_time();
+    BVHNode *root = build_bvh(spheres, num_spheres, &params.build, sphere_indices);
+    double in_core_time = get_wall_time() - start;
+    LinearBVH *bvh = bvh_flatten(root, spheres, sphere_indices);
+    if (!bvh)
+    {
+        printf("Out-of-core build: skipped, the in-memory tree does not flatten\n\n");
+        free_bvh(root);
+        free(sphere_indices);
+        bvh_cache_close(mapped);
+        remove(tree_path);
+        return;
+    }
+
+    int mismatches = 0;
+    double in_core_trace = 0.0, ooc_trace = 0.0;
+    for (int i = 0; i < num_rays; i++)
+    {
+        Vec3 dir = {
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1};
+        Ray ray = {{0, 0, 0}, vec3_normalize(dir)};
+
+        start = get_wall_time();
+        HitRecord in_core = ray_bvh_intersect(ray, bvh);
+        in_core_trace += get_wall_time() - start;
+        start = get_wall_time();
+        HitRecord ooc = ray_bvh_intersect(ray, &mapped->bvh);
+        ooc_trace += get_wall_time() - start;
+
+        if (in_core.hit_something != ooc.hit_something || (in_core.hit_something && in_core.t != ooc.t))
+            mismatches++;
+    }
+
+    printf("Out-of-core build (%.1f MB budget, %d buckets, %d partition passes, depth %d):\n",
+           params.memory_budget / 1048576.0, stats.bucket_count, stats.partition_passes, stats.depth);
+    printf("Build: out-of-core %f seconds, in-memory %f seconds\n", ooc_time, in_core_time);
+    printf("Peak reserved: %.1f MB, peak RSS of the process: %.1f MB, growth during the build: %.1f MB\n",
+           stats.peak_reserved / 1048576.0, stats.peak_rss_kb / 1024.0, stats.rss_growth_kb / 1024.0);
+    printf("Traversal: in-memory %.0f rays/second, out-of-core %.0f rays/second, mismatches: %d\n\n",
+           num_rays / in_core_trace, num_rays / ooc_trace, mismatches);
+
+    free_linear_bvh(bvh);
+    free_bvh(root);
+    free(sphere_indices);
+    bvh_cache_close(mapped);
+    remove(tree_path);
+}
+
+// Incremental updates of the dynamic BVH, per sphere: removals and single insertions into a binned
+// build over half of the spheres, then the rest as one batch, which rebuilds the upper levels. An
+// empty tree is also filled once by single insertions and once by one batch. The final trees are
+// traced on the same rays as a fresh build of all the spheres.
+void benchmark_dynamic_bvh(Sphere *spheres, int num_spheres, int num_rays)
+{
+    int built = num_spheres / 2;
+    int singles_end = num_spheres * 5 / 8;
+    int *sphere_indices = malloc(num_spheres * sizeof(int));
+    int *batch = malloc(num_spheres * sizeof(int));
+    BVHBuildParams params = bvh_default_build_params();
+    BVHNode *root = sphere_indices && batch ? build_bvh(spheres, built, &params, sphere_indices) : NULL;
+    // A failed bvh_make_dynamic() frees the tree it was given
+    DynamicBVH *tree = root ? bvh_make_dynamic(root, sphere_indices) : NULL;
+    DynamicBVH *singles = bvh_make_dynamic(NULL, NULL);
+    DynamicBVH *batched = bvh_make_dynamic(NULL, NULL);
+    if (!tree || !singles || !batched)
+    {
+        printf("Dynamic BVH: failed to build the trees\n\n");
+        free_dynamic_bvh(tree);
+        free_dynamic_bvh(singles);
+        free_dynamic_bvh(batched);
+        free(sphere_indices);
+        free(batch);
+        return;
+    }
+
+    // Removed spheres are inserted again with the batch
+    int ok = 1, count = 0;
+    double start = get_wall_time();
+    for (int i = 0; i < built && ok; i += 3)
+    {
+        ok = bvh_remove(tree, spheres, i);
+        batch[count++] = i;
+    }
+    double remove_time = (get_wall_time() - start) / count;
+    int removed = count;
+
+    start = get_wall_time();
+    for (int i = built; i < singles_end && ok; i++)
+    {
+        ok = bvh_insert(tree, spheres, i);
+    }
+    double insert_time = (get_wall_time() - start) / (singles_end - built);
+
+    for (int i = singles_end; i < num_spheres; i++)
+    {
+        batch[count++] = i;
+    }
+    start = get_wall_time();
+    ok = ok && bvh_insert_batch(tree, spheres, batch, count);
+    double batch_time = (get_wall_time() - start) / count;
+
+    start = get_wall_time();
+    for (int i = 0; i < num_spheres && ok; i++)
+    {
+        ok = bvh_insert(singles, spheres, i);
+    }
+    double empty_singles_time = (get_wall_time() - start) / num_spheres;
+
+    for (int i = 0; i < num_spheres; i++)
+    {
+        batch[i] = i;
+    }
+    start = get_wall_time();
+    ok = ok && bvh_insert_batch(batched, spheres, batch, num_spheres);
+    double empty_batch_time = (get_wall_time() - start) / num_spheres;
+
+    start = get_wall_time();
+    BVHNode *fresh = ok ? build_bvh(spheres, num_spheres, &params, sphere_indices) : NULL;
+    double build_time = (get_wall_time() - start) / num_spheres;
+
+    LinearBVH *fresh_bvh = fresh ? bvh_flatten(fresh, spheres, sphere_indices) : NULL;
+    LinearBVH *updated_bvh = fresh_bvh ? bvh_flatten(tree->root, spheres, tree->sphere_indices) : NULL;
+    if (!updated_bvh)
+    {
+        printf("Dynamic BVH: skipped, an update failed or a tree does not flatten\n\n");
+        free_linear_bvh(fresh_bvh);
+        free_bvh(fresh);
+        free_dynamic_bvh(tree);
+        free_dynamic_bvh(singles);
+        free_dynamic_bvh(batched);
+        free(sphere_indices);
+        free(batch);
+        return;
+    }
+
+    int mismatches = 0;
+    double fresh_trace = 0.0, updated_trace = 0.0;
+    for (int i = 0; i < num_rays; i++)
+    {
+        Vec3 dir = {
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1};
+        Ray ray = {{0, 0, 0}, vec3_normalize(dir)};
+
+        start = get_wall_time();
+        HitRecord expected = ray_bvh_intersect(ray, fresh_bvh);
+        fresh_trace += get_wall_time() - start;
+        start = get_wall_time();
+        HitRecord updated = ray_bvh_intersect(ray, updated_bvh);
+        updated_trace += get_wall_time() - start;
+
+        if (expected.hit_something != updated.hit_something || (expected.hit_something && expected.t != updated.t))
+            mismatches++;
+    }
+
+    printf("Dynamic BVH (%d built, %d removed, %d inserted, then a batch of %d):\n", built, removed,
+           singles_end - built, count);
+    printf("Per sphere: remove %.2f us, insert %.2f us, batch %.2f us\n", remove_time * 1e6,
+           insert_time * 1e6, batch_time * 1e6);
+    printf("Empty tree, per sphere: single insertions %.2f us, one batch %.2f us, fresh build %.2f us\n",
+           empty_singles_time * 1e6, empty_batch_time * 1e6, build_time * 1e6);
+    printf("SAH cost: updated %.2f, single insertions %.2f, one batch %.2f, fresh build %.2f\n",
+           bvh_sah_cost(tree->root), bvh_sah_cost(singles->root), bvh_sah_cost(batched->root), bvh_sah_cost(fresh));
+    printf("Traversal: fresh %.0f rays/second, updated %.0f rays/second, mismatches: %d\n\n",
+           num_rays / fresh_trace, num_rays / updated_trace, mismatches);
+
+    free_linear_bvh(updated_bvh);
+    free_linear_bvh(fresh_bvh);
+    free_bvh(fresh);
+    free_dynamic_bvh(tree);
+    free_dynamic_bvh(singles);
+    free_dynamic_bvh(batched);
+    free(sphere_indices);
+    free(batch);
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// SAH cost calibration
+// Measures the relative cost of a node visit and a sphere test with the renderer's own traversal
+// kernel on this machine, instead of assuming one.
+// - One random scene is built with leaf sizes from 1 to 32 spheres, so the mix of node visits and
+//   sphere tests per ray shifts from tree to tree. Leaves are filled up to the leaf size by a
+//   prohibitive traversal cost during these builds.
+// - The same rays are traced through every tree: once counted (ray_bvh_intersect_counted()) for
+//   the node visits and sphere tests, then timed with the plain ray_bvh_intersect(), best of a few
+//   runs.
+// - Time per ray = traversal_cost * node visits + intersect_cost * sphere tests is fitted by least
+//   squares, and the model keeps the ratio with intersect_cost 1.
+
+//----------------------------------------------------------------------------------------------------
+
+#define CALIBRATION_LEAF_SIZES 6
+#define CALIBRATION_RUNS 3
+
+int calibrate_sah_cost_model(int num_spheres, int num_rays, BVHCostModel *model)
+{
+    float world_size = 1000.0f;
+    Sphere *spheres = malloc(num_spheres * sizeof(Sphere));
+    int *sphere_indices = malloc(num_spheres * sizeof(int));
+    Ray *rays = malloc(num_rays * sizeof(Ray));
+    for (int i = 0; i < num_spheres; i++)
+    {
+        Vec3 center = {
+            (float)rand() / RAND_MAX * world_size - world_size / 2,
+            (float)rand() / RAND_MAX * world_size - world_size / 2,
+            (float)rand() / RAND_MAX * world_size - world_size / 2};
+        spheres[i] = create_benchmark_sphere(center);
+    }
+    for (int i = 0; i < num_rays; i++)
+    {
+        Vec3 dir = {
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1};
+        rays[i] = (Ray){{0, 0, 0}, vec3_normalize(dir)};
+    }
+
+    BVHCostModel previous = bvh_cost_model();
+    bvh_set_cost_model((BVHCostModel){1e30f, 1.0f});
+
+    // Sums of the normal equations of the fit, counts and times per ray
+    double nn = 0.0, ns = 0.0, ss = 0.0, nt = 0.0, st = 0.0;
+    for (int l = 0; l < CALIBRATION_LEAF_SIZES; l++)
+    {
+        BVHBuildParams params = bvh_default_build_params();
+        params.max_leaf_size = 1 << l;
+        BVHNode *root = build_bvh(spheres, num_spheres, &params, sphere_indices);
+        LinearBVH *bvh = bvh_flatten(root, spheres, sphere_indices);
+        if (!bvh)
+        {
+            printf("Leaf size %2d: skipped, the tree does not flatten\n", params.max_leaf_size);
+            free_bvh(root);
+            continue;
+        }
+
+        BVHTraceCounts counts = {0, 0};
+        for (int i = 0; i < num_rays; i++)
+        {
+            ray_bvh_intersect_counted(rays[i], bvh, &counts);
+        }
+
+        double best = INFINITY;
+        for (int run = 0; run < CALIBRATION_RUNS; run++)
+        {
+            double start = get_wall_time();
+            for (int i = 0; i < num_rays; i++)
+            {
+                ray_bvh_intersect(rays[i], bvh);
+            }
+            double time = get_wall_time() - start;
+            best = time < best ? time : best;
+        }
+
+        double nodes = (double)counts.node_tests / num_rays;
+        double tests = (double)counts.sphere_tests / num_rays;
+        double time = best / num_rays * 1e9;
+        printf("Leaf size %2d: %8.1f node visits, %8.1f sphere tests, %8.1f ns per ray\n",
+               params.max_leaf_size, nodes, tests, time);
+        nn += nodes * nodes;
+        ns += nodes * tests;
+        ss += tests * tests;
+        nt += nodes * time;
+        st += tests * time;
+
+        free_linear_bvh(bvh);
+        free_bvh(root);
+    }
+    bvh_set_cost_model(previous);
+
+    free(rays);
+    free(sphere_indices);
+    free(spheres);
+
+    double determinant = nn * ss - ns * ns;
+    double node_time = (nt * ss - st * ns) / determinant;
+    double sphere_time = (st * nn - nt * ns) / determinant;
+    if (!(node_time > 0.0 && sphere_time > 0.0 && isfinite(node_time / sphere_time)))
+    {
+        printf("Calibration failed: node visit %.2f ns, sphere test %.2f ns\n", node_time, sphere_time);
+        return 0;
+    }
+
+    printf("Node visit: %.2f ns, sphere test: %.2f ns\n", node_time, sphere_time);
+    model->traversal_cost = (float)(node_time / sphere_time);
+    model->intersect_cost = 1.0f;
+    return 1;
+}
+
+// Calibrates the cost model, saves it as the profile every later build reads and uses it right away
+void run_cost_calibration()
+{
+    printf("SAH cost calibration:\n");
+    BVHCostModel model;
+    if (!calibrate_sah_cost_model(100000, 100000, &model))
+        return;
+
+    BVHCostModel previous = bvh_cost_model();
+    printf("Traversal cost: %.3f (was %.3f), intersection cost: %.3f\n", model.traversal_cost,
+           previous.traversal_cost / previous.intersect_cost, model.intersect_cost);
+    if (bvh_cost_model_save(BVH_COST_PROFILE_PATH, model))
+        printf("Saved to %s\n", BVH_COST_PROFILE_PATH);
+    else
+        printf("Could not write %s\n", BVH_COST_PROFILE_PATH);
+    bvh_set_cost_model(model);
+}
+
+// Tunes the build parameters on a benchmark scene mixing uniform noise with tight clusters, traced
+// by rays from its centre, and saves the winner for the realtime renderer
+void run_autotune()
+{
+    int num_spheres = 100000, num_rays = 20000, num_clusters = 32;
+    float world_size = 1000.0f, cluster_size = 20.0f;
+
+    Sphere *spheres = malloc(num_spheres * sizeof(Sphere));
+    Vec3 clusters[32];
+    for (int c = 0; c < num_clusters; c++)
+    {
+        clusters[c] = (Vec3){
+            (float)rand() / RAND_MAX * world_size - world_size / 2,
+            (float)rand() / RAND_MAX * world_size - world_size / 2,
+            (float)rand() / RAND_MAX * world_size - world_size / 2};
+    }
+    for (int i = 0; i < num_spheres; i++)
+    {
+        Vec3 offset = {
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1};
+        Vec3 center = i % 2 ? vec3_add(clusters[i % num_clusters], vec3_multiply(offset, cluster_size))
+                            : vec3_multiply(offset, world_size / 2);
+        spheres[i] = create_benchmark_sphere(center);
+    }
+
+    Ray *rays = malloc(num_rays * sizeof(Ray));
+    for (int i = 0; i < num_rays; i++)
+    {
+        Vec3 dir = {
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1,
+            (float)rand() / RAND_MAX * 2 - 1};
+        rays[i] = (Ray){{0, 0, 0}, vec3_normalize(dir)};
+    }
+
+    printf("BVH build parameter autotuning (%d spheres, %d rays):\n", num_spheres, num_rays);
+    BVHTuneResult result;
+    if (bvh_autotune(spheres, num_spheres, rays, num_rays, NULL, &result))
+    {
+        printf("Best of %d configurations: %s builder, %d bins, leaf size %d, depth %d\n", result.candidates,
+               bvh_builder_name(result.params.builder), result.params.bin_count, result.params.max_leaf_size,
+               result.params.max_depth);
+        printf("Traversal: %.0f rays/second (defaults: %.0f rays/second, %.2fx), build: %f seconds\n",
+               result.rays_per_second, result.default_rays_per_second,
+               result.rays_per_second / result.default_rays_per_second, result.build_time);
+        if (bvh_build_params_save(BVH_TUNED_PARAMS_PATH, &result.params))
+            printf("Saved to %s\n", BVH_TUNED_PARAMS_PATH);
+        else
+            printf("Could not write %s\n", BVH_TUNED_PARAMS_PATH);
+    }
+
+    free(rays);
+    free(spheres);
+}
+
 void print_sphere_info(Sphere *spheres, int num_spheres) {
     printf("\nSphere Distribution Info:\n");
     float min_x = INFINITY, max_x = -INFINITY;
@@ -284,6 +1202,7 @@ void run_benchmark_with_plotting()
 {
 
     remove("benchmark_data.txt");
+    remove("bvh_stats.jsonl");
     srand(time(NULL));
 
     int sphere_counts[10];
@@ -314,13 +1233,70 @@ void run_benchmark_with_plotting()
         }
         // print_sphere_info(spheres, num_spheres);
 
-        BVHNode *root = build_bvh_node(spheres, 0, num_spheres - 1, 20);
+        // Serial and parallel build of the same scene, the serial tree is only timed
+        BVHBuildParams params = bvh_default_build_params();
+        int *sphere_indices = malloc(num_spheres * sizeof(int));
+        params.num_threads = 1;
+        double build_start = get_wall_time();
+        BVHNode *root = build_bvh(spheres, num_spheres, &params, sphere_indices);
+        double serial_build_time = get_wall_time() - build_start;
+        free_bvh(root);
+
+        params.num_threads = 0;
+        build_start = get_wall_time();
+        root = build_bvh(spheres, num_spheres, &params, sphere_indices);
+        double parallel_build_time = get_wall_time() - build_start;
+
+        // Traced trees read a copy of the spheres in leaf order
+        Sphere *leaf_spheres = bvh_compact_spheres(spheres, sphere_indices, num_spheres);
+        LinearBVH *bvh = bvh_flatten(root, leaf_spheres, NULL);
+        if (!bvh)
+        {
+            printf("Skipped, the binned SAH tree does not flatten\n");
+            printf("----------------------------------------\n");
+            free_bvh(root);
+            bvh_free_large(leaf_spheres);
+            free(sphere_indices);
+            free(spheres);
+            continue;
+        }
+
+        printf("BVH build (binned SAH, %d bins):\n", params.bin_count);
+        printf("Serial: %f seconds\n", serial_build_time);
+        printf("Parallel (%d threads): %f seconds (%.2fx speedup)\n\n", bvh_thread_count(&params),
+               parallel_build_time, serial_build_time / parallel_build_time);
+
+        // Quality of the traced tree, also appended to the JSON lines file for later comparison
+        BVHStats stats;
+        char label[64];
+        snprintf(label, sizeof(label), "binned SAH, %d spheres", num_spheres);
+        if (bvh_linear_stats(bvh, &stats))
+        {
+            bvh_stats_print(stdout, label, &stats);
+            FILE *stats_file = fopen("bvh_stats.jsonl", "a");
+            if (stats_file)
+            {
+                bvh_stats_print_json(stats_file, label, &stats);
+                fclose(stats_file);
+            }
+        }
 
         double time_no_bvh = benchmark_no_bvh(spheres, num_spheres, num_rays);
-        double time_with_bvh = benchmark_with_bvh(root, num_spheres, num_rays);
+        double time_with_bvh = benchmark_with_bvh(bvh, num_spheres, num_rays);
+        benchmark_builders(spheres, num_spheres, num_rays);
+        benchmark_wide_bvh(root, leaf_spheres, NULL, num_rays);
+        benchmark_node_layouts(bvh, num_rays);
+        benchmark_numa_traversal(bvh, num_rays);
+        benchmark_instancing(num_spheres, world_size, num_rays);
+        benchmark_bvh_cache(spheres, num_spheres, num_rays);
+        benchmark_out_of_core(spheres, num_spheres, num_rays);
+        benchmark_dynamic_bvh(spheres, num_spheres, num_rays);
 
         save_benchmark_data("benchmark_data.txt", num_spheres, time_no_bvh, time_with_bvh);
+        free_linear_bvh(bvh);
         free_bvh(root);
+        bvh_free_large(leaf_spheres);
+        free(sphere_indices);
         free(spheres);
 
         printf("----------------------------------------\n");
@@ -1,11 +1,17 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include "Custom/bvh.h"
 #include "Custom/ray.h"
 #include "Custom/vec3.h"
 #include "Custom/hit.h"
 #include "Custom/constants.h"
+#include "Custom/bvh_memory.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 //----------------------------------------------------------------------------------------------------
 
@@ -23,7 +29,7 @@ AABB create_empty_aabb()
         {-INFINITY, -INFINITY, -INFINITY}};
 }
 
-AABB create_aabb_from_sphere(Sphere *sphere)
+AABB create_aabb_from_sphere(const Sphere *sphere)
 {
     return (AABB){
         {sphere->center.x - sphere->radius,
@@ -56,7 +62,10 @@ float get_aabb_surface_area(AABB box)
                    dimensions.z * dimensions.x);
 }
 
-float evaluate_sah(Sphere *spheres, int start, int end, int axis, float split)
+// Split cost in the form bvh_sah_prefers_leaf() takes: sphere count times surface area summed over
+// both sides. The traversal and intersection costs of the cost model are applied there, and leaving
+// out the parent's area does not change which plane is cheapest.
+float evaluate_sah(const Sphere *spheres, const int *sphere_indices, int start, int end, int axis, float split)
 {
     int left_count = 0, right_count = 0;
     AABB left_bounds = create_empty_aabb();
@@ -64,36 +73,37 @@ float evaluate_sah(Sphere *spheres, int start, int end, int axis, float split)
 
     for (int i = start; i < end; i++)
     {
+        const Sphere *sphere = &spheres[sphere_indices[i]];
         float center = 0;
         switch (axis)
         {
         case 0:
-            center = spheres[i].center.x;
+            center = sphere->center.x;
             break;
         case 1:
-            center = spheres[i].center.y;
+            center = sphere->center.y;
             break;
         case 2:
-            center = spheres[i].center.z;
+            center = sphere->center.z;
             break;
         }
 
         if (center < split)
         {
             left_count++;
-            left_bounds = combine_aabb(left_bounds, create_aabb_from_sphere(&spheres[i]));
+            left_bounds = combine_aabb(left_bounds, create_aabb_from_sphere(sphere));
         }
         else
         {
             right_count++;
-            right_bounds = combine_aabb(right_bounds, create_aabb_from_sphere(&spheres[i]));
+            right_bounds = combine_aabb(right_bounds, create_aabb_from_sphere(sphere));
         }
     }
 
     float left_sa = get_aabb_surface_area(left_bounds);
     float right_sa = get_aabb_surface_area(right_bounds);
 
-    return 0.125f + (left_count * left_sa + right_count * right_sa);
+    return left_count * left_sa + right_count * right_sa;
 }
 
 //----------------------------------------------------------------------------------------------------
@@ -101,10 +111,13 @@ float evaluate_sah(Sphere *spheres, int start, int end, int axis, float split)
 // BVH (Bounding Volume Hierarchy) construction using a top-down approach.
 // Top-Down BVH Construction :
 // - Root Node Creation : contains all spheres as AABB.
-// - Object Partition : AABB partition with Surface Area Heurestics (SAH).
+// - Object Partition : AABB partition with Surface Area Heurestics (SAH). The sphere indices are
+//                      partitioned, the spheres themselves stay where they are.
 // - Child Nodes Creation: Recursive creation and partitioning of child node.
-// - Repeat Until Leaf Nodes: Partioning until each subset contains a single sphere
-//                           or depth limit is reached (20 here)
+// - Repeat Until Leaf Nodes: Partioning until a leaf of up to BVH_DEFAULT_MAX_LEAF_SIZE spheres is
+//                           cheaper than the best split, a subset contains a single sphere
+//                           or the depth limit is reached (max_depth of the build parameters,
+//                           BVH_PLANES_MAX_DEPTH through build_bvh_node())
 
 //----------------------------------------------------------------------------------------------------
 
@@ -114,26 +127,34 @@ static void debug_aabb(AABB box, const char* label) {
            box.max.x, box.max.y, box.max.z);
 }
 
-BVHNode *build_bvh_node(Sphere *spheres, int start, int end, int depth)
+static BVHNode *make_leaf(BVHNode *node, int first, int count)
 {
-    BVHNode *node = (BVHNode *)malloc(sizeof(BVHNode));
+    node->left = node->right = NULL;
+    node->first = first;
+    node->sphere_count = count;
+    return node;
+}
+
+static BVHNode *build_planes_node(BVHNodeArena *arena, const Sphere *spheres, int *sphere_indices, int start,
+                                  int end, int depth, int max_depth, int max_leaf_size)
+{
+    BVHNode *node = bvh_arena_alloc_node(arena);
+    if (node == NULL)
+        return NULL;
     node->bounds = create_empty_aabb();
 
     for (int i = start; i < end; i++)
     {
-        node->bounds = combine_aabb(node->bounds, create_aabb_from_sphere(&spheres[i]));
+        node->bounds = combine_aabb(node->bounds, create_aabb_from_sphere(&spheres[sphere_indices[i]]));
     }
 
     int num_spheres = end - start;
     // debug_aabb(node->bounds, "Node bounds");
 
 
-    if (num_spheres <= 1 || depth >= 40) {
-        node->left = node->right = NULL;
-        node->sphere = &spheres[start];
-        node->sphere_count = num_spheres;
+    if (num_spheres <= 1 || depth >= max_depth) {
         // printf("Leaf node with %d spheres\n", num_spheres);
-        return node;
+        return make_leaf(node, start, num_spheres);
     }
 
     float best_cost = INFINITY;
@@ -158,7 +179,7 @@ BVHNode *build_bvh_node(Sphere *spheres, int start, int end, int depth)
                 split = node->bounds.min.z + (i / 8.0f) * (node->bounds.max.z - node->bounds.min.z);
             }
 
-            float cost = evaluate_sah(spheres, start, end, axis, split);
+            float cost = evaluate_sah(spheres, sphere_indices, start, end, axis, split);
 
             if (cost < best_cost)
             {
@@ -169,28 +190,34 @@ BVHNode *build_bvh_node(Sphere *spheres, int start, int end, int depth)
         }
     }
 
+    // Planes leaving one side empty have a NaN cost and are never chosen, so best_cost stays
+    // INFINITY when the centers coincide
+    if (bvh_sah_prefers_leaf(num_spheres, get_aabb_surface_area(node->bounds), best_cost, max_leaf_size))
+        return make_leaf(node, start, num_spheres);
+
     int mid = start;
     for (int i = start; i < end;)
     {
+        const Sphere *sphere = &spheres[sphere_indices[i]];
         float center = 0;
         switch (best_axis)
         {
         case 0:
-            center = spheres[i].center.x;
+            center = sphere->center.x;
             break;
         case 1:
-            center = spheres[i].center.y;
+            center = sphere->center.y;
             break;
         case 2:
-            center = spheres[i].center.z;
+            center = sphere->center.z;
             break;
         }
 
         if (center < best_split)
         {
-            Sphere temp = spheres[i];
-            spheres[i] = spheres[mid];
-            spheres[mid] = temp;
+            int temp = sphere_indices[i];
+            sphere_indices[i] = sphere_indices[mid];
+            sphere_indices[mid] = temp;
             mid++;
             i++;
         }
@@ -200,10 +227,317 @@ BVHNode *build_bvh_node(Sphere *spheres, int start, int end, int depth)
         }
     }
 
-    node->left = build_bvh_node(spheres, start, mid, depth + 1);
-    node->right = build_bvh_node(spheres, mid, end, depth + 1);
-    node->sphere = NULL;
+    // No plane separates coincident centers, halve them instead of recursing into the same node
+    if (mid == start || mid == end)
+        mid = start + num_spheres / 2;
+
+    node->left = build_planes_node(arena, spheres, sphere_indices, start, mid, depth + 1, max_depth, max_leaf_size);
+    node->right = build_planes_node(arena, spheres, sphere_indices, mid, end, depth + 1, max_depth, max_leaf_size);
+    if (node->left == NULL || node->right == NULL)
+    {
+        // Arena nodes go with the arena, nodes allocated one by one are freed here
+        if (arena == NULL)
+        {
+            free_bvh(node->left);
+            free_bvh(node->right);
+            free(node);
+        }
+        return NULL;
+    }
+    node->first = 0;
     node->sphere_count = 0;
 
     return node;
 }
+
+// Allocates every node on its own. build_bvh() builds the same tree into an arena when given
+// BVH_PLANES_MAX_DEPTH and the default leaf size.
+BVHNode *build_bvh_node(const Sphere *spheres, int *sphere_indices, int start, int end, int depth)
+{
+    return build_planes_node(NULL, spheres, sphere_indices, start, end, depth, BVH_PLANES_MAX_DEPTH,
+                             BVH_DEFAULT_MAX_LEAF_SIZE);
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// Shared helpers for the primitive-reference based builders.
+// bvh_fill_prim_refs() - precomputes bounds and centroid of every sphere once per build.
+// bvh_compact_spheres() - copies the spheres into leaf order, so traversal reads every leaf from
+//                         one contiguous block instead of going through the sphere indices.
+// build_bvh() - entry point choosing the builder from the build parameters.
+// bvh_collapse_leaves() - merges the single sphere leaves of the bottom-up builders into SAH leaves.
+// Both helpers split their loops into OpenMP tasks, so they run in parallel when called from
+// inside a builder's parallel region and serially anywhere else.
+
+//----------------------------------------------------------------------------------------------------
+
+BVHBuildParams bvh_default_build_params()
+{
+    return (BVHBuildParams){
+        .builder = BVH_BUILDER_BINNED,
+        .bin_count = BVH_DEFAULT_BINS,
+        .max_depth = BVH_DEFAULT_MAX_DEPTH,
+        .num_threads = 0,
+        .morton_bits = BVH_DEFAULT_MORTON_BITS,
+        .ploc_radius = BVH_DEFAULT_PLOC_RADIUS,
+        .max_leaf_size = BVH_DEFAULT_MAX_LEAF_SIZE};
+}
+
+int bvh_max_leaf_size(const BVHBuildParams *params)
+{
+    return params && params->max_leaf_size > 0 ? params->max_leaf_size : BVH_DEFAULT_MAX_LEAF_SIZE;
+}
+
+int bvh_thread_count(const BVHBuildParams *params)
+{
+#ifdef _OPENMP
+    if (params && params->num_threads > 0)
+        return params->num_threads;
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// SAH cost model
+// The profile is a text file of "name value" lines, '#' starts a comment:
+//     traversal_cost 2.5
+//     intersect_cost 1
+// It is loaded once, on first use, by whichever thread gets there first. Later reads take no lock.
+
+//----------------------------------------------------------------------------------------------------
+
+static BVHCostModel cost_model = {BVH_SAH_TRAVERSAL_COST, BVH_SAH_INTERSECT_COST};
+static SDL_atomic_t cost_model_ready;
+static SDL_SpinLock cost_model_lock = 0;
+
+static int read_cost_profile(const char *path, BVHCostModel *model)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return 0;
+
+    BVHCostModel read = {-1.0f, -1.0f};
+    char line[256];
+    while (fgets(line, sizeof(line), file))
+    {
+        char name[64];
+        float value;
+        if (line[0] == '#' || sscanf(line, "%63s %f", name, &value) != 2)
+            continue;
+        if (strcmp(name, "traversal_cost") == 0)
+            read.traversal_cost = value;
+        else if (strcmp(name, "intersect_cost") == 0)
+            read.intersect_cost = value;
+    }
+    fclose(file);
+
+    if (!(read.traversal_cost > 0.0f && read.traversal_cost < INFINITY &&
+          read.intersect_cost > 0.0f && read.intersect_cost < INFINITY))
+    {
+        printf("Ignoring SAH cost profile %s: it needs positive traversal_cost and intersect_cost\n", path);
+        return 0;
+    }
+    *model = read;
+    return 1;
+}
+
+BVHCostModel bvh_cost_model()
+{
+    if (!SDL_AtomicGet(&cost_model_ready))
+    {
+        SDL_AtomicLock(&cost_model_lock);
+        if (!SDL_AtomicGet(&cost_model_ready))
+        {
+            read_cost_profile(BVH_COST_PROFILE_PATH, &cost_model);
+            SDL_AtomicSet(&cost_model_ready, 1);
+        }
+        SDL_AtomicUnlock(&cost_model_lock);
+    }
+    return cost_model;
+}
+
+void bvh_set_cost_model(BVHCostModel model)
+{
+    SDL_AtomicLock(&cost_model_lock);
+    cost_model = model;
+    SDL_AtomicSet(&cost_model_ready, 1);
+    SDL_AtomicUnlock(&cost_model_lock);
+}
+
+int bvh_cost_model_load(const char *path)
+{
+    BVHCostModel model;
+    if (!read_cost_profile(path, &model))
+        return 0;
+    bvh_set_cost_model(model);
+    return 1;
+}
+
+int bvh_cost_model_save(const char *path, BVHCostModel model)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return 0;
+    fprintf(file, "# SAH cost profile: relative costs of a node visit and of a sphere test\n");
+    fprintf(file, "traversal_cost %.6g\n", model.traversal_cost);
+    fprintf(file, "intersect_cost %.6g\n", model.intersect_cost);
+    return fclose(file) == 0;
+}
+
+void bvh_fill_prim_refs(BVHPrimRef *refs, const Sphere *spheres, int num_spheres)
+{
+#pragma omp taskloop grainsize(BVH_PARALLEL_GRAIN)
+    for (int i = 0; i < num_spheres; i++)
+    {
+        refs[i].bounds = create_aabb_from_sphere(&spheres[i]);
+        refs[i].centroid = spheres[i].center;
+        refs[i].index = i;
+    }
+}
+
+BVHPrimRef *bvh_create_prim_refs(const Sphere *spheres, int num_spheres)
+{
+    BVHPrimRef *refs = (BVHPrimRef *)malloc(num_spheres * sizeof(BVHPrimRef));
+    if (refs)
+        bvh_fill_prim_refs(refs, spheres, num_spheres);
+    return refs;
+}
+
+// The copy is the caller's to free with bvh_free_large(), trees over it take NULL sphere indices
+Sphere *bvh_compact_spheres(const Sphere *spheres, const int *sphere_indices, int num_spheres)
+{
+    Sphere *compact = (Sphere *)bvh_alloc_large((num_spheres > 0 ? num_spheres : 1) * sizeof(Sphere));
+    if (!compact)
+    {
+        printf("Failed to allocate a compact copy of %d spheres\n", num_spheres);
+        return NULL;
+    }
+
+    BVHBuildParams params = bvh_default_build_params();
+#pragma omp parallel num_threads(bvh_thread_count(&params)) if (num_spheres > BVH_PARALLEL_GRAIN)
+#pragma omp single
+#pragma omp taskloop grainsize(BVH_PARALLEL_GRAIN)
+    for (int i = 0; i < num_spheres; i++)
+    {
+        compact[i] = spheres[sphere_indices[i]];
+    }
+    return compact;
+}
+
+BVHNode *build_bvh(const Sphere *spheres, int num_spheres, const BVHBuildParams *params, int *sphere_indices)
+{
+    BVHBuildParams defaults = bvh_default_build_params();
+    if (!params)
+        params = &defaults;
+
+    switch (params->builder)
+    {
+    case BVH_BUILDER_BINNED:
+        return build_bvh_binned(spheres, num_spheres, params, sphere_indices);
+    case BVH_BUILDER_SWEEP:
+        return build_bvh_sweep(spheres, num_spheres, params, sphere_indices);
+    case BVH_BUILDER_LBVH:
+        return build_bvh_lbvh(spheres, num_spheres, params, sphere_indices);
+    case BVH_BUILDER_HLBVH:
+        return build_bvh_hlbvh(spheres, num_spheres, params, sphere_indices);
+    case BVH_BUILDER_PLOC:
+        return build_bvh_ploc(spheres, num_spheres, params, sphere_indices);
+    case BVH_BUILDER_PLANES:
+    default:
+    {
+        for (int i = 0; i < num_spheres; i++)
+        {
+            sphere_indices[i] = i;
+        }
+        BVHNodeArena *arena = bvh_arena_create(1);
+        BVHNode *root = build_planes_node(arena, spheres, sphere_indices, 0, num_spheres, 0, params->max_depth,
+                                          bvh_max_leaf_size(params));
+        bvh_arena_attach(arena, root);
+        return root;
+    }
+    }
+}
+
+// Subtrees near the root are collapsed as separate tasks
+#define COLLAPSE_TASK_DEPTH 8
+
+// Post-order, so a node sees its children after they were merged. Two sibling leaves become one
+// if their ranges of the sphere index array are adjacent and the SAH prefers the merged leaf.
+static void collapse_node(BVHNodeArena *arena, BVHNode *node, int max_leaf_size, int depth)
+{
+    if (node->left == NULL)
+        return;
+
+    if (depth < COLLAPSE_TASK_DEPTH)
+    {
+#pragma omp task
+        collapse_node(arena, node->left, max_leaf_size, depth + 1);
+        collapse_node(arena, node->right, max_leaf_size, depth + 1);
+#pragma omp taskwait
+    }
+    else
+    {
+        collapse_node(arena, node->left, max_leaf_size, depth + 1);
+        collapse_node(arena, node->right, max_leaf_size, depth + 1);
+    }
+
+    BVHNode *left = node->left, *right = node->right;
+    if (left->left != NULL || right->left != NULL)
+        return;
+
+    int first;
+    if (left->first + left->sphere_count == right->first)
+        first = left->first;
+    else if (right->first + right->sphere_count == left->first)
+        first = right->first;
+    else
+        return;
+
+    int count = left->sphere_count + right->sphere_count;
+    float split_cost = left->sphere_count * get_aabb_surface_area(left->bounds) +
+                       right->sphere_count * get_aabb_surface_area(right->bounds);
+    if (!bvh_sah_prefers_leaf(count, get_aabb_surface_area(node->bounds), split_cost, max_leaf_size))
+        return;
+
+    make_leaf(node, first, count);
+    bvh_arena_release_node(arena, left);
+    bvh_arena_release_node(arena, right);
+}
+
+// Runs its top levels as tasks when called from inside a builder's parallel region
+void bvh_collapse_leaves(BVHNodeArena *arena, BVHNode *root, int max_leaf_size)
+{
+    if (root != NULL && max_leaf_size > 1)
+        collapse_node(arena, root, max_leaf_size, 0);
+}
+
+// Number of sphere index slots the leaves of a tree cover
+int bvh_sphere_count(const BVHNode *root)
+{
+    if (root == NULL)
+        return 0;
+    if (root->left == NULL)
+        return root->sphere_count > 0 ? root->sphere_count : 0;
+    return bvh_sphere_count(root->left) + bvh_sphere_count(root->right);
+}
+
+static float sah_cost_node(const BVHNode *node, const BVHCostModel *costs)
+{
+    // Empty leaves from build_bvh_node() have inverted bounds and no cost
+    if (node->left == NULL)
+        return node->sphere_count > 0 ? costs->intersect_cost * get_aabb_surface_area(node->bounds) * node->sphere_count : 0.0f;
+    float area = get_aabb_surface_area(node->bounds);
+    return costs->traversal_cost * area + sah_cost_node(node->left, costs) + sah_cost_node(node->right, costs);
+}
+
+float bvh_sah_cost(const BVHNode *root)
+{
+    if (root == NULL)
+        return 0.0f;
+    float area = get_aabb_surface_area(root->bounds);
+    BVHCostModel costs = bvh_cost_model();
+    return area > 0.0f ? sah_cost_node(root, &costs) / area : 0.0f;
+}
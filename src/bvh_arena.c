@@ -0,0 +1,364 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "Custom/bvh.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//----------------------------------------------------------------------------------------------------
+
+// Node arena
+// Builders take their nodes from an arena instead of calling malloc() once per node, so a tree of
+// n spheres costs a few hundred allocations instead of 2n, and releasing it frees whole chunks.
+// - Every build thread owns a slot holding its current chunk and bumps a counter in it, without
+//   locks or atomics. Only a full chunk goes back to malloc() for the next one.
+// - Chunks start at ARENA_FIRST_CHUNK_NODES nodes and double up to ARENA_MAX_CHUNK_NODES, so small
+//   scenes do not reserve a large chunk per thread.
+// - A finished tree's root is registered with its arena (bvh_arena_attach()) in a hash table keyed
+//   by the root. free_bvh(root) finds it there in constant time and releases the arena, one free()
+//   per chunk, without visiting a single node.
+// - Released nodes (leaves merged by bvh_collapse_leaves(), nodes removed from a DynamicBVH) go on
+//   a free list in the releasing thread's slot and are handed out again before the chunk grows,
+//   so a tree that keeps changing does not keep growing its arena.
+// - Threads inside an OpenMP parallel region use the slot of their thread number. Any other thread
+//   (the background rebuild, a serial caller) and team members past the slot count share the last
+//   slot under a spin lock.
+// Trees whose nodes were allocated one by one (build_bvh_node(), trees built by hand) are not
+// registered, free_bvh() tears them down iteratively instead. Builds with BVH_DEBUG also check that
+// such a tree is not a subtree of an arena tree, which takes a scan of every registered chunk.
+
+//----------------------------------------------------------------------------------------------------
+
+#define ARENA_FIRST_CHUNK_NODES 64
+#define ARENA_MAX_CHUNK_NODES 16384
+#define REGISTRY_FIRST_BUCKETS 64
+
+typedef struct ArenaChunk
+{
+    struct ArenaChunk *next;
+    int used;
+    int capacity;
+    BVHNode nodes[];
+} ArenaChunk;
+
+// One cache line per slot, so threads bumping their own counters never share a line
+typedef struct ArenaSlot
+{
+    ArenaChunk *chunk;      // current chunk, head of the slot's list of chunks
+    BVHNode *free_nodes;    // released nodes, linked through their left pointers
+    char padding[64 - sizeof(ArenaChunk *) - sizeof(BVHNode *)];
+} ArenaSlot;
+
+struct BVHNodeArena
+{
+    ArenaSlot *slots;
+    int slot_count;         // one per build thread, the last one is shared by any other thread
+    SDL_SpinLock shared_lock;   // guards the shared slot
+    const BVHNode *root;
+    struct BVHNodeArena *next;  // next arena in the same registry bucket
+};
+
+// Arenas of the live trees, chained in buckets by the hash of their root. The buckets double once
+// there are more arenas than buckets; if that allocation fails the chains just grow longer.
+// Trees are built and freed on different threads (the background rebuild), so the registry takes a
+// spin lock that holds without OpenMP as well.
+static BVHNodeArena *first_buckets[REGISTRY_FIRST_BUCKETS];
+static BVHNodeArena **registry_buckets = first_buckets;
+static size_t registry_bucket_count = REGISTRY_FIRST_BUCKETS;
+static size_t registered_count = 0;
+static SDL_SpinLock registry_lock = 0;
+
+BVHNodeArena *bvh_arena_create(int num_threads)
+{
+    BVHNodeArena *arena = (BVHNodeArena *)malloc(sizeof(BVHNodeArena));
+    if (arena == NULL)
+        return NULL;
+
+    arena->slot_count = (num_threads > 0 ? num_threads : 1) + 1;
+    arena->slots = (ArenaSlot *)calloc(arena->slot_count, sizeof(ArenaSlot));
+    arena->shared_lock = 0;
+    arena->root = NULL;
+    arena->next = NULL;
+    if (arena->slots == NULL)
+    {
+        free(arena);
+        return NULL;
+    }
+    return arena;
+}
+
+void bvh_arena_destroy(BVHNodeArena *arena)
+{
+    if (arena == NULL)
+        return;
+
+    for (int s = 0; s < arena->slot_count; s++)
+    {
+        ArenaChunk *chunk = arena->slots[s].chunk;
+        while (chunk != NULL)
+        {
+            ArenaChunk *next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+    }
+    free(arena->slots);
+    free(arena);
+}
+
+static BVHNode *alloc_from_slot(ArenaSlot *slot)
+{
+    if (slot->free_nodes != NULL)
+    {
+        BVHNode *node = slot->free_nodes;
+        slot->free_nodes = node->left;
+        return node;
+    }
+
+    ArenaChunk *chunk = slot->chunk;
+    if (chunk == NULL || chunk->used == chunk->capacity)
+    {
+        int capacity = chunk == NULL ? ARENA_FIRST_CHUNK_NODES : 2 * chunk->capacity;
+        if (capacity > ARENA_MAX_CHUNK_NODES)
+            capacity = ARENA_MAX_CHUNK_NODES;
+
+        ArenaChunk *fresh = (ArenaChunk *)malloc(sizeof(ArenaChunk) + capacity * sizeof(BVHNode));
+        if (fresh == NULL)
+        {
+            printf("Failed to allocate a chunk of %d BVH nodes\n", capacity);
+            return NULL;
+        }
+        fresh->next = chunk;
+        fresh->used = 0;
+        fresh->capacity = capacity;
+        slot->chunk = chunk = fresh;
+    }
+    return &chunk->nodes[chunk->used++];
+}
+
+// Thread numbers only tell OpenMP team members apart. Outside a parallel region every thread is
+// number 0, so the SDL rebuild thread and the main thread would bump the same counter.
+static int thread_slot(const BVHNodeArena *arena)
+{
+    int thread = arena->slot_count - 1;
+#ifdef _OPENMP
+    if (omp_in_parallel())
+        thread = omp_get_thread_num();
+#endif
+    return thread < arena->slot_count - 1 ? thread : arena->slot_count - 1;
+}
+
+// A slot's chunks double until the largest size, so they hold less than twice the nodes handed out
+// by the slot plus its first chunk, and every chunk but the last of a slot is full
+size_t bvh_arena_bytes_bound(int node_count, int num_threads)
+{
+    size_t slots = (size_t)(num_threads > 0 ? num_threads : 1) + 1;
+    size_t nodes = 2 * (size_t)(node_count > 0 ? node_count : 0) + slots * ARENA_FIRST_CHUNK_NODES;
+    size_t chunks = (size_t)(node_count > 0 ? node_count : 0) / ARENA_FIRST_CHUNK_NODES + slots;
+    return sizeof(BVHNodeArena) + slots * sizeof(ArenaSlot) + nodes * sizeof(BVHNode) + chunks * sizeof(ArenaChunk);
+}
+
+// A NULL arena falls back to malloc(), for trees that are freed node by node
+BVHNode *bvh_arena_alloc_node(BVHNodeArena *arena)
+{
+    if (arena == NULL)
+        return (BVHNode *)malloc(sizeof(BVHNode));
+
+    int slot = thread_slot(arena);
+    if (slot < arena->slot_count - 1)
+        return alloc_from_slot(&arena->slots[slot]);
+
+    SDL_AtomicLock(&arena->shared_lock);
+    BVHNode *node = alloc_from_slot(&arena->slots[slot]);
+    SDL_AtomicUnlock(&arena->shared_lock);
+    return node;
+}
+
+// The node's memory stays in the arena for the next allocation of the same thread
+void bvh_arena_release_node(BVHNodeArena *arena, BVHNode *node)
+{
+    if (arena == NULL)
+    {
+        free(node);
+        return;
+    }
+
+    int slot = thread_slot(arena);
+    if (slot < arena->slot_count - 1)
+    {
+        node->left = arena->slots[slot].free_nodes;
+        arena->slots[slot].free_nodes = node;
+        return;
+    }
+
+    SDL_AtomicLock(&arena->shared_lock);
+    node->left = arena->slots[slot].free_nodes;
+    arena->slots[slot].free_nodes = node;
+    SDL_AtomicUnlock(&arena->shared_lock);
+}
+
+// Fibonacci hashing of the root's address, bucket_count is a power of two
+static size_t root_bucket(const BVHNode *root, size_t bucket_count)
+{
+    uint64_t hash = (uint64_t)(uintptr_t)root * UINT64_C(0x9E3779B97F4A7C15);
+    return (size_t)(hash >> 32) & (bucket_count - 1);
+}
+
+// Called with the registry lock held
+static void grow_registry()
+{
+    size_t bucket_count = 2 * registry_bucket_count;
+    BVHNodeArena **buckets = (BVHNodeArena **)calloc(bucket_count, sizeof(BVHNodeArena *));
+    if (buckets == NULL)
+        return;
+
+    for (size_t b = 0; b < registry_bucket_count; b++)
+    {
+        BVHNodeArena *arena = registry_buckets[b];
+        while (arena != NULL)
+        {
+            BVHNodeArena *next = arena->next;
+            size_t bucket = root_bucket(arena->root, bucket_count);
+            arena->next = buckets[bucket];
+            buckets[bucket] = arena;
+            arena = next;
+        }
+    }
+    if (registry_buckets != first_buckets)
+        free(registry_buckets);
+    registry_buckets = buckets;
+    registry_bucket_count = bucket_count;
+}
+
+// Hands the arena over to the tree, free_bvh(root) releases it. An empty tree releases it at once.
+void bvh_arena_attach(BVHNodeArena *arena, const BVHNode *root)
+{
+    if (arena == NULL)
+        return;
+    if (root == NULL)
+    {
+        bvh_arena_destroy(arena);
+        return;
+    }
+
+    arena->root = root;
+    SDL_AtomicLock(&registry_lock);
+    if (registered_count >= registry_bucket_count)
+        grow_registry();
+    size_t bucket = root_bucket(root, registry_bucket_count);
+    arena->next = registry_buckets[bucket];
+    registry_buckets[bucket] = arena;
+    registered_count++;
+    SDL_AtomicUnlock(&registry_lock);
+}
+
+// Arena of a tree registered with bvh_arena_attach(), NULL for trees allocated node by node
+BVHNodeArena *bvh_arena_of(const BVHNode *root)
+{
+    BVHNodeArena *found = NULL;
+    SDL_AtomicLock(&registry_lock);
+    for (BVHNodeArena *arena = registry_buckets[root_bucket(root, registry_bucket_count)];
+         arena != NULL && found == NULL; arena = arena->next)
+    {
+        if (arena->root == root)
+            found = arena;
+    }
+    SDL_AtomicUnlock(&registry_lock);
+    return found;
+}
+
+static BVHNodeArena *detach_arena(const BVHNode *root)
+{
+    BVHNodeArena *found = NULL;
+    SDL_AtomicLock(&registry_lock);
+    for (BVHNodeArena **link = &registry_buckets[root_bucket(root, registry_bucket_count)]; *link != NULL;
+         link = &(*link)->next)
+    {
+        if ((*link)->root == root)
+        {
+            found = *link;
+            *link = found->next;
+            registered_count--;
+            break;
+        }
+    }
+    SDL_AtomicUnlock(&registry_lock);
+    return found;
+}
+
+#ifdef BVH_DEBUG
+static int arena_holds_node(const BVHNodeArena *arena, const BVHNode *node)
+{
+    for (int s = 0; s < arena->slot_count; s++)
+    {
+        for (const ArenaChunk *chunk = arena->slots[s].chunk; chunk != NULL; chunk = chunk->next)
+        {
+            if (node >= chunk->nodes && node < chunk->nodes + chunk->used)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+// Whether node lies inside a registered arena without being its root, i.e. a subtree of an arena tree
+static int inside_registered_arena(const BVHNode *node)
+{
+    int found = 0;
+    SDL_AtomicLock(&registry_lock);
+    for (size_t b = 0; b < registry_bucket_count && !found; b++)
+    {
+        for (const BVHNodeArena *arena = registry_buckets[b]; arena != NULL && !found; arena = arena->next)
+        {
+            found = arena_holds_node(arena, node);
+        }
+    }
+    SDL_AtomicUnlock(&registry_lock);
+    return found;
+}
+#endif
+
+// Must be called with the root. Arena trees go in one step, others node by node: every left child
+// is rotated up until the node has none, then the node is freed and its right subtree follows.
+// Needs neither recursion nor a stack, however deep the tree.
+// A subtree of an arena tree must not be passed: its nodes were never malloc()ed one by one, and
+// releasing them would leave the rest of the tree pointing into freed chunks. Builds with BVH_DEBUG
+// refuse it; the check scans every registered chunk, so other builds leave it out.
+void free_bvh(BVHNode *root)
+{
+    if (root == NULL)
+        return;
+
+    BVHNodeArena *arena = detach_arena(root);
+    if (arena != NULL)
+    {
+        bvh_arena_destroy(arena);
+        return;
+    }
+#ifdef BVH_DEBUG
+    if (inside_registered_arena(root))
+    {
+        printf("free_bvh() called with an interior node of an arena tree, free the tree's root instead\n");
+        return;
+    }
+#endif
+
+    BVHNode *node = root;
+    while (node != NULL)
+    {
+        if (node->left != NULL)
+        {
+            BVHNode *left = node->left;
+            node->left = left->right;
+            left->right = node;
+            node = left;
+        }
+        else
+        {
+            BVHNode *right = node->right;
+            free(node);
+            node = right;
+        }
+    }
+}
@@ -0,0 +1,310 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <SDL2/SDL.h>
+#include "Custom/bvh_autotune.h"
+#include "Custom/bvh_linear.h"
+#include "Custom/hit.h"
+#include "Custom/bvh_memory.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// Build parameter autotuning
+// One configuration does not fit every scene: uniform noise favours different leaf sizes and
+// builders than tight clusters. The tuner measures instead of guessing.
+// - Every candidate is built, flattened over leaf ordered spheres like the renderer's snapshots and
+//   traced with the given rays. Its score is the best traversal throughput of TUNE_TRACE_RUNS runs.
+// - The search is coordinate descent over builder, bin count, leaf size and depth limit: every
+//   value of one dimension is tried with the others fixed and the fastest is kept, then the next
+//   dimension. Rounds repeat until one changes nothing. Dimensions a builder ignores are skipped
+//   (bins outside the binned and HLBVH builders, depth outside the top-down SAH builders).
+// - Measured configurations are remembered, so later rounds never rebuild one.
+
+//----------------------------------------------------------------------------------------------------
+
+#define TUNE_TRACE_RUNS 3
+#define TUNE_MAX_ROUNDS 3
+#define TUNE_MAX_CANDIDATES 256
+
+static const BVHBuilder tune_builders[] = {
+    BVH_BUILDER_BINNED, BVH_BUILDER_SWEEP, BVH_BUILDER_PLANES,
+    BVH_BUILDER_LBVH, BVH_BUILDER_HLBVH, BVH_BUILDER_PLOC};
+static const int tune_bin_counts[] = {16, 32, 64};
+static const int tune_leaf_sizes[] = {1, 2, 4, 8, 16};
+static const int tune_depths[] = {16, 24, 32, 48, 64};
+
+static const char *builder_names[] = {"planes", "binned", "sweep", "lbvh", "hlbvh", "ploc"};
+
+typedef struct TuneCandidate
+{
+    BVHBuildParams params;
+    double build_time;
+    double rays_per_second;
+} TuneCandidate;
+
+typedef struct TuneSearch
+{
+    const Sphere *spheres;
+    int num_spheres;
+    const Ray *rays;
+    int num_rays;
+    int *sphere_indices;
+    TuneCandidate *measured;
+    int measured_count;
+} TuneSearch;
+
+const char *bvh_builder_name(BVHBuilder builder)
+{
+    if ((int)builder < 0 || (int)builder >= (int)(sizeof(builder_names) / sizeof(builder_names[0])))
+        return "unknown";
+    return builder_names[builder];
+}
+
+static int uses_bins(BVHBuilder builder)
+{
+    return builder == BVH_BUILDER_BINNED || builder == BVH_BUILDER_HLBVH;
+}
+
+static int uses_depth(BVHBuilder builder)
+{
+    return builder == BVH_BUILDER_BINNED || builder == BVH_BUILDER_SWEEP || builder == BVH_BUILDER_PLANES;
+}
+
+static double seconds_since(Uint64 start)
+{
+    return (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+}
+
+// Fields a builder ignores are set to their defaults, so equal trees compare as equal candidates
+static BVHBuildParams canonical(BVHBuildParams params)
+{
+    BVHBuildParams defaults = bvh_default_build_params();
+    if (!uses_bins(params.builder))
+        params.bin_count = defaults.bin_count;
+    if (!uses_depth(params.builder))
+        params.max_depth = defaults.max_depth;
+    return params;
+}
+
+static int same_candidate(const BVHBuildParams *a, const BVHBuildParams *b)
+{
+    return a->builder == b->builder && a->bin_count == b->bin_count && a->max_depth == b->max_depth &&
+           a->max_leaf_size == b->max_leaf_size;
+}
+
+// Throughput of one configuration in rays per second, 0 if it could not be built
+static double measure(TuneSearch *search, BVHBuildParams params)
+{
+    params = canonical(params);
+    for (int i = 0; i < search->measured_count; i++)
+    {
+        if (same_candidate(&search->measured[i].params, &params))
+            return search->measured[i].rays_per_second;
+    }
+    if (search->measured_count == TUNE_MAX_CANDIDATES)
+        return 0.0;
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    BVHNode *root = build_bvh(search->spheres, search->num_spheres, &params, search->sphere_indices);
+    double build_time = seconds_since(start);
+    Sphere *leaf_spheres = root ? bvh_compact_spheres(search->spheres, search->sphere_indices, search->num_spheres) : NULL;
+    LinearBVH *bvh = leaf_spheres ? bvh_flatten(root, leaf_spheres, NULL) : NULL;
+
+    double rays_per_second = 0.0;
+    for (int run = 0; bvh && run < TUNE_TRACE_RUNS; run++)
+    {
+        start = SDL_GetPerformanceCounter();
+        for (int i = 0; i < search->num_rays; i++)
+        {
+            ray_bvh_intersect(search->rays[i], bvh);
+        }
+        double elapsed = seconds_since(start);
+        double throughput = elapsed > 0.0 ? search->num_rays / elapsed : INFINITY;
+        if (throughput > rays_per_second)
+            rays_per_second = throughput;
+    }
+
+    free_linear_bvh(bvh);
+    bvh_free_large(leaf_spheres);
+    free_bvh(root);
+
+    search->measured[search->measured_count++] = (TuneCandidate){params, build_time, rays_per_second};
+    printf("  %-6s bins %2d, leaf size %2d, depth %2d: build %f seconds, %.0f rays/second\n",
+           bvh_builder_name(params.builder), params.bin_count, params.max_leaf_size, params.max_depth,
+           build_time, rays_per_second);
+    return rays_per_second;
+}
+
+// Tries every value of one field on top of best, returns 1 if best changed
+static int tune_field(TuneSearch *search, BVHBuildParams *best, double *best_score, int *field,
+                      const int *values, int value_count)
+{
+    int changed = 0;
+    int best_value = *field;
+    for (int v = 0; v < value_count; v++)
+    {
+        *field = values[v];
+        double score = measure(search, *best);
+        if (score > *best_score)
+        {
+            *best_score = score;
+            best_value = values[v];
+            changed = 1;
+        }
+    }
+    *field = best_value;
+    return changed;
+}
+
+int bvh_autotune(const Sphere *spheres, int num_spheres, const Ray *rays, int num_rays,
+                 const BVHBuildParams *base, BVHTuneResult *result)
+{
+    if (num_spheres <= 0 || num_rays <= 0)
+        return 0;
+
+    TuneSearch search = {
+        .spheres = spheres,
+        .num_spheres = num_spheres,
+        .rays = rays,
+        .num_rays = num_rays,
+        .sphere_indices = (int *)malloc(num_spheres * sizeof(int)),
+        .measured = (TuneCandidate *)malloc(TUNE_MAX_CANDIDATES * sizeof(TuneCandidate)),
+        .measured_count = 0};
+    if (!search.sphere_indices || !search.measured)
+    {
+        free(search.sphere_indices);
+        free(search.measured);
+        return 0;
+    }
+
+    BVHBuildParams best = base ? *base : bvh_default_build_params();
+    best.max_leaf_size = bvh_max_leaf_size(&best);
+    best = canonical(best);
+    double best_score = measure(&search, best);
+    double default_score = best_score;
+    if (base)
+    {
+        BVHBuildParams defaults = bvh_default_build_params();
+        defaults.num_threads = base->num_threads;
+        default_score = measure(&search, defaults);
+    }
+
+    for (int round = 0; round < TUNE_MAX_ROUNDS; round++)
+    {
+        int changed = 0;
+        BVHBuildParams fastest = best;
+        for (int b = 0; b < (int)(sizeof(tune_builders) / sizeof(tune_builders[0])); b++)
+        {
+            BVHBuildParams candidate = best;
+            candidate.builder = tune_builders[b];
+            double score = measure(&search, candidate);
+            if (score > best_score)
+            {
+                best_score = score;
+                fastest = canonical(candidate);
+                changed = 1;
+            }
+        }
+        best = fastest;
+        if (uses_bins(best.builder))
+            changed |= tune_field(&search, &best, &best_score, &best.bin_count, tune_bin_counts,
+                                  sizeof(tune_bin_counts) / sizeof(tune_bin_counts[0]));
+        changed |= tune_field(&search, &best, &best_score, &best.max_leaf_size, tune_leaf_sizes,
+                              sizeof(tune_leaf_sizes) / sizeof(tune_leaf_sizes[0]));
+        if (uses_depth(best.builder))
+            changed |= tune_field(&search, &best, &best_score, &best.max_depth, tune_depths,
+                                  sizeof(tune_depths) / sizeof(tune_depths[0]));
+        if (!changed)
+            break;
+    }
+
+    best = canonical(best);
+    result->params = best;
+    result->rays_per_second = best_score;
+    result->default_rays_per_second = default_score;
+    result->candidates = search.measured_count;
+    result->build_time = 0.0;
+    for (int i = 0; i < search.measured_count; i++)
+    {
+        if (same_candidate(&search.measured[i].params, &best))
+            result->build_time = search.measured[i].build_time;
+    }
+
+    free(search.measured);
+    free(search.sphere_indices);
+    return best_score > 0.0;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// Tuned parameter files, in the format of the SAH cost profile
+
+//----------------------------------------------------------------------------------------------------
+
+int bvh_build_params_save(const char *path, const BVHBuildParams *params)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return 0;
+    fprintf(file, "# BVH build parameters chosen by the autotuner\n");
+    fprintf(file, "builder %s\n", bvh_builder_name(params->builder));
+    fprintf(file, "bin_count %d\n", params->bin_count);
+    fprintf(file, "max_depth %d\n", params->max_depth);
+    fprintf(file, "max_leaf_size %d\n", params->max_leaf_size);
+    fprintf(file, "morton_bits %d\n", params->morton_bits);
+    fprintf(file, "ploc_radius %d\n", params->ploc_radius);
+    return fclose(file) == 0;
+}
+
+int bvh_build_params_load(const char *path, BVHBuildParams *params)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return 0;
+
+    BVHBuildParams read = *params;
+    int valid = 1;
+    char line[256];
+    while (fgets(line, sizeof(line), file))
+    {
+        char name[64], value[64];
+        if (line[0] == '#' || sscanf(line, "%63s %63s", name, value) != 2)
+            continue;
+
+        if (strcmp(name, "builder") == 0)
+        {
+            int found = 0;
+            for (int b = 0; b < (int)(sizeof(builder_names) / sizeof(builder_names[0])); b++)
+            {
+                if (strcmp(value, builder_names[b]) == 0)
+                {
+                    read.builder = (BVHBuilder)b;
+                    found = 1;
+                }
+            }
+            valid &= found;
+        }
+        else if (strcmp(name, "bin_count") == 0)
+            read.bin_count = atoi(value);
+        else if (strcmp(name, "max_depth") == 0)
+            read.max_depth = atoi(value);
+        else if (strcmp(name, "max_leaf_size") == 0)
+            read.max_leaf_size = atoi(value);
+        else if (strcmp(name, "morton_bits") == 0)
+            read.morton_bits = atoi(value);
+        else if (strcmp(name, "ploc_radius") == 0)
+            read.ploc_radius = atoi(value);
+    }
+    fclose(file);
+
+    valid &= read.bin_count >= 2 && read.bin_count <= BVH_MAX_BINS && read.max_depth > 0 &&
+             read.max_leaf_size > 0 && (read.morton_bits == 30 || read.morton_bits == 63) && read.ploc_radius > 0;
+    if (!valid)
+    {
+        printf("Ignoring BVH build parameters %s: unknown builder or value out of range\n", path);
+        return 0;
+    }
+    *params = read;
+    return 1;
+}
@@ -0,0 +1,471 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "Custom/bvh_cache.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//----------------------------------------------------------------------------------------------------
+
+// On-disk BVH cache
+// A built scene is written once as a flattened BVH together with its spheres in leaf order. Later
+// runs map the file and trace straight from the mapped pages:
+// - No parsing and no copies: the node and sphere sections are stored exactly as they are laid out
+//   in memory, at aligned offsets, so LinearBVH points into the mapping. Only the header is checked.
+// - Pages are loaded on first touch and shared through the page cache, so several render processes
+//   on one host trace a single physical copy of the tree.
+// - The file is keyed by a 64 bit FNV-1a hash of the spheres and of every build parameter that
+//   shapes the tree. The thread count is left out, trees do not depend on it. A file written by
+//   another version, for another key, on a machine of other byte order or with other struct sizes
+//   is rejected and rebuilt.
+// - Files are written to a temporary name unique to the writer (mkstemp(), process and thread id on
+//   Windows) and renamed, so a reader never maps a half written file and processes missing the same
+//   key at once each write their own complete file, the last rename wins.
+// - Opening checks the header and walks the nodes once: a truncated or corrupt file whose child or
+//   sphere offsets point outside the file, or that is deeper than the traversal stack, is rejected.
+//   The streaming writer lets trees that never exist in memory as a whole (the out-of-core builder)
+//   write the same format section by section.
+
+//----------------------------------------------------------------------------------------------------
+
+#define BVH_CACHE_MAGIC 0x48564253u       // "SBVH" in a little endian file
+#define BVH_CACHE_BYTE_ORDER 0x01020304u
+#define BVH_CACHE_ALIGNMENT 64
+
+typedef struct BVHCacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t node_size;
+    uint32_t sphere_size;
+    int32_t node_count;
+    int32_t depth;
+    int32_t sphere_count;
+    uint64_t key;
+    uint64_t node_offset;   // byte offsets of the sections from the start of the file
+    uint64_t sphere_offset;
+    uint64_t file_size;
+} BVHCacheHeader;
+
+static size_t align_offset(size_t offset)
+{
+    return (offset + BVH_CACHE_ALIGNMENT - 1) / BVH_CACHE_ALIGNMENT * BVH_CACHE_ALIGNMENT;
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+uint64_t bvh_cache_key_begin(int num_spheres, const BVHBuildParams *params)
+{
+    BVHBuildParams defaults = bvh_default_build_params();
+    if (!params)
+        params = &defaults;
+
+    // Field by field, so struct padding never enters the hash
+    int32_t settings[] = {
+        BVH_CACHE_VERSION, num_spheres, (int32_t)params->builder, params->bin_count, params->max_depth,
+        params->morton_bits, params->ploc_radius, bvh_max_leaf_size(params)};
+    BVHCostModel model = bvh_cost_model();
+    float costs[] = {model.traversal_cost, model.intersect_cost};
+
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hash = fnv1a(hash, settings, sizeof(settings));
+    return fnv1a(hash, costs, sizeof(costs));
+}
+
+uint64_t bvh_cache_key_append(uint64_t key, const Sphere *spheres, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        key = fnv1a(key, &spheres[i].center, sizeof(Vec3));
+        key = fnv1a(key, &spheres[i].radius, sizeof(float));
+        key = fnv1a(key, &spheres[i].color, sizeof(SDL_Color));
+    }
+    return key;
+}
+
+uint64_t bvh_cache_key_mix(uint64_t key, const void *data, size_t size)
+{
+    return fnv1a(key, data, size);
+}
+
+uint64_t bvh_cache_key(const Sphere *spheres, int num_spheres, const BVHBuildParams *params)
+{
+    return bvh_cache_key_append(bvh_cache_key_begin(num_spheres, params), spheres, num_spheres);
+}
+
+int bvh_cache_path(char *path, size_t size, const char *directory, uint64_t key)
+{
+    int written = snprintf(path, size, "%s/bvh_%016llx.bvhcache", directory ? directory : ".", (unsigned long long)key);
+    return written > 0 && (size_t)written < size;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+static int write_padding(FILE *file, size_t count)
+{
+    static const char zeros[BVH_CACHE_ALIGNMENT] = {0};
+    return count == 0 || fwrite(zeros, 1, count, file) == count;
+}
+
+// Streaming writer: header first, then exactly node_count nodes and sphere_count spheres in order
+struct BVHCacheWriter
+{
+    FILE *file;
+    char *path;
+    char *temporary;
+    BVHCacheHeader header;
+    int nodes_written;
+    int spheres_written;
+    int ok;
+};
+
+BVHCacheWriter *bvh_cache_writer_open(const char *path, int node_count, int depth, int sphere_count, uint64_t key)
+{
+    BVHCacheWriter *writer = (BVHCacheWriter *)calloc(1, sizeof(BVHCacheWriter));
+    if (!writer)
+        return NULL;
+
+    size_t path_length = strlen(path);
+    size_t temporary_size = path_length + 48;
+    writer->path = (char *)malloc(path_length + 1);
+    writer->temporary = (char *)malloc(temporary_size);
+    if (!writer->path || !writer->temporary)
+    {
+        free(writer->path);
+        free(writer->temporary);
+        free(writer);
+        return NULL;
+    }
+    memcpy(writer->path, path, path_length + 1);
+
+    writer->header = (BVHCacheHeader){
+        .magic = BVH_CACHE_MAGIC,
+        .version = BVH_CACHE_VERSION,
+        .byte_order = BVH_CACHE_BYTE_ORDER,
+        .node_size = sizeof(LinearBVHNode),
+        .sphere_size = sizeof(Sphere),
+        .node_count = node_count,
+        .depth = depth,
+        .sphere_count = sphere_count,
+        .key = key};
+    writer->header.node_offset = align_offset(sizeof(BVHCacheHeader));
+    writer->header.sphere_offset = align_offset(writer->header.node_offset + (size_t)node_count * sizeof(LinearBVHNode));
+    writer->header.file_size = writer->header.sphere_offset + (size_t)sphere_count * sizeof(Sphere);
+
+#ifdef _WIN32
+    snprintf(writer->temporary, temporary_size, "%s.%lu.%lu.tmp", path, (unsigned long)GetCurrentProcessId(),
+             (unsigned long)GetCurrentThreadId());
+    writer->file = fopen(writer->temporary, "wb");
+#else
+    snprintf(writer->temporary, temporary_size, "%s.XXXXXX", path);
+    int fd = mkstemp(writer->temporary);
+    // mkstemp() creates the file for its owner only, the cache is shared like any other file
+    if (fd >= 0)
+    {
+        fchmod(fd, 0644);
+        writer->file = fdopen(fd, "wb");
+        if (!writer->file)
+        {
+            close(fd);
+            remove(writer->temporary);
+        }
+    }
+#endif
+    if (!writer->file)
+    {
+        printf("Failed to create BVH cache file %s\n", writer->temporary);
+        free(writer->path);
+        free(writer->temporary);
+        free(writer);
+        return NULL;
+    }
+    writer->ok = fwrite(&writer->header, sizeof(BVHCacheHeader), 1, writer->file) == 1 &&
+                 write_padding(writer->file, writer->header.node_offset - sizeof(BVHCacheHeader));
+    return writer;
+}
+
+int bvh_cache_write_nodes(BVHCacheWriter *writer, const LinearBVHNode *nodes, int count)
+{
+    if (writer->ok && writer->nodes_written + count <= writer->header.node_count &&
+        fwrite(nodes, sizeof(LinearBVHNode), count, writer->file) == (size_t)count)
+    {
+        writer->nodes_written += count;
+    }
+    else
+    {
+        writer->ok = 0;
+    }
+    return writer->ok;
+}
+
+int bvh_cache_write_spheres(BVHCacheWriter *writer, const Sphere *spheres, int count)
+{
+    // The sphere section starts on the first sphere, after the last node
+    if (writer->ok && writer->spheres_written == 0 && count > 0)
+    {
+        size_t end_of_nodes = writer->header.node_offset + (size_t)writer->header.node_count * sizeof(LinearBVHNode);
+        writer->ok = writer->nodes_written == writer->header.node_count &&
+                     write_padding(writer->file, writer->header.sphere_offset - end_of_nodes);
+    }
+    if (writer->ok && writer->spheres_written + count <= writer->header.sphere_count &&
+        fwrite(spheres, sizeof(Sphere), count, writer->file) == (size_t)count)
+    {
+        writer->spheres_written += count;
+    }
+    else
+    {
+        writer->ok = 0;
+    }
+    return writer->ok;
+}
+
+int bvh_cache_writer_close(BVHCacheWriter *writer)
+{
+    if (!writer)
+        return 0;
+
+    int ok = writer->ok && writer->nodes_written == writer->header.node_count &&
+             writer->spheres_written == writer->header.sphere_count;
+    if (ok && writer->header.sphere_count == 0)
+    {
+        size_t end_of_nodes = writer->header.node_offset + (size_t)writer->header.node_count * sizeof(LinearBVHNode);
+        ok = write_padding(writer->file, writer->header.sphere_offset - end_of_nodes);
+    }
+    if (fclose(writer->file) != 0)
+        ok = 0;
+
+#ifdef _WIN32
+    // rename() does not replace existing files on Windows
+    if (ok)
+        remove(writer->path);
+#endif
+    if (!ok || rename(writer->temporary, writer->path) != 0)
+    {
+        printf("Failed to write BVH cache file %s\n", writer->path);
+        remove(writer->temporary);
+        ok = 0;
+    }
+    free(writer->path);
+    free(writer->temporary);
+    free(writer);
+    return ok;
+}
+
+int bvh_cache_save(const char *path, const LinearBVH *bvh, int sphere_count, uint64_t key)
+{
+    if (!bvh || !path)
+        return 0;
+
+    BVHCacheWriter *writer = bvh_cache_writer_open(path, bvh->node_count, bvh->depth, sphere_count, key);
+    if (!writer)
+        return 0;
+    bvh_cache_write_nodes(writer, bvh->nodes, bvh->node_count);
+
+    // Cached trees trace without sphere indices, so the spheres go in leaf order
+    for (int slot = 0; slot < sphere_count; slot++)
+    {
+        if (!bvh_cache_write_spheres(writer, &bvh->spheres[bvh_leaf_sphere(bvh->sphere_indices, slot)], 1))
+            break;
+    }
+    return bvh_cache_writer_close(writer);
+}
+
+//----------------------------------------------------------------------------------------------------
+
+static int map_file(BVHCacheMapping *mapping, const char *path)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return 0;
+    LARGE_INTEGER size;
+    HANDLE view_mapping = NULL;
+    void *data = NULL;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+        view_mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (view_mapping)
+        data = MapViewOfFile(view_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!data)
+    {
+        if (view_mapping)
+            CloseHandle(view_mapping);
+        CloseHandle(file);
+        return 0;
+    }
+    mapping->file = file;
+    mapping->mapping = view_mapping;
+    mapping->data = data;
+    mapping->size = (size_t)size.QuadPart;
+    return 1;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    struct stat status;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &status) == 0 && status.st_size > 0)
+        data = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps the file alive on its own
+    close(fd);
+    if (data == MAP_FAILED)
+        return 0;
+    mapping->data = data;
+    mapping->size = (size_t)status.st_size;
+    return 1;
+#endif
+}
+
+static void unmap_file(BVHCacheMapping *mapping)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(mapping->data);
+    CloseHandle(mapping->mapping);
+    CloseHandle(mapping->file);
+#else
+    munmap(mapping->data, mapping->size);
+#endif
+}
+
+static int header_matches(const BVHCacheHeader *header, size_t size, uint64_t key)
+{
+    return header->magic == BVH_CACHE_MAGIC &&
+           header->version == BVH_CACHE_VERSION &&
+           header->byte_order == BVH_CACHE_BYTE_ORDER &&
+           header->node_size == sizeof(LinearBVHNode) &&
+           header->sphere_size == sizeof(Sphere) &&
+           header->key == key &&
+           header->node_count >= 0 && header->sphere_count >= 0 &&
+           header->depth <= LINEAR_BVH_MAX_DEPTH &&
+           header->node_offset % BVH_CACHE_ALIGNMENT == 0 &&
+           header->node_offset + (uint64_t)header->node_count * sizeof(LinearBVHNode) <= header->sphere_offset &&
+           header->sphere_offset + (uint64_t)header->sphere_count * sizeof(Sphere) == header->file_size &&
+           header->file_size == size;
+}
+
+// Visited in preorder, the nodes of the depth-first layout come in index order. Every node is checked
+// before the traversal could reach it: children inside the node array, leaves inside the sphere
+// array, split axes the traversal can index and paths no deeper than its stack.
+static int nodes_valid(const LinearBVHNode *nodes, int node_count, int sphere_count)
+{
+    if (node_count == 0)
+        return 1;
+
+    int stack[LINEAR_BVH_MAX_DEPTH];
+    int stack_depth[LINEAR_BVH_MAX_DEPTH];
+    int stack_size = 0;
+    int next = 0;
+    int index = 0;
+    int depth = 1;
+    while (1)
+    {
+        if (index != next++)
+            return 0;
+        const LinearBVHNode *node = &nodes[index];
+        if (node->count > 0)
+        {
+            if (node->offset < 0 || node->offset > sphere_count - node->count)
+                return 0;
+            if (stack_size == 0)
+                break;
+            stack_size--;
+            index = stack[stack_size];
+            depth = stack_depth[stack_size];
+            continue;
+        }
+        if (node->axis > 2 || index + 1 >= node_count || node->offset <= index + 1 || node->offset >= node_count ||
+            depth >= LINEAR_BVH_MAX_DEPTH)
+            return 0;
+        stack[stack_size] = node->offset;
+        stack_depth[stack_size++] = depth + 1;
+        index++;
+        depth++;
+    }
+    return next == node_count;
+}
+
+BVHCacheMapping *bvh_cache_open(const char *path, uint64_t key)
+{
+    BVHCacheMapping *mapping = (BVHCacheMapping *)calloc(1, sizeof(BVHCacheMapping));
+    if (!mapping)
+        return NULL;
+    if (!map_file(mapping, path))
+    {
+        free(mapping);
+        return NULL;
+    }
+
+    const BVHCacheHeader *header = (const BVHCacheHeader *)mapping->data;
+    if (mapping->size < sizeof(BVHCacheHeader) || !header_matches(header, mapping->size, key))
+    {
+        bvh_cache_close(mapping);
+        return NULL;
+    }
+
+    char *base = (char *)mapping->data;
+    if (!nodes_valid((const LinearBVHNode *)(base + header->node_offset), header->node_count, header->sphere_count))
+    {
+        printf("Rejecting BVH cache file %s: its nodes point outside the file\n", path);
+        bvh_cache_close(mapping);
+        return NULL;
+    }
+    mapping->key = key;
+    mapping->sphere_count = header->sphere_count;
+    mapping->bvh.nodes = (LinearBVHNode *)(base + header->node_offset);
+    mapping->bvh.node_count = header->node_count;
+    mapping->bvh.depth = header->depth;
+    mapping->bvh.spheres = (Sphere *)(base + header->sphere_offset);
+    mapping->bvh.sphere_indices = NULL;
+    return mapping;
+}
+
+void bvh_cache_close(BVHCacheMapping *mapping)
+{
+    if (!mapping)
+        return;
+    unmap_file(mapping);
+    free(mapping);
+}
+
+BVHCacheMapping *bvh_cache_load_or_build(const char *directory, const Sphere *spheres, int num_spheres,
+                                         const BVHBuildParams *params)
+{
+    uint64_t key = bvh_cache_key(spheres, num_spheres, params);
+    char path[1024];
+    if (!bvh_cache_path(path, sizeof(path), directory, key))
+        return NULL;
+
+    BVHCacheMapping *mapping = bvh_cache_open(path, key);
+    if (mapping)
+        return mapping;
+
+    int *sphere_indices = (int *)malloc((num_spheres > 0 ? num_spheres : 1) * sizeof(int));
+    if (!sphere_indices)
+        return NULL;
+    BVHNode *root = build_bvh(spheres, num_spheres, params, sphere_indices);
+    // The spheres are only read, bvh_cache_save() writes them out in leaf order
+    LinearBVH *bvh = root ? bvh_flatten(root, (Sphere *)spheres, sphere_indices) : NULL;
+    int saved = bvh && bvh_cache_save(path, bvh, num_spheres, key);
+    free_linear_bvh(bvh);
+    free_bvh(root);
+    free(sphere_indices);
+
+    return saved ? bvh_cache_open(path, key) : NULL;
+}
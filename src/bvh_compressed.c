@@ -0,0 +1,413 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "Custom/bvh_compressed.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// bvh_compress() - Builds a compressed 8-wide BVH from the binary tree of any builder (Ylitie,
+// Karras and Laine 2017), for scenes where even the flattened tree would not fit into memory.
+// - Subtrees with at most COMPRESSED_BVH_MAX_LEAF spheres are never opened and become leaves.
+// - Children are gathered so that nodes near the bottom take in whole subtrees as leaves instead
+//   of spending a node on every small subtree (see gather_children()).
+// - Every node stores its own bounds as a float origin and a power of two scale per axis, chosen
+//   so 255 steps cover the node. Child bounds are then single bytes, rounded down for the minimum
+//   and up for the maximum, checked against the exact decoding formula.
+// - Interior children of a node are stored next to each other, as are the sphere indices of its
+//   leaves, so a node needs only two base indices and one byte per child to find them. The index
+//   array names the spheres directly, the builder's sphere indices are resolved while building.
+// About 80 bytes per node plus 4 bytes per sphere, typically 6 to 8 bytes per sphere in total.
+
+//----------------------------------------------------------------------------------------------------
+
+typedef struct CompressedBuild
+{
+    CompressedBVH *bvh;
+    Sphere *spheres;
+    const int *sphere_indices;
+    int next_node;
+    int next_index;
+} CompressedBuild;
+
+// A gathered child: a subtree of the binary tree, or a range of the spheres of a binary leaf,
+// since leaves with more than COMPRESSED_BVH_MAX_LEAF spheres have to be split over several slots
+typedef struct CompressedChild
+{
+    const BVHNode *node;
+    int first;              // ranges only: first sphere slot and number of spheres
+    int count;
+    AABB bounds;
+} CompressedChild;
+
+static CompressedChild wrap_node(const BVHNode *node)
+{
+    CompressedChild child = {.node = node, .first = 0, .count = 0, .bounds = node->bounds};
+    if (node->left == NULL)
+    {
+        child.first = node->first;
+        child.count = node->sphere_count > 0 ? node->sphere_count : 0;
+    }
+    return child;
+}
+
+static CompressedChild sphere_range(const CompressedBuild *build, const BVHNode *leaf, int first, int count)
+{
+    CompressedChild child = {.node = leaf, .first = first, .count = count, .bounds = create_empty_aabb()};
+    for (int i = first; i < first + count; i++)
+    {
+        child.bounds = grow_aabb(child.bounds, create_aabb_from_sphere(&build->spheres[bvh_leaf_sphere(build->sphere_indices, i)]));
+    }
+    return child;
+}
+
+static int is_range(const CompressedChild *child)
+{
+    return child->node->left == NULL;
+}
+
+// Upper bound of the node count: one per binary interior node and per split of a big leaf
+static int max_node_count(const BVHNode *node)
+{
+    if (node->left == NULL)
+        return node->sphere_count > COMPRESSED_BVH_MAX_LEAF ? node->sphere_count / COMPRESSED_BVH_MAX_LEAF : 0;
+    return 1 + max_node_count(node->left) + max_node_count(node->right);
+}
+
+// Sphere count of a subtree if it is at most limit, limit + 1 otherwise, without visiting the
+// whole subtree
+static int small_sphere_count(const BVHNode *node, int limit)
+{
+    if (node->left == NULL)
+        return node->sphere_count > 0 ? (node->sphere_count > limit ? limit + 1 : node->sphere_count) : 0;
+    int left = small_sphere_count(node->left, limit);
+    if (left > limit)
+        return limit + 1;
+    int total = left + small_sphere_count(node->right, limit - left);
+    return total > limit ? limit + 1 : total;
+}
+
+// Children with more than COMPRESSED_BVH_MAX_LEAF spheres become nodes, all others leaves
+static int is_compressed_node(const CompressedChild *child)
+{
+    if (is_range(child))
+        return child->count > COMPRESSED_BVH_MAX_LEAF;
+    return small_sphere_count(child->node, COMPRESSED_BVH_MAX_LEAF) > COMPRESSED_BVH_MAX_LEAF;
+}
+
+static void open_child(const CompressedBuild *build, const CompressedChild *child,
+                       CompressedChild *left, CompressedChild *right)
+{
+    if (is_range(child))
+    {
+        // Split at a multiple of the leaf size, so a range ends up in exactly ceil(count / size) leaves
+        int half = (child->count / COMPRESSED_BVH_MAX_LEAF + 1) / 2 * COMPRESSED_BVH_MAX_LEAF;
+        *left = sphere_range(build, child->node, child->first, half);
+        *right = sphere_range(build, child->node, child->first + half, child->count - half);
+        return;
+    }
+    *left = wrap_node(child->node->left);
+    *right = wrap_node(child->node->right);
+}
+
+// Leaf clusters are the largest subtrees or ranges with at most COMPRESSED_BVH_MAX_LEAF spheres.
+// Returns the number of clusters below a child, capped at COMPRESSED_BVH_WIDTH + 1.
+static int cluster_count(const CompressedBuild *build, const CompressedChild *child)
+{
+    if (!is_compressed_node(child))
+        return 1;
+    if (is_range(child))
+    {
+        int clusters = (child->count + COMPRESSED_BVH_MAX_LEAF - 1) / COMPRESSED_BVH_MAX_LEAF;
+        return clusters > COMPRESSED_BVH_WIDTH ? COMPRESSED_BVH_WIDTH + 1 : clusters;
+    }
+
+    CompressedChild left, right;
+    open_child(build, child, &left, &right);
+    int total = cluster_count(build, &left);
+    if (total > COMPRESSED_BVH_WIDTH)
+        return COMPRESSED_BVH_WIDTH + 1;
+    total += cluster_count(build, &right);
+    return total > COMPRESSED_BVH_WIDTH ? COMPRESSED_BVH_WIDTH + 1 : total;
+}
+
+static void append_clusters(const CompressedBuild *build, const CompressedChild *child,
+                            CompressedChild *children, int *count)
+{
+    if (!is_compressed_node(child))
+    {
+        children[(*count)++] = *child;
+        return;
+    }
+    CompressedChild left, right;
+    open_child(build, child, &left, &right);
+    append_clusters(build, &left, children, count);
+    append_clusters(build, &right, children, count);
+}
+
+static void append_spheres(CompressedBuild *build, const CompressedChild *child)
+{
+    if (is_range(child))
+    {
+        for (int i = child->first; i < child->first + child->count; i++)
+        {
+            build->bvh->indices[build->next_index++] = (uint32_t)bvh_leaf_sphere(build->sphere_indices, i);
+        }
+        return;
+    }
+    CompressedChild left, right;
+    open_child(build, child, &left, &right);
+    append_spheres(build, &left);
+    append_spheres(build, &right);
+}
+
+// Picks the children of a node in two steps, which keeps the node count close to the minimum of
+// one node per 7 leaf clusters:
+// - children too big to become a single node are opened, largest area first, while slots are free,
+// - children whose clusters all fit into the remaining slots are then flattened into leaves,
+//   smallest first, each one saving a node.
+static int gather_children(const CompressedBuild *build, const CompressedChild *node, CompressedChild *children)
+{
+    if (!is_compressed_node(node))
+    {
+        children[0] = *node;
+        return node->count > 0 || !is_range(node) ? 1 : 0;
+    }
+
+    int count = 2;
+    open_child(build, node, &children[0], &children[1]);
+    while (count < COMPRESSED_BVH_WIDTH)
+    {
+        int largest = -1;
+        float largest_area = -1.0f;
+        for (int i = 0; i < count; i++)
+        {
+            if (cluster_count(build, &children[i]) <= COMPRESSED_BVH_WIDTH)
+                continue;
+            float area = get_aabb_surface_area(children[i].bounds);
+            if (area > largest_area)
+            {
+                largest_area = area;
+                largest = i;
+            }
+        }
+        if (largest < 0)
+            break;
+
+        CompressedChild opened = children[largest];
+        open_child(build, &opened, &children[largest], &children[count++]);
+    }
+
+    while (1)
+    {
+        int smallest = -1;
+        int smallest_clusters = COMPRESSED_BVH_WIDTH + 1;
+        for (int i = 0; i < count; i++)
+        {
+            if (!is_compressed_node(&children[i]))
+                continue;
+            int clusters = cluster_count(build, &children[i]);
+            if (count + clusters - 1 <= COMPRESSED_BVH_WIDTH && clusters < smallest_clusters)
+            {
+                smallest_clusters = clusters;
+                smallest = i;
+            }
+        }
+        if (smallest < 0)
+            break;
+
+        CompressedChild flattened = children[smallest];
+        children[smallest] = children[--count];
+        append_clusters(build, &flattened, children, &count);
+    }
+
+    // Empty leaves of build_bvh_node() are dropped
+    int kept = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (!is_range(&children[i]) || children[i].count > 0)
+            children[kept++] = children[i];
+    }
+    return kept;
+}
+
+static float exponent_scale(int exponent)
+{
+    return ldexpf(1.0f, exponent);
+}
+
+// Smallest power of two step for which 255 steps from origin reach max
+static int choose_exponent(float origin, float max)
+{
+    float extent = max - origin;
+    int exponent = -126;
+    if (extent > 0.0f)
+    {
+        frexpf(extent / 255.0f, &exponent);
+        exponent = exponent < -126 ? -126 : exponent;
+    }
+    while (exponent < 127 && origin + 255.0f * exponent_scale(exponent) < max)
+    {
+        exponent++;
+    }
+    return exponent;
+}
+
+static uint8_t quantize_down(float value, float origin, float scale)
+{
+    float steps = floorf((value - origin) / scale);
+    int q = steps < 0.0f ? 0 : (steps > 255.0f ? 255 : (int)steps);
+    while (q > 0 && origin + q * scale > value)
+    {
+        q--;
+    }
+    return (uint8_t)q;
+}
+
+static uint8_t quantize_up(float value, float origin, float scale)
+{
+    float steps = ceilf((value - origin) / scale);
+    int q = steps < 0.0f ? 0 : (steps > 255.0f ? 255 : (int)steps);
+    while (q < 255 && origin + q * scale < value)
+    {
+        q++;
+    }
+    return (uint8_t)q;
+}
+
+static void compress_node(CompressedBuild *build, int index, const CompressedChild *node, int depth)
+{
+    CompressedBVHNode *out = &build->bvh->nodes[index];
+    if (depth > build->bvh->depth)
+        build->bvh->depth = depth;
+
+    CompressedChild children[COMPRESSED_BVH_WIDTH];
+    int count = gather_children(build, node, children);
+
+    float node_min[3] = {node->bounds.min.x, node->bounds.min.y, node->bounds.min.z};
+    float node_max[3] = {node->bounds.max.x, node->bounds.max.y, node->bounds.max.z};
+    float scale[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        int exponent = choose_exponent(node_min[axis], node_max[axis]);
+        out->origin[axis] = node_min[axis];
+        out->exponent[axis] = (int8_t)exponent;
+        scale[axis] = exponent_scale(exponent);
+    }
+
+    // Interior children take consecutive node slots, leaves consecutive sphere indices
+    int is_node[COMPRESSED_BVH_WIDTH];
+    int interior_count = 0;
+    for (int slot = 0; slot < count; slot++)
+    {
+        is_node[slot] = is_compressed_node(&children[slot]);
+        interior_count += is_node[slot];
+    }
+    out->child_base = (uint32_t)build->next_node;
+    out->leaf_base = (uint32_t)build->next_index;
+    out->interior_mask = 0;
+    build->next_node += interior_count;
+
+    int rank = 0;
+    for (int slot = 0; slot < COMPRESSED_BVH_WIDTH; slot++)
+    {
+        if (slot >= count)
+        {
+            out->meta[slot] = COMPRESSED_BVH_EMPTY_SLOT;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                out->lo[axis][slot] = 255;
+                out->hi[axis][slot] = 0;
+            }
+            continue;
+        }
+
+        const CompressedChild *child = &children[slot];
+        float child_min[3] = {child->bounds.min.x, child->bounds.min.y, child->bounds.min.z};
+        float child_max[3] = {child->bounds.max.x, child->bounds.max.y, child->bounds.max.z};
+        for (int axis = 0; axis < 3; axis++)
+        {
+            out->lo[axis][slot] = quantize_down(child_min[axis], node_min[axis], scale[axis]);
+            out->hi[axis][slot] = quantize_up(child_max[axis], node_min[axis], scale[axis]);
+        }
+
+        if (is_node[slot])
+        {
+            out->interior_mask |= (uint8_t)(1 << slot);
+            out->meta[slot] = (uint8_t)rank++;
+        }
+        else
+        {
+            int offset = build->next_index - (int)out->leaf_base;
+            append_spheres(build, child);
+            int spheres = build->next_index - (int)out->leaf_base - offset;
+            out->meta[slot] = (uint8_t)(offset << 2 | (spheres - 1));
+        }
+    }
+
+    rank = 0;
+    for (int slot = 0; slot < count; slot++)
+    {
+        if (is_node[slot])
+            compress_node(build, (int)out->child_base + rank++, &children[slot], depth + 1);
+    }
+}
+
+CompressedBVH *bvh_compress(const BVHNode *root, Sphere *spheres, const int *sphere_indices)
+{
+    int max_nodes = root ? max_node_count(root) : 0;
+    max_nodes = max_nodes > 0 ? max_nodes : 1;
+    int num_indices = bvh_sphere_count(root);
+
+    CompressedBVH *bvh = (CompressedBVH *)malloc(sizeof(CompressedBVH));
+    if (!bvh)
+        return NULL;
+    *bvh = (CompressedBVH){
+        .nodes = (CompressedBVHNode *)malloc((size_t)max_nodes * sizeof(CompressedBVHNode)),
+        .node_count = 0,
+        .depth = 0,
+        .indices = (uint32_t *)malloc((size_t)(num_indices > 0 ? num_indices : 1) * sizeof(uint32_t)),
+        .index_count = num_indices,
+        .spheres = spheres};
+    if (!bvh->nodes || !bvh->indices)
+    {
+        printf("Failed to allocate compressed BVH for %d spheres\n", num_indices);
+        free_compressed_bvh(bvh);
+        return NULL;
+    }
+
+    if (num_indices > 0)
+    {
+        CompressedBuild build = {.bvh = bvh, .spheres = spheres, .sphere_indices = sphere_indices, .next_node = 1, .next_index = 0};
+        CompressedChild top = wrap_node(root);
+        compress_node(&build, 0, &top, 1);
+        bvh->node_count = build.next_node;
+
+        CompressedBVHNode *nodes = (CompressedBVHNode *)realloc(bvh->nodes, (size_t)bvh->node_count * sizeof(CompressedBVHNode));
+        if (nodes)
+            bvh->nodes = nodes;
+    }
+
+    // Every visited node pushes at most 7 children besides the one visited next
+    if (bvh->depth * (COMPRESSED_BVH_WIDTH - 1) + 1 > COMPRESSED_BVH_STACK_SIZE)
+    {
+        printf("Compressed BVH depth %d exceeds the traversal stack\n", bvh->depth);
+        free_compressed_bvh(bvh);
+        return NULL;
+    }
+    return bvh;
+}
+
+size_t compressed_bvh_bytes(const CompressedBVH *bvh)
+{
+    return sizeof(CompressedBVH) + (size_t)bvh->node_count * sizeof(CompressedBVHNode) +
+           (size_t)bvh->index_count * sizeof(uint32_t);
+}
+
+void free_compressed_bvh(CompressedBVH *bvh)
+{
+    if (!bvh)
+        return;
+    free(bvh->nodes);
+    free(bvh->indices);
+    free(bvh);
+}
@@ -0,0 +1,327 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "Custom/bvh_instance.h"
+#include "Custom/bvh_memory.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// Two level acceleration structure for instanced geometry
+// A scene that repeats the same sphere clusters at different places stores every cluster once:
+// - A bottom level (BLAS) is an ordinary flattened BVH over one cluster, in the cluster's own
+//   object space, built once with any builder.
+// - An instance places a BLAS in the world with an affine transform. Only the transform, its
+//   inverse and the world bounds are stored per instance, so memory grows with the unique
+//   geometry, plus a fixed amount per instance, instead of with the expanded sphere count.
+// - The top level (TLAS) is a binned SAH tree over the world bounds of the instances, with one
+//   instance per leaf, in the same 32 byte node layout as the flattened BVH.
+// Moving an instance only changes its transform, bvh_update_tlas() then rebuilds the top level,
+// which costs O( instances log instances ) and never touches a sphere. The traversal
+// (ray_tlas_intersect()) moves the ray into object space instead of moving the geometry.
+
+//----------------------------------------------------------------------------------------------------
+
+Transform transform_identity()
+{
+    return (Transform){{{1.0f, 0.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 1.0f, 0.0f}}};
+}
+
+Transform transform_make(Vec3 translation, float yaw, float scale)
+{
+    float c = cosf(yaw) * scale;
+    float s = sinf(yaw) * scale;
+    return (Transform){{{c, 0.0f, s, translation.x}, {0.0f, scale, 0.0f, translation.y}, {-s, 0.0f, c, translation.z}}};
+}
+
+// Inverse of the 3x3 part from its cofactors, the translation follows as -inverse * translation
+Transform transform_inverse(const Transform *t)
+{
+    const float (*m)[4] = t->m;
+    float cofactor[3][3] = {
+        {m[1][1] * m[2][2] - m[1][2] * m[2][1], m[1][2] * m[2][0] - m[1][0] * m[2][2], m[1][0] * m[2][1] - m[1][1] * m[2][0]},
+        {m[0][2] * m[2][1] - m[0][1] * m[2][2], m[0][0] * m[2][2] - m[0][2] * m[2][0], m[0][1] * m[2][0] - m[0][0] * m[2][1]},
+        {m[0][1] * m[1][2] - m[0][2] * m[1][1], m[0][2] * m[1][0] - m[0][0] * m[1][2], m[0][0] * m[1][1] - m[0][1] * m[1][0]}};
+    float det = m[0][0] * cofactor[0][0] + m[0][1] * cofactor[0][1] + m[0][2] * cofactor[0][2];
+    if (fabsf(det) < 1e-20f)
+        return transform_identity();
+
+    Transform inverse;
+    for (int row = 0; row < 3; row++)
+    {
+        for (int col = 0; col < 3; col++)
+        {
+            inverse.m[row][col] = cofactor[col][row] / det;
+        }
+    }
+    for (int row = 0; row < 3; row++)
+    {
+        inverse.m[row][3] = -(inverse.m[row][0] * m[0][3] + inverse.m[row][1] * m[1][3] + inverse.m[row][2] * m[2][3]);
+    }
+    return inverse;
+}
+
+Vec3 transform_point(const Transform *t, Vec3 p)
+{
+    return (Vec3){
+        t->m[0][0] * p.x + t->m[0][1] * p.y + t->m[0][2] * p.z + t->m[0][3],
+        t->m[1][0] * p.x + t->m[1][1] * p.y + t->m[1][2] * p.z + t->m[1][3],
+        t->m[2][0] * p.x + t->m[2][1] * p.y + t->m[2][2] * p.z + t->m[2][3]};
+}
+
+Vec3 transform_vector(const Transform *t, Vec3 v)
+{
+    return (Vec3){
+        t->m[0][0] * v.x + t->m[0][1] * v.y + t->m[0][2] * v.z,
+        t->m[1][0] * v.x + t->m[1][1] * v.y + t->m[1][2] * v.z,
+        t->m[2][0] * v.x + t->m[2][1] * v.y + t->m[2][2] * v.z};
+}
+
+// Normals transform with the inverse transpose, which stays correct under non-uniform scale
+Vec3 transform_normal(const Transform *world_to_object, Vec3 n)
+{
+    const float (*m)[4] = world_to_object->m;
+    return vec3_normalize((Vec3){
+        m[0][0] * n.x + m[1][0] * n.y + m[2][0] * n.z,
+        m[0][1] * n.x + m[1][1] * n.y + m[2][1] * n.z,
+        m[0][2] * n.x + m[1][2] * n.y + m[2][2] * n.z});
+}
+
+// World bounds of an object space box: the bounds of its eight transformed corners
+static AABB transform_bounds(const Transform *t, AABB box)
+{
+    AABB bounds = create_empty_aabb();
+    for (int corner = 0; corner < 8; corner++)
+    {
+        Vec3 p = {
+            corner & 1 ? box.max.x : box.min.x,
+            corner & 2 ? box.max.y : box.min.y,
+            corner & 4 ? box.max.z : box.min.z};
+        bounds = grow_aabb_point(bounds, transform_point(t, p));
+    }
+    return bounds;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+BLAS *bvh_build_blas(const Sphere *spheres, int num_spheres, const BVHBuildParams *params)
+{
+    BLAS *blas = (BLAS *)calloc(1, sizeof(BLAS));
+    int *sphere_indices = (int *)malloc((num_spheres > 0 ? num_spheres : 1) * sizeof(int));
+    if (!blas || !sphere_indices)
+    {
+        printf("Failed to allocate a bottom level BVH of %d spheres\n", num_spheres);
+        free(blas);
+        free(sphere_indices);
+        return NULL;
+    }
+
+    BVHNode *root = num_spheres > 0 ? build_bvh(spheres, num_spheres, params, sphere_indices) : NULL;
+    blas->sphere_count = num_spheres;
+    blas->bounds = root ? root->bounds : create_empty_aabb();
+    blas->spheres = bvh_compact_spheres(spheres, sphere_indices, num_spheres);
+    blas->bvh = blas->spheres ? bvh_flatten(root, blas->spheres, NULL) : NULL;
+    free_bvh(root);
+    free(sphere_indices);
+
+    if (!blas->bvh)
+    {
+        free_blas(blas);
+        return NULL;
+    }
+    return blas;
+}
+
+void free_blas(BLAS *blas)
+{
+    if (!blas)
+        return;
+    free_linear_bvh(blas->bvh);
+    bvh_free_large(blas->spheres);
+    free(blas);
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// The top level is built by the binned builder over one leaf per instance. The leaves and the tree
+// above them only live until they are emitted into the node array.
+
+//----------------------------------------------------------------------------------------------------
+
+typedef struct TLASEmit
+{
+    TLAS *tlas;
+    int next;
+} TLASEmit;
+
+static void emit_tlas_node(TLASEmit *emit, const BVHNode *node, int depth)
+{
+    int index = emit->next++;
+    if (depth > emit->tlas->depth)
+        emit->tlas->depth = depth;
+
+    LinearBVHNode *out = &emit->tlas->nodes[index];
+    out->min[0] = node->bounds.min.x;
+    out->min[1] = node->bounds.min.y;
+    out->min[2] = node->bounds.min.z;
+    out->max[0] = node->bounds.max.x;
+    out->max[1] = node->bounds.max.y;
+    out->max[2] = node->bounds.max.z;
+    out->pad = 0;
+
+    if (node->left == NULL)
+    {
+        out->offset = node->first;
+        out->count = 1;
+        out->axis = 0;
+        return;
+    }
+
+    int axis = linear_bvh_ordering_axis(node->left->bounds, node->right->bounds);
+    const BVHNode *first = node->left;
+    const BVHNode *second = node->right;
+    if (linear_bvh_children_swapped(first->bounds, second->bounds, axis))
+    {
+        first = node->right;
+        second = node->left;
+    }
+
+    out->count = 0;
+    out->axis = (uint8_t)axis;
+    emit_tlas_node(emit, first, depth + 1);
+    out->offset = emit->next;
+    emit_tlas_node(emit, second, depth + 1);
+}
+
+int bvh_update_tlas(TLAS *tlas, const BVHBuildParams *params)
+{
+    BVHBuildParams defaults = bvh_default_build_params();
+    if (!params)
+        params = &defaults;
+
+    int count = tlas->instance_count;
+    BVHNode *leaves = (BVHNode *)malloc((count > 0 ? count : 1) * sizeof(BVHNode));
+    BVHNode **subtrees = (BVHNode **)malloc((count > 0 ? count : 1) * sizeof(BVHNode *));
+    BVHPrimRef *refs = (BVHPrimRef *)malloc((count > 0 ? count : 1) * sizeof(BVHPrimRef));
+    if (!leaves || !subtrees || !refs)
+    {
+        printf("Failed to allocate the top level BVH of %d instances\n", count);
+        free(leaves);
+        free(subtrees);
+        free(refs);
+        return 0;
+    }
+
+    // Instances of empty clusters get no leaf
+    int leaf_count = 0;
+    for (int i = 0; i < count; i++)
+    {
+        BVHInstance *instance = &tlas->instances[i];
+        instance->world_to_object = transform_inverse(&instance->object_to_world);
+        if (!instance->blas || instance->blas->sphere_count <= 0)
+        {
+            instance->bounds = create_empty_aabb();
+            continue;
+        }
+        instance->bounds = transform_bounds(&instance->object_to_world, instance->blas->bounds);
+
+        BVHNode *leaf = &leaves[leaf_count];
+        leaf->bounds = instance->bounds;
+        leaf->left = leaf->right = NULL;
+        leaf->first = i;
+        leaf->sphere_count = 1;
+        subtrees[leaf_count] = leaf;
+        refs[leaf_count].bounds = instance->bounds;
+        refs[leaf_count].centroid = vec3_multiply(vec3_add(instance->bounds.min, instance->bounds.max), 0.5f);
+        refs[leaf_count].index = leaf_count;
+        leaf_count++;
+    }
+
+    BVHNodeArena *arena = bvh_arena_create(bvh_thread_count(params));
+    BVHNode *root = NULL;
+    if (leaf_count > 0 && arena)
+    {
+#pragma omp parallel num_threads(bvh_thread_count(params))
+#pragma omp single
+        root = bvh_build_binned_subtrees(arena, refs, leaf_count, subtrees, NULL, params);
+    }
+
+    // A binary tree over the leaves, every interior node has two children
+    int node_count = leaf_count > 0 ? 2 * leaf_count - 1 : 0;
+    int ok = root != NULL || leaf_count == 0;
+    if (ok && node_count > tlas->node_count)
+    {
+        LinearBVHNode *nodes = (LinearBVHNode *)realloc(tlas->nodes, node_count * sizeof(LinearBVHNode));
+        if (nodes)
+            tlas->nodes = nodes;
+        else
+            ok = 0;
+    }
+
+    if (ok)
+    {
+        tlas->node_count = node_count;
+        tlas->depth = 0;
+        if (root)
+        {
+            TLASEmit emit = {.tlas = tlas, .next = 0};
+            emit_tlas_node(&emit, root, 1);
+        }
+        if (tlas->depth > LINEAR_BVH_MAX_DEPTH)
+        {
+            printf("TLAS depth %d exceeds the linear BVH limit of %d\n", tlas->depth, LINEAR_BVH_MAX_DEPTH);
+            tlas->node_count = 0;
+            ok = 0;
+        }
+    }
+    else
+    {
+        printf("Failed to build the top level BVH of %d instances\n", count);
+        tlas->node_count = 0;
+    }
+
+    bvh_arena_destroy(arena);
+    free(leaves);
+    free(subtrees);
+    free(refs);
+    return ok;
+}
+
+TLAS *bvh_build_tlas(BVHInstance *instances, int instance_count, const BVHBuildParams *params)
+{
+    TLAS *tlas = (TLAS *)calloc(1, sizeof(TLAS));
+    if (!tlas)
+        return NULL;
+    tlas->instances = instances;
+    tlas->instance_count = instance_count;
+
+    if (!bvh_update_tlas(tlas, params))
+    {
+        free_tlas(tlas);
+        return NULL;
+    }
+    return tlas;
+}
+
+void free_tlas(TLAS *tlas)
+{
+    if (!tlas)
+        return;
+    free(tlas->nodes);
+    free(tlas);
+}
+
+size_t bvh_blas_bytes(const BLAS *blas)
+{
+    if (!blas)
+        return 0;
+    return sizeof(BLAS) + sizeof(LinearBVH) + (size_t)blas->bvh->node_count * sizeof(LinearBVHNode) +
+           (size_t)blas->sphere_count * sizeof(Sphere);
+}
+
+size_t bvh_tlas_bytes(const TLAS *tlas)
+{
+    if (!tlas)
+        return 0;
+    return sizeof(TLAS) + (size_t)tlas->node_count * sizeof(LinearBVHNode) +
+           (size_t)tlas->instance_count * sizeof(BVHInstance);
+}
@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "Custom/bvh_layout.h"
+#include "Custom/bvh_memory.h"
+#include "Custom/bvh_restructure.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// Cache-aware node layouts
+// Once the nodes outgrow the caches, traversal time is mostly spent waiting for node fetches. The
+// depth-first order keeps a left child next to its parent, but the right child and everything
+// below it is far away, and the top levels that every ray visits are spread over the array.
+// bvh_cluster_layout() re-lays a flattened BVH out in units of sibling pairs:
+// - Both children of a node sit in one 64 byte cache line, so a visit to either fetches the other.
+//   The root shares the first line with a padding node.
+// - Pairs form a tree of their own: the pair below an interior child is that child's pair.
+// - BVH_LAYOUT_DEPTH_FIRST orders the pairs depth-first, the baseline for the other two.
+// - BVH_LAYOUT_VEB orders them van Emde Boas style: the top half of the levels first, recursively
+//   laid out the same way, then every subtree hanging below it. Every subtree of height h then
+//   spans O(1) blocks of any size that hold 2^h pairs, without knowing the block size.
+// - BVH_LAYOUT_TREELET fills page sized blocks greedily: starting from a treelet root, the pair with
+//   the highest probability of being visited (surface area of its parent over the root's) is taken
+//   next, until the block is full. The pairs left on the frontier become roots of later treelets.
+// The root and the top levels always come first, so they stay hot in one contiguous block.
+
+//----------------------------------------------------------------------------------------------------
+
+#define PAIRS_PER_PAGE (BVH_LAYOUT_PAGE_BYTES / BVH_LAYOUT_LINE_BYTES)
+
+// Pairs are identified by the flattened index of their parent, pair 0 holds the root's children
+typedef struct LayoutBuild
+{
+    const LinearBVH *source;
+    int *position;          // pair slot of every interior node's pair, -1 for leaves
+    int next;               // next free pair slot, slot 0 holds the root and the padding node
+} LayoutBuild;
+
+static const char *layout_names[] = {"depth-first", "van Emde Boas", "treelet"};
+
+const char *bvh_layout_name(BVHNodeLayout layout)
+{
+    if ((int)layout < 0 || (int)layout >= BVH_LAYOUT_COUNT)
+        return "unknown";
+    return layout_names[layout];
+}
+
+static int is_interior(const LinearBVH *bvh, int index)
+{
+    return bvh->nodes[index].count == 0;
+}
+
+// Child pairs of pair p, returns their number
+static int child_pairs(const LinearBVH *bvh, int p, int children[2])
+{
+    int count = 0;
+    if (is_interior(bvh, p + 1))
+        children[count++] = p + 1;
+    if (is_interior(bvh, bvh->nodes[p].offset))
+        children[count++] = bvh->nodes[p].offset;
+    return count;
+}
+
+static void place(LayoutBuild *build, int p)
+{
+    build->position[p] = build->next++;
+}
+
+static void layout_depth_first(LayoutBuild *build, int p)
+{
+    place(build, p);
+    int children[2];
+    int count = child_pairs(build->source, p, children);
+    for (int c = 0; c < count; c++)
+    {
+        layout_depth_first(build, children[c]);
+    }
+}
+
+static int pair_height(const LinearBVH *bvh, int p)
+{
+    int children[2];
+    int count = child_pairs(bvh, p, children);
+    int height = 0;
+    for (int c = 0; c < count; c++)
+    {
+        int child = pair_height(bvh, children[c]);
+        height = child > height ? child : height;
+    }
+    return height + 1;
+}
+
+static void layout_veb(LayoutBuild *build, int p, int height);
+
+// Lays out every pair depth levels below p as the root of a subtree of the given height
+static void layout_veb_frontier(LayoutBuild *build, int p, int depth, int height)
+{
+    if (depth == 0)
+    {
+        layout_veb(build, p, height);
+        return;
+    }
+    int children[2];
+    int count = child_pairs(build->source, p, children);
+    for (int c = 0; c < count; c++)
+    {
+        layout_veb_frontier(build, children[c], depth - 1, height);
+    }
+}
+
+// Lays out the top height levels of the subtree of p
+static void layout_veb(LayoutBuild *build, int p, int height)
+{
+    if (height == 1)
+    {
+        place(build, p);
+        return;
+    }
+    int top = (height + 1) / 2;
+    layout_veb(build, p, top);
+    layout_veb_frontier(build, p, top, height - top);
+}
+
+static float node_area(const LinearBVH *bvh, int index)
+{
+    const LinearBVHNode *node = &bvh->nodes[index];
+    AABB bounds = {{node->min[0], node->min[1], node->min[2]}, {node->max[0], node->max[1], node->max[2]}};
+    return get_aabb_surface_area(bounds);
+}
+
+// Share of the rays hitting the root that visit pair p: those hitting its parent
+static float pair_probability(const LinearBVH *bvh, int p, float root_area)
+{
+    return root_area > 0.0f ? node_area(bvh, p) / root_area : 1.0f;
+}
+
+static int layout_treelets(LayoutBuild *build, int pair_count)
+{
+    const LinearBVH *bvh = build->source;
+    float root_area = node_area(bvh, 0);
+    // Every pair enters the heap and the root queue at most once each. The heap is ordered by
+    // negated probability, likeliest pair first.
+    BVHHeapEntry *heap = (BVHHeapEntry *)malloc(pair_count * sizeof(BVHHeapEntry));
+    int *roots = (int *)malloc(pair_count * sizeof(int));
+    if (!heap || !roots)
+    {
+        free(heap);
+        free(roots);
+        return 0;
+    }
+
+    int root_head = 0, root_tail = 0;
+    roots[root_tail++] = 0;
+    int block_used = 1; // the root's own line
+    while (root_head < root_tail)
+    {
+        int heap_size = 0;
+        int first = roots[root_head++];
+        bvh_heap_push(heap, &heap_size, (BVHHeapEntry){-pair_probability(bvh, first, root_area), first});
+        while (heap_size > 0 && block_used < PAIRS_PER_PAGE)
+        {
+            BVHHeapEntry entry = bvh_heap_pop(heap, &heap_size);
+            place(build, entry.node);
+            block_used++;
+            int children[2];
+            int count = child_pairs(bvh, entry.node, children);
+            for (int c = 0; c < count; c++)
+            {
+                float probability = pair_probability(bvh, children[c], root_area);
+                bvh_heap_push(heap, &heap_size, (BVHHeapEntry){-probability, children[c]});
+            }
+        }
+        // The block is full: the rest of the frontier starts treelets of later blocks, likeliest first
+        while (heap_size > 0)
+        {
+            roots[root_tail++] = bvh_heap_pop(heap, &heap_size).node;
+        }
+        if (block_used == PAIRS_PER_PAGE)
+            block_used = 0;
+    }
+
+    free(heap);
+    free(roots);
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+ClusteredBVH *bvh_cluster_layout(const LinearBVH *source, BVHNodeLayout layout)
+{
+    ClusteredBVH *bvh = (ClusteredBVH *)calloc(1, sizeof(ClusteredBVH));
+    if (!bvh)
+        return NULL;
+    bvh->layout = layout;
+    bvh->depth = source->depth;
+    bvh->spheres = source->spheres;
+
+    int interior_count = 0, slots = 0;
+    for (int i = 0; i < source->node_count; i++)
+    {
+        if (is_interior(source, i))
+            interior_count++;
+        else if (source->nodes[i].offset + source->nodes[i].count > slots)
+            slots = source->nodes[i].offset + source->nodes[i].count;
+    }
+
+    bvh->node_count = source->node_count > 0 ? 2 * (interior_count + 1) : 0;
+    size_t node_bytes = (size_t)(bvh->node_count > 0 ? bvh->node_count : 1) * sizeof(LinearBVHNode);
+    bvh->node_memory = bvh_alloc_large(node_bytes + BVH_LAYOUT_PAGE_BYTES);
+    int *position = (int *)malloc((source->node_count > 0 ? source->node_count : 1) * sizeof(int));
+    if (source->sphere_indices)
+        bvh->sphere_indices = (int *)malloc((slots > 0 ? slots : 1) * sizeof(int));
+    if (!bvh->node_memory || !position || (source->sphere_indices && !bvh->sphere_indices))
+    {
+        free(position);
+        free_clustered_bvh(bvh);
+        return NULL;
+    }
+    bvh->nodes = (LinearBVHNode *)(((uintptr_t)bvh->node_memory + BVH_LAYOUT_PAGE_BYTES - 1) &
+                                   ~(uintptr_t)(BVH_LAYOUT_PAGE_BYTES - 1));
+    if (source->sphere_indices)
+        memcpy(bvh->sphere_indices, source->sphere_indices, slots * sizeof(int));
+    if (source->node_count == 0)
+    {
+        free(position);
+        return bvh;
+    }
+
+    for (int i = 0; i < source->node_count; i++)
+    {
+        position[i] = -1;
+    }
+    LayoutBuild build = {source, position, 1};
+    if (is_interior(source, 0))
+    {
+        int ok = 1;
+        switch (layout)
+        {
+        case BVH_LAYOUT_VEB:
+            layout_veb(&build, 0, pair_height(source, 0));
+            break;
+        case BVH_LAYOUT_TREELET:
+            ok = layout_treelets(&build, interior_count);
+            break;
+        case BVH_LAYOUT_DEPTH_FIRST:
+        default:
+            layout_depth_first(&build, 0);
+            break;
+        }
+        if (!ok)
+        {
+            free(position);
+            free_clustered_bvh(bvh);
+            return NULL;
+        }
+    }
+
+    // Every node lands in the pair slot its parent was given, the root in slot 0
+    memset(bvh->nodes, 0, 2 * sizeof(LinearBVHNode));
+    bvh->nodes[0] = source->nodes[0];
+    for (int p = 0; p < source->node_count; p++)
+    {
+        if (position[p] < 0)
+            continue;
+        int first = 2 * position[p];
+        const LinearBVHNode *children[2] = {&source->nodes[p + 1], &source->nodes[source->nodes[p].offset]};
+        int sources[2] = {p + 1, source->nodes[p].offset};
+        for (int c = 0; c < 2; c++)
+        {
+            LinearBVHNode *out = &bvh->nodes[first + c];
+            *out = *children[c];
+            if (out->count == 0)
+                out->offset = 2 * position[sources[c]];
+        }
+    }
+    if (is_interior(source, 0))
+        bvh->nodes[0].offset = 2 * position[0];
+
+    free(position);
+    return bvh;
+}
+
+void free_clustered_bvh(ClusteredBVH *bvh)
+{
+    if (!bvh)
+        return;
+    bvh_free_large(bvh->node_memory);
+    free(bvh->sphere_indices);
+    free(bvh);
+}
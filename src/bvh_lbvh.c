@@ -0,0 +1,308 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "Custom/bvh.h"
+#include "Custom/morton.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// Linear BVH (LBVH) construction from sorted Morton codes (Karras 2012)
+// Time Complexity - O( n ) apart from the radix sort, which is O( n * bits / 8 )
+// - Sphere centers are quantized to a 2^10 (30-bit codes) or 2^21 (63-bit codes) grid per axis over
+//   the centroid bounds, their Morton codes are radix sorted together with the sphere indices.
+// - A binary radix tree over the n sorted codes has exactly n - 1 internal nodes. Internal node i
+//   always covers a key range that starts or ends at i, so every internal node finds its range
+//   and its split position (the first bit where the codes of the range differ) on its own, without
+//   depending on any other node. All n - 1 nodes are therefore built in one parallel loop.
+// - Duplicate codes are made unique by falling back to the key indices when comparing prefixes.
+// - Bounds are filled in bottom-up while the radix tree is turned into BVHNodes.
+// - Sibling leaves are then merged into multi-sphere leaves where the SAH prefers them
+//   (bvh_collapse_leaves()); sorted spheres make every subtree a contiguous range.
+// Builds very fast but splits at spatial midpoints only, so traversal is slower than with SAH trees.
+
+//----------------------------------------------------------------------------------------------------
+
+typedef struct LBVHBuild
+{
+    const Sphere *spheres;
+    int *order;             // sphere indices in Morton order, the final leaf order
+    uint64_t *codes;
+    int count;
+    int base;               // slot of key 0 in the sphere index array
+    int *left;              // child of internal node i, >= 0 internal node, < 0 leaf ~index
+    int *right;
+    int *span;              // number of leaves below internal node i
+    BVHNodeArena *arena;
+} LBVHBuild;
+
+// Length of the common prefix of keys i and j, or -1 if j is outside the array
+static inline int common_prefix(const LBVHBuild *build, int i, int j)
+{
+    if (j < 0 || j >= build->count)
+        return -1;
+    uint64_t a = build->codes[i], b = build->codes[j];
+    if (a == b)
+        return 64 + __builtin_clz((unsigned int)(i ^ j));
+    return __builtin_clzll(a ^ b);
+}
+
+static void build_radix_node(LBVHBuild *build, int i)
+{
+    int d = common_prefix(build, i, i + 1) - common_prefix(build, i, i - 1) >= 0 ? 1 : -1;
+
+    // Upper bound for the length of the range, then binary search for its other end
+    int min_prefix = common_prefix(build, i, i - d);
+    int max_length = 2;
+    while (common_prefix(build, i, i + max_length * d) > min_prefix)
+    {
+        max_length *= 2;
+    }
+    int length = 0;
+    for (int t = max_length / 2; t >= 1; t /= 2)
+    {
+        if (common_prefix(build, i, i + (length + t) * d) > min_prefix)
+            length += t;
+    }
+    int j = i + length * d;
+
+    // Binary search for the last key that shares more than the range's common prefix with key i
+    int node_prefix = common_prefix(build, i, j);
+    int split = 0;
+    int t = length;
+    do
+    {
+        t = (t + 1) / 2;
+        if (common_prefix(build, i, i + (split + t) * d) > node_prefix)
+            split += t;
+    } while (t > 1);
+    int gamma = i + split * d + (d < 0 ? -1 : 0);
+
+    int first = i < j ? i : j;
+    int last = i < j ? j : i;
+    build->left[i] = first == gamma ? ~gamma : gamma;
+    build->right[i] = last == gamma + 1 ? ~(gamma + 1) : gamma + 1;
+    build->span[i] = last - first + 1;
+}
+
+static BVHNode *emit_lbvh_node(LBVHBuild *build, int child)
+{
+    BVHNode *node = bvh_arena_alloc_node(build->arena);
+    if (node == NULL)
+        return NULL;
+
+    if (child < 0)
+    {
+        int index = ~child;
+        node->bounds = create_aabb_from_sphere(&build->spheres[build->order[index]]);
+        node->left = node->right = NULL;
+        node->first = build->base + index;
+        node->sphere_count = 1;
+        return node;
+    }
+
+    if (build->span[child] > BVH_TASK_THRESHOLD)
+    {
+#pragma omp task
+        node->left = emit_lbvh_node(build, build->left[child]);
+        node->right = emit_lbvh_node(build, build->right[child]);
+#pragma omp taskwait
+    }
+    else
+    {
+        node->left = emit_lbvh_node(build, build->left[child]);
+        node->right = emit_lbvh_node(build, build->right[child]);
+    }
+    // The partial tree stays in the arena, released with it when the build fails
+    if (node->left == NULL || node->right == NULL)
+        return NULL;
+    node->bounds = grow_aabb(node->left->bounds, node->right->bounds);
+    node->first = 0;
+    node->sphere_count = 0;
+
+    return node;
+}
+
+// Radix tree over keys [first, first + count). Its count - 1 internal nodes use the slots of the
+// same range in the child arrays, so disjoint ranges can be built at the same time.
+static BVHNode *build_lbvh_range(const LBVHBuild *build, int first, int count)
+{
+    LBVHBuild range = {
+        .spheres = build->spheres,
+        .order = build->order + first,
+        .codes = build->codes + first,
+        .count = count,
+        .base = first,
+        .left = build->left + first,
+        .right = build->right + first,
+        .span = build->span + first,
+        .arena = build->arena};
+
+#pragma omp taskloop grainsize(BVH_PARALLEL_GRAIN)
+    for (int i = 0; i < count - 1; i++)
+    {
+        build_radix_node(&range, i);
+    }
+
+    return emit_lbvh_node(&range, count > 1 ? 0 : ~0);
+}
+
+static int alloc_lbvh_build(LBVHBuild *build, const Sphere *spheres, int num_spheres, int *sphere_indices)
+{
+    *build = (LBVHBuild){
+        .spheres = spheres,
+        .order = sphere_indices,
+        .codes = (uint64_t *)malloc(num_spheres * sizeof(uint64_t)),
+        .count = num_spheres,
+        .base = 0,
+        .left = (int *)malloc(num_spheres * sizeof(int)),
+        .right = (int *)malloc(num_spheres * sizeof(int)),
+        .span = (int *)malloc(num_spheres * sizeof(int)),
+        .arena = NULL};
+    return build->codes && build->left && build->right && build->span;
+}
+
+static void free_lbvh_build(LBVHBuild *build)
+{
+    free(build->codes);
+    free(build->left);
+    free(build->right);
+    free(build->span);
+}
+
+BVHNode *build_bvh_lbvh(const Sphere *spheres, int num_spheres, const BVHBuildParams *params, int *sphere_indices)
+{
+    if (num_spheres <= 0)
+        return NULL;
+
+    LBVHBuild build;
+    int ok = alloc_lbvh_build(&build, spheres, num_spheres, sphere_indices);
+
+    BVHNode *root = NULL;
+    if (ok)
+    {
+        int bits = params->morton_bits == MORTON_BITS_63 ? MORTON_BITS_63 : MORTON_BITS_30;
+        build.arena = bvh_arena_create(bvh_thread_count(params));
+
+#pragma omp parallel num_threads(bvh_thread_count(params))
+#pragma omp single
+        {
+            if (morton_sort_spheres(spheres, num_spheres, bits, build.codes, sphere_indices))
+            {
+                root = build_lbvh_range(&build, 0, num_spheres);
+                bvh_collapse_leaves(build.arena, root, bvh_max_leaf_size(params));
+            }
+            else
+            {
+                printf("Failed to allocate the LBVH Morton sort for %d spheres\n", num_spheres);
+            }
+        }
+    }
+    else
+    {
+        printf("Failed to allocate LBVH build data for %d spheres\n", num_spheres);
+    }
+
+    free_lbvh_build(&build);
+    bvh_arena_attach(build.arena, root);
+
+    return root;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// Hierarchical LBVH (HLBVH) construction
+// Time Complexity - O( n ) for the clusters, plus the SAH build over the k clusters
+// - Spheres are Morton sorted as for the LBVH. A single linear pass then cuts the sorted array into
+//   clusters wherever the top HLBVH_CLUSTER_BITS bits of the code change, i.e. one cluster per
+//   occupied cell of a 32 x 32 x 32 grid over the centroid bounds.
+// - Each cluster gets its own LBVH subtree (one task per cluster).
+// - The binned SAH builder (bvh_sah.c) then builds the upper levels, using the cluster bounding
+//   boxes as its primitives. The upper levels decide most of the traversal cost, so the tree comes
+//   close to a full SAH build while the build cost stays close to the LBVH.
+// - Leaves inside the clusters are merged into multi-sphere leaves as for the LBVH.
+
+//----------------------------------------------------------------------------------------------------
+
+#define HLBVH_CLUSTER_BITS 15
+
+BVHNode *build_bvh_hlbvh(const Sphere *spheres, int num_spheres, const BVHBuildParams *params, int *sphere_indices)
+{
+    if (num_spheres <= 0)
+        return NULL;
+
+    LBVHBuild build;
+    int *cluster_start = (int *)malloc((num_spheres + 1) * sizeof(int));
+    int ok = alloc_lbvh_build(&build, spheres, num_spheres, sphere_indices) && cluster_start;
+
+    BVHNode *root = NULL;
+    if (ok)
+    {
+        int bits = params->morton_bits == MORTON_BITS_63 ? MORTON_BITS_63 : MORTON_BITS_30;
+        int shift = bits - HLBVH_CLUSTER_BITS;
+        build.arena = bvh_arena_create(bvh_thread_count(params));
+
+#pragma omp parallel num_threads(bvh_thread_count(params))
+#pragma omp single
+        {
+            if (!morton_sort_spheres(spheres, num_spheres, bits, build.codes, sphere_indices))
+            {
+                printf("Failed to allocate the HLBVH Morton sort for %d spheres\n", num_spheres);
+            }
+            else
+            {
+                int num_clusters = 0;
+                for (int i = 0; i < num_spheres; i++)
+                {
+                    if (i == 0 || (build.codes[i] >> shift) != (build.codes[i - 1] >> shift))
+                        cluster_start[num_clusters++] = i;
+                }
+                cluster_start[num_clusters] = num_spheres;
+
+                BVHNode **clusters = (BVHNode **)malloc(num_clusters * sizeof(BVHNode *));
+                BVHPrimRef *refs = (BVHPrimRef *)malloc(num_clusters * sizeof(BVHPrimRef));
+
+                int failed = clusters == NULL || refs == NULL;
+                if (failed)
+                {
+                    printf("Failed to allocate the HLBVH top level for %d clusters\n", num_clusters);
+                }
+                else
+                {
+#pragma omp taskloop shared(failed)
+                    for (int c = 0; c < num_clusters; c++)
+                    {
+                        clusters[c] = build_lbvh_range(&build, cluster_start[c],
+                                                       cluster_start[c + 1] - cluster_start[c]);
+                        if (clusters[c] == NULL)
+                        {
+#pragma omp atomic write
+                            failed = 1;
+                            continue;
+                        }
+
+                        AABB bounds = clusters[c]->bounds;
+                        refs[c].bounds = bounds;
+                        refs[c].centroid = vec3_multiply(vec3_add(bounds.min, bounds.max), 0.5f);
+                        refs[c].index = c;
+                    }
+                }
+
+                if (!failed)
+                    root = bvh_build_binned_subtrees(build.arena, refs, num_clusters, clusters, NULL, params);
+                bvh_collapse_leaves(build.arena, root, bvh_max_leaf_size(params));
+
+                free(clusters);
+                free(refs);
+            }
+        }
+    }
+    else
+    {
+        printf("Failed to allocate HLBVH build data for %d spheres\n", num_spheres);
+    }
+
+    free_lbvh_build(&build);
+    free(cluster_start);
+    bvh_arena_attach(build.arena, root);
+
+    return root;
+}
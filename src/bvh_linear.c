@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "Custom/bvh_linear.h"
+#include "Custom/bvh_memory.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// bvh_flatten() - Converts the pointer tree of any builder into one contiguous array of 32 byte
+// nodes in depth-first order.
+// - The left child of an interior node is the next node, only the right child needs an index.
+// - A leaf stores its spheres as an offset/count range of sphere slots. With sphere indices, the
+//   flattened tree keeps its own copy of them, laid out in the depth-first order of its leaves.
+//   Without, the slots are the positions in a sphere array already in leaf order.
+// - The children are ordered along the axis in which their centers are furthest apart, so the
+//   traversal can visit the nearer child first from the sign of the ray direction alone.
+// - Empty leaves of build_bvh_node() are dropped and leaves above LINEAR_BVH_MAX_LEAF_SIZE spheres
+//   are split in halves, so the traversal never sees either.
+// - Nodes and sphere indices come from bvh_alloc_large(), so large trees sit on huge pages spread
+//   over the NUMA nodes.
+// The pointer tree is left untouched and can be freed afterwards.
+
+//----------------------------------------------------------------------------------------------------
+
+typedef struct LinearBuild
+{
+    LinearBVH *bvh;
+    Sphere *spheres;
+    const int *sphere_indices;
+    int next;
+    int next_slot;
+} LinearBuild;
+
+static int is_empty_leaf(const BVHNode *node)
+{
+    return node->left == NULL && node->sphere_count <= 0;
+}
+
+static int range_node_count(int count)
+{
+    if (count <= LINEAR_BVH_MAX_LEAF_SIZE)
+        return 1;
+    return 1 + range_node_count(count / 2) + range_node_count(count - count / 2);
+}
+
+static int linear_node_count(const BVHNode *node)
+{
+    if (node->left == NULL)
+        return node->sphere_count > 0 ? range_node_count(node->sphere_count) : 0;
+    if (is_empty_leaf(node->left))
+        return linear_node_count(node->right);
+    if (is_empty_leaf(node->right))
+        return linear_node_count(node->left);
+    return 1 + linear_node_count(node->left) + linear_node_count(node->right);
+}
+
+static void set_bounds(LinearBVHNode *out, AABB bounds)
+{
+    out->min[0] = bounds.min.x;
+    out->min[1] = bounds.min.y;
+    out->min[2] = bounds.min.z;
+    out->max[0] = bounds.max.x;
+    out->max[1] = bounds.max.y;
+    out->max[2] = bounds.max.z;
+}
+
+// Spheres [first, first + count) of a leaf, split until every piece fits into a node
+static AABB emit_range(LinearBuild *build, int first, int count, int depth)
+{
+    LinearBVHNode *out = &build->bvh->nodes[build->next++];
+    if (depth > build->bvh->depth)
+        build->bvh->depth = depth;
+
+    AABB bounds;
+    if (count <= LINEAR_BVH_MAX_LEAF_SIZE)
+    {
+        bounds = create_empty_aabb();
+        for (int i = first; i < first + count; i++)
+        {
+            bounds = grow_aabb(bounds, create_aabb_from_sphere(&build->spheres[bvh_leaf_sphere(build->sphere_indices, i)]));
+        }
+        out->offset = first;
+        if (build->sphere_indices)
+        {
+            memcpy(&build->bvh->sphere_indices[build->next_slot], &build->sphere_indices[first], count * sizeof(int));
+            out->offset = build->next_slot;
+            build->next_slot += count;
+        }
+        out->count = (uint16_t)count;
+        out->axis = 0;
+    }
+    else
+    {
+        AABB left = emit_range(build, first, count / 2, depth + 1);
+        out->offset = build->next;
+        AABB right = emit_range(build, first + count / 2, count - count / 2, depth + 1);
+        bounds = grow_aabb(left, right);
+        out->count = 0;
+        out->axis = 0;
+    }
+    out->pad = 0;
+    set_bounds(out, bounds);
+    return bounds;
+}
+
+static void emit_node(LinearBuild *build, const BVHNode *node, int depth)
+{
+    if (node->left == NULL)
+    {
+        emit_range(build, node->first, node->sphere_count, depth);
+        return;
+    }
+    if (is_empty_leaf(node->left))
+    {
+        emit_node(build, node->right, depth);
+        return;
+    }
+    if (is_empty_leaf(node->right))
+    {
+        emit_node(build, node->left, depth);
+        return;
+    }
+
+    int index = build->next++;
+    if (depth > build->bvh->depth)
+        build->bvh->depth = depth;
+
+    int axis = linear_bvh_ordering_axis(node->left->bounds, node->right->bounds);
+    const BVHNode *first = node->left;
+    const BVHNode *second = node->right;
+    if (linear_bvh_children_swapped(first->bounds, second->bounds, axis))
+    {
+        first = node->right;
+        second = node->left;
+    }
+
+    emit_node(build, first, depth + 1);
+    LinearBVHNode *out = &build->bvh->nodes[index];
+    out->offset = build->next;
+    emit_node(build, second, depth + 1);
+
+    set_bounds(out, node->bounds);
+    out->count = 0;
+    out->axis = (uint8_t)axis;
+    out->pad = 0;
+}
+
+LinearBVH *bvh_flatten(const BVHNode *root, Sphere *spheres, const int *sphere_indices)
+{
+    LinearBVH *bvh = (LinearBVH *)malloc(sizeof(LinearBVH));
+    if (!bvh)
+        return NULL;
+
+    int slots = bvh_sphere_count(root);
+    bvh->node_count = root ? linear_node_count(root) : 0;
+    bvh->depth = 0;
+    bvh->spheres = spheres;
+    bvh->nodes = (LinearBVHNode *)bvh_alloc_large((bvh->node_count > 0 ? bvh->node_count : 1) * sizeof(LinearBVHNode));
+    bvh->sphere_indices = sphere_indices ? (int *)bvh_alloc_large((slots > 0 ? slots : 1) * sizeof(int)) : NULL;
+    if (!bvh->nodes || (sphere_indices && !bvh->sphere_indices))
+    {
+        printf("Failed to allocate %d linear BVH nodes\n", bvh->node_count);
+        free_linear_bvh(bvh);
+        return NULL;
+    }
+
+    if (bvh->node_count > 0)
+    {
+        LinearBuild build = {.bvh = bvh, .spheres = spheres, .sphere_indices = sphere_indices, .next = 0, .next_slot = 0};
+        emit_node(&build, root, 1);
+    }
+
+    if (bvh->depth > LINEAR_BVH_MAX_DEPTH)
+    {
+        printf("BVH depth %d exceeds the linear BVH limit of %d\n", bvh->depth, LINEAR_BVH_MAX_DEPTH);
+        free_linear_bvh(bvh);
+        return NULL;
+    }
+    return bvh;
+}
+
+void free_linear_bvh(LinearBVH *bvh)
+{
+    if (!bvh)
+        return;
+    bvh_free_large(bvh->nodes);
+    bvh_free_large(bvh->sphere_indices);
+    free(bvh);
+}
@@ -0,0 +1,447 @@
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <SDL2/SDL.h>
+#include "Custom/bvh_memory.h"
+
+#ifndef _WIN32
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+//----------------------------------------------------------------------------------------------------
+
+// Huge page and NUMA aware allocation
+// The node array, the leaf ordered spheres and the framebuffer are large, read by every render
+// thread and touched first by a single one (the flattening or copying thread). With the kernel
+// defaults that costs twice:
+// - Random node fetches over a few hundred MiB of 4 KiB pages miss the TLB on almost every visit.
+//   Arrays of at least BVH_LARGE_ALLOC_MIN_BYTES are mapped 2 MiB aligned and backed by transparent
+//   huge pages (madvise(MADV_HUGEPAGE)), or by reserved 2 MiB pages (MAP_HUGETLB) when asked for and
+//   available, falling back to transparent ones otherwise.
+// - First touch puts every page on the builder's node, so the threads on the other socket trace
+//   across the interconnect and share one memory controller. The pages are interleaved over all
+//   nodes instead (mbind(MPOL_INTERLEAVE), a raw system call, libnuma is not required).
+// - Read-only trees can instead be replicated once per node (bvh_replicate()), and threads pinned to
+//   a node (bvh_pin_thread_to_node()) trace the replica of their node, so no fetch leaves the socket.
+// Every step is a hint: a kernel without NUMA support, a container that forbids mbind() or a machine
+// without huge pages gets regular pages on one node, never a failed allocation.
+// Smaller arrays come from malloc(). Either way the allocation starts with a BlockHeader, so
+// bvh_free_large() knows how to release it.
+
+//----------------------------------------------------------------------------------------------------
+
+#define BLOCK_ALIGNMENT 64
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+
+typedef enum BlockKind
+{
+    BLOCK_MALLOC,
+    BLOCK_MAPPED,
+} BlockKind;
+
+typedef struct BlockHeader
+{
+    void *base;         // start of the malloc() block or of the mapping
+    size_t size;        // mapped bytes
+    BlockKind kind;
+} BlockHeader;
+
+static BVHMemoryPolicy memory_policy = {BVH_HUGE_PAGES_TRANSPARENT, BVH_NUMA_INTERLEAVE};
+static int numa_nodes = 1;
+static SDL_atomic_t memory_policy_ready;
+static SDL_SpinLock memory_policy_lock = 0;
+
+// Highest node in /sys/devices/system/node/online ("0", "0-1", "0,2-3") plus one
+static int read_numa_node_count()
+{
+    int count = 1;
+#ifndef _WIN32
+    FILE *file = fopen("/sys/devices/system/node/online", "r");
+    if (!file)
+        return 1;
+    char line[256], *rest;
+    if (fgets(line, sizeof(line), file))
+    {
+        for (char *range = strtok_r(line, ",\n", &rest); range; range = strtok_r(NULL, ",\n", &rest))
+        {
+            int first, last;
+            int fields = sscanf(range, "%d-%d", &first, &last);
+            if (fields == 1)
+                last = first;
+            if (fields >= 1 && last + 1 > count)
+                count = last + 1;
+        }
+    }
+    fclose(file);
+#endif
+    return count < BVH_MAX_NUMA_NODES ? count : BVH_MAX_NUMA_NODES;
+}
+
+static void read_memory_policy(BVHMemoryPolicy *policy)
+{
+    const char *pages = getenv("BVH_HUGE_PAGES");
+    if (pages && strcmp(pages, "off") == 0)
+        policy->huge_pages = BVH_HUGE_PAGES_OFF;
+    else if (pages && strcmp(pages, "thp") == 0)
+        policy->huge_pages = BVH_HUGE_PAGES_TRANSPARENT;
+    else if (pages && strcmp(pages, "2mb") == 0)
+        policy->huge_pages = BVH_HUGE_PAGES_EXPLICIT;
+    else if (pages)
+        printf("Ignoring BVH_HUGE_PAGES=%s: expected off, thp or 2mb\n", pages);
+
+    const char *placement = getenv("BVH_NUMA");
+    if (placement && strcmp(placement, "local") == 0)
+        policy->placement = BVH_NUMA_FIRST_TOUCH;
+    else if (placement && strcmp(placement, "interleave") == 0)
+        policy->placement = BVH_NUMA_INTERLEAVE;
+    else if (placement)
+        printf("Ignoring BVH_NUMA=%s: expected local or interleave\n", placement);
+}
+
+static void init_memory_policy()
+{
+    if (SDL_AtomicGet(&memory_policy_ready))
+        return;
+    SDL_AtomicLock(&memory_policy_lock);
+    if (!SDL_AtomicGet(&memory_policy_ready))
+    {
+        read_memory_policy(&memory_policy);
+        numa_nodes = read_numa_node_count();
+        SDL_AtomicSet(&memory_policy_ready, 1);
+    }
+    SDL_AtomicUnlock(&memory_policy_lock);
+}
+
+BVHMemoryPolicy bvh_memory_policy()
+{
+    init_memory_policy();
+    SDL_AtomicLock(&memory_policy_lock);
+    BVHMemoryPolicy policy = memory_policy;
+    SDL_AtomicUnlock(&memory_policy_lock);
+    return policy;
+}
+
+void bvh_set_memory_policy(BVHMemoryPolicy policy)
+{
+    init_memory_policy();
+    SDL_AtomicLock(&memory_policy_lock);
+    memory_policy = policy;
+    SDL_AtomicUnlock(&memory_policy_lock);
+}
+
+int bvh_numa_node_count()
+{
+    init_memory_policy();
+    return numa_nodes;
+}
+
+int bvh_numa_current_node()
+{
+#if !defined(_WIN32) && defined(SYS_getcpu)
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0 && (int)node < bvh_numa_node_count())
+        return (int)node;
+#endif
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+static void *header_payload(BlockHeader *header)
+{
+    return (char *)header + sizeof(BlockHeader);
+}
+
+static BlockHeader *payload_header(void *memory)
+{
+    return (BlockHeader *)((char *)memory - sizeof(BlockHeader));
+}
+
+static void *alloc_small(size_t bytes)
+{
+    void *base = malloc(bytes + sizeof(BlockHeader) + BLOCK_ALIGNMENT);
+    if (!base)
+        return NULL;
+    uintptr_t payload = ((uintptr_t)base + sizeof(BlockHeader) + BLOCK_ALIGNMENT - 1) & ~(uintptr_t)(BLOCK_ALIGNMENT - 1);
+    BlockHeader *header = payload_header((void *)payload);
+    *header = (BlockHeader){base, 0, BLOCK_MALLOC};
+    return (void *)payload;
+}
+
+#ifndef _WIN32
+// Placement hint for a fresh mapping, before any of its pages has been touched
+static void place_pages(void *base, size_t size, int node)
+{
+#ifdef SYS_mbind
+    int nodes = bvh_numa_node_count();
+    if (nodes < 2)
+        return;
+    unsigned long mask[BVH_MAX_NUMA_NODES / (8 * sizeof(unsigned long)) + 1] = {0};
+    int mode;
+    if (node >= 0)
+    {
+        mask[node / (8 * sizeof(unsigned long))] |= 1ul << (node % (8 * sizeof(unsigned long)));
+        mode = MPOL_PREFERRED;
+    }
+    else if (bvh_memory_policy().placement == BVH_NUMA_INTERLEAVE)
+    {
+        for (int n = 0; n < nodes; n++)
+        {
+            mask[n / (8 * sizeof(unsigned long))] |= 1ul << (n % (8 * sizeof(unsigned long)));
+        }
+        mode = MPOL_INTERLEAVE;
+    }
+    else
+        return;
+    // maxnode counts one past the highest bit the kernel reads
+    syscall(SYS_mbind, base, size, mode, mask, (unsigned long)nodes + 1, 0ul);
+#else
+    (void)base;
+    (void)size;
+    (void)node;
+#endif
+}
+
+// A 2 MiB aligned mapping of at least size bytes, backed by huge pages if the policy asks for them
+static void *map_pages(size_t size, size_t *mapped)
+{
+    BVHHugePages huge_pages = bvh_memory_policy().huge_pages;
+    size = (size + BVH_HUGE_PAGE_BYTES - 1) / BVH_HUGE_PAGE_BYTES * BVH_HUGE_PAGE_BYTES;
+    *mapped = size;
+
+#ifdef MAP_HUGETLB
+    if (huge_pages == BVH_HUGE_PAGES_EXPLICIT)
+    {
+        void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base != MAP_FAILED)
+            return base;
+    }
+#endif
+
+    // Over-allocate by one huge page and trim both ends to get an aligned mapping
+    char *base = (char *)mmap(NULL, size + BVH_HUGE_PAGE_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    char *aligned = (char *)(((uintptr_t)base + BVH_HUGE_PAGE_BYTES - 1) & ~(uintptr_t)(BVH_HUGE_PAGE_BYTES - 1));
+    if (aligned > base)
+        munmap(base, aligned - base);
+    if (aligned + size < base + size + BVH_HUGE_PAGE_BYTES)
+        munmap(aligned + size, base + size + BVH_HUGE_PAGE_BYTES - (aligned + size));
+#ifdef MADV_HUGEPAGE
+    if (huge_pages != BVH_HUGE_PAGES_OFF)
+        madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
+#endif
+
+static void *alloc_large(size_t bytes, int node)
+{
+#ifndef _WIN32
+    if (bytes >= BVH_LARGE_ALLOC_MIN_BYTES)
+    {
+        size_t mapped;
+        void *base = map_pages(bytes + BLOCK_ALIGNMENT, &mapped);
+        if (base)
+        {
+            place_pages(base, mapped, node);
+            // The header takes the first line, the payload starts on the second
+            BlockHeader *header = (BlockHeader *)((char *)base + BLOCK_ALIGNMENT - sizeof(BlockHeader));
+            *header = (BlockHeader){base, mapped, BLOCK_MAPPED};
+            return header_payload(header);
+        }
+    }
+#else
+    (void)node;
+#endif
+    return alloc_small(bytes);
+}
+
+void *bvh_alloc_large(size_t bytes)
+{
+    return alloc_large(bytes, -1);
+}
+
+void *bvh_alloc_large_on_node(size_t bytes, int node)
+{
+    return alloc_large(bytes, node >= 0 && node < bvh_numa_node_count() ? node : -1);
+}
+
+void bvh_free_large(void *memory)
+{
+    if (!memory)
+        return;
+    BlockHeader *header = payload_header(memory);
+#ifndef _WIN32
+    if (header->kind == BLOCK_MAPPED)
+    {
+        munmap(header->base, header->size);
+        return;
+    }
+#endif
+    free(header->base);
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// Thread pinning, Linux only: the CPUs of a node are listed in /sys/devices/system/node/nodeN/cpulist
+
+//----------------------------------------------------------------------------------------------------
+
+int bvh_pin_thread_to_node(int node, BVHThreadAffinity *previous)
+{
+    if (previous)
+        previous->saved = 0;
+#ifndef _WIN32
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return 0;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    char line[1024], *rest;
+    if (fgets(line, sizeof(line), file))
+    {
+        for (char *range = strtok_r(line, ",\n", &rest); range; range = strtok_r(NULL, ",\n", &rest))
+        {
+            int first, last;
+            int fields = sscanf(range, "%d-%d", &first, &last);
+            if (fields == 1)
+                last = first;
+            for (int cpu = first; fields >= 1 && cpu <= last && cpu < CPU_SETSIZE; cpu++)
+            {
+                CPU_SET(cpu, &cpus);
+            }
+        }
+    }
+    fclose(file);
+    if (CPU_COUNT(&cpus) == 0)
+        return 0;
+
+    if (previous && sizeof(previous->cpus) >= sizeof(cpu_set_t))
+    {
+        cpu_set_t current;
+        if (sched_getaffinity(0, sizeof(current), &current) == 0)
+        {
+            memcpy(previous->cpus, &current, sizeof(current));
+            previous->saved = 1;
+        }
+    }
+    return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+#else
+    (void)node;
+    return 0;
+#endif
+}
+
+void bvh_restore_thread_affinity(const BVHThreadAffinity *previous)
+{
+#ifndef _WIN32
+    if (previous && previous->saved)
+    {
+        cpu_set_t cpus;
+        memcpy(&cpus, previous->cpus, sizeof(cpus));
+        sched_setaffinity(0, sizeof(cpus), &cpus);
+    }
+#else
+    (void)previous;
+#endif
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// Replication: every replica is one allocation on its node holding the nodes, the sphere indices
+// and every sphere the leaves reach, so a pinned thread never reads another node's memory.
+
+//----------------------------------------------------------------------------------------------------
+
+static size_t align_block(size_t offset)
+{
+    return (offset + BLOCK_ALIGNMENT - 1) / BLOCK_ALIGNMENT * BLOCK_ALIGNMENT;
+}
+
+BVHReplicas *bvh_replicate(const LinearBVH *bvh)
+{
+    BVHReplicas *replicas = (BVHReplicas *)calloc(1, sizeof(BVHReplicas));
+    if (!replicas)
+        return NULL;
+
+    int slots = 0;
+    for (int i = 0; i < bvh->node_count; i++)
+    {
+        if (bvh->nodes[i].count > 0 && bvh->nodes[i].offset + bvh->nodes[i].count > slots)
+            slots = bvh->nodes[i].offset + bvh->nodes[i].count;
+    }
+    int sphere_count = slots;
+    if (bvh->sphere_indices)
+    {
+        sphere_count = 0;
+        for (int slot = 0; slot < slots; slot++)
+        {
+            if (bvh->sphere_indices[slot] + 1 > sphere_count)
+                sphere_count = bvh->sphere_indices[slot] + 1;
+        }
+    }
+
+    size_t node_bytes = (size_t)bvh->node_count * sizeof(LinearBVHNode);
+    size_t index_bytes = bvh->sphere_indices ? (size_t)slots * sizeof(int) : 0;
+    size_t sphere_bytes = (size_t)sphere_count * sizeof(Sphere);
+    size_t index_offset = align_block(node_bytes);
+    size_t sphere_offset = align_block(index_offset + index_bytes);
+    size_t total_bytes = sphere_offset + sphere_bytes;
+
+    int nodes = bvh_numa_node_count();
+    for (int node = 0; node < nodes; node++)
+    {
+        char *memory = (char *)bvh_alloc_large_on_node(total_bytes > 0 ? total_bytes : 1, node);
+        if (!memory)
+        {
+            printf("Failed to allocate the BVH replica of NUMA node %d\n", node);
+            free_bvh_replicas(replicas);
+            return NULL;
+        }
+        LinearBVH *replica = &replicas->replicas[node];
+        *replica = *bvh;
+        replica->nodes = (LinearBVHNode *)memory;
+        replica->sphere_indices = bvh->sphere_indices ? (int *)(memory + index_offset) : NULL;
+        replica->spheres = (Sphere *)(memory + sphere_offset);
+        memcpy(replica->nodes, bvh->nodes, node_bytes);
+        if (replica->sphere_indices)
+            memcpy(replica->sphere_indices, bvh->sphere_indices, index_bytes);
+        memcpy(replica->spheres, bvh->spheres, sphere_bytes);
+        replicas->memory[node] = memory;
+        replicas->count = node + 1;
+    }
+    return replicas;
+}
+
+const LinearBVH *bvh_replica_for_node(const BVHReplicas *replicas, int node)
+{
+    return &replicas->replicas[node >= 0 && node < replicas->count ? node : 0];
+}
+
+void free_bvh_replicas(BVHReplicas *replicas)
+{
+    if (!replicas)
+        return;
+    for (int node = 0; node < replicas->count; node++)
+    {
+        bvh_free_large(replicas->memory[node]);
+    }
+    free(replicas);
+}
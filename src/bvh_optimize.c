@@ -0,0 +1,530 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "Custom/bvh_optimize.h"
+#include "Custom/bvh_restructure.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//----------------------------------------------------------------------------------------------------
+
+// Treelet restructuring (TRBVH, Karras and Aila 2013)
+// Post-build optimization of an existing tree from any builder, without rebuilding it.
+// - A treelet is grown from a node by repeatedly expanding the treelet leaf with the largest
+//   surface area, until it has BVH_TREELET_LEAVES leaves. Its leaves are whole subtrees.
+// - The subtree costs below the treelet leaves do not depend on how the treelet is wired, so the
+//   best topology is the one with the smallest total surface area of its internal nodes. Dynamic
+//   programming over all subsets of the treelet leaves finds it exactly: for every subset, the
+//   cheapest way to split it into two smaller ones (3^7 partitions for 7 leaves).
+// - The treelet is then rewired in place, reusing its own internal nodes, so no memory is
+//   allocated and the treelet root keeps its address.
+// Treelets are processed bottom-up, children before parents, and disjoint subtrees are processed
+// as parallel tasks. Every pass visits each node with at least BVH_TREELET_LEAVES leaves below it.
+
+//----------------------------------------------------------------------------------------------------
+
+#define TREELET_SUBSETS (1 << BVH_TREELET_LEAVES)
+
+typedef struct Treelet
+{
+    BVHNode *internal[BVH_TREELET_LEAVES - 1];
+    BVHNode *leaves[BVH_TREELET_LEAVES];
+    int internal_count;
+    int leaf_count;
+    AABB bounds[TREELET_SUBSETS];       // union of the bounds of every subset of leaves
+    float area[TREELET_SUBSETS];
+    float cost[TREELET_SUBSETS];        // smallest total area of the internal nodes of a subset
+    unsigned char split[TREELET_SUBSETS];
+} Treelet;
+
+static int is_leaf(const BVHNode *node)
+{
+    return node->left == NULL;
+}
+
+static void form_treelet(Treelet *t, BVHNode *root)
+{
+    t->internal[0] = root;
+    t->internal_count = 1;
+    t->leaves[0] = root->left;
+    t->leaves[1] = root->right;
+    t->leaf_count = 2;
+
+    while (t->leaf_count < BVH_TREELET_LEAVES)
+    {
+        int largest = -1;
+        float largest_area = -1.0f;
+        for (int i = 0; i < t->leaf_count; i++)
+        {
+            if (is_leaf(t->leaves[i]))
+                continue;
+            float area = get_aabb_surface_area(t->leaves[i]->bounds);
+            if (area > largest_area)
+            {
+                largest_area = area;
+                largest = i;
+            }
+        }
+        if (largest < 0)
+            break;
+
+        BVHNode *expanded = t->leaves[largest];
+        t->internal[t->internal_count++] = expanded;
+        t->leaves[largest] = expanded->left;
+        t->leaves[t->leaf_count++] = expanded->right;
+    }
+}
+
+static void find_best_topology(Treelet *t)
+{
+    int subsets = 1 << t->leaf_count;
+
+    // Each subset's bounds grow those of the subset without its lowest leaf
+    t->bounds[0] = create_empty_aabb();
+    for (int s = 1; s < subsets; s++)
+    {
+        t->bounds[s] = grow_aabb(t->bounds[s & (s - 1)], t->leaves[__builtin_ctz(s)]->bounds);
+        t->area[s] = get_aabb_surface_area(t->bounds[s]);
+        t->cost[s] = 0.0f;
+    }
+
+    // Subsets in increasing order visit all smaller subsets of s before s itself
+    for (int s = 1; s < subsets; s++)
+    {
+        if ((s & (s - 1)) == 0)
+            continue;
+
+        // Only partitions whose first half holds the lowest leaf, the mirrored ones cost the same
+        int lowest = s & -s;
+        int rest = s ^ lowest;
+        float best = INFINITY;
+        int best_part = 0;
+        for (int others = (rest - 1) & rest;; others = (others - 1) & rest)
+        {
+            int part = others | lowest;
+            float cost = t->cost[part] + t->cost[s ^ part];
+            if (cost < best)
+            {
+                best = cost;
+                best_part = part;
+            }
+            if (others == 0)
+                break;
+        }
+        t->cost[s] = t->area[s] + best;
+        t->split[s] = (unsigned char)best_part;
+    }
+}
+
+static BVHNode *rebuild_treelet(Treelet *t, int subset, int *next_internal)
+{
+    if ((subset & (subset - 1)) == 0)
+        return t->leaves[__builtin_ctz(subset)];
+
+    BVHNode *node = t->internal[(*next_internal)++];
+    int part = t->split[subset];
+    node->left = rebuild_treelet(t, part, next_internal);
+    node->right = rebuild_treelet(t, subset ^ part, next_internal);
+    node->bounds = grow_aabb(node->left->bounds, node->right->bounds);
+    return node;
+}
+
+static float treelet_internal_area(const BVHNode *node, const Treelet *t)
+{
+    for (int i = 0; i < t->leaf_count; i++)
+    {
+        if (node == t->leaves[i])
+            return 0.0f;
+    }
+    return get_aabb_surface_area(node->bounds) +
+           treelet_internal_area(node->left, t) + treelet_internal_area(node->right, t);
+}
+
+static void restructure_treelet(BVHNode *root)
+{
+    Treelet t;
+    form_treelet(&t, root);
+    if (t.leaf_count < 3)
+        return;
+
+    find_best_topology(&t);
+    int all = (1 << t.leaf_count) - 1;
+    if (t.cost[all] >= treelet_internal_area(root, &t))
+        return;
+
+    int next_internal = 0;
+    rebuild_treelet(&t, all, &next_internal);
+}
+
+// Subtree sizes are not stored in the nodes, so the top levels of the tree become tasks instead
+#define TREELET_TASK_DEPTH 12
+
+// Optimizes the treelets below node before the one rooted at node, returns its number of leaves
+static int optimize_subtree(BVHNode *node, int depth)
+{
+    if (is_leaf(node))
+        return 1;
+
+    int left_leaves, right_leaves;
+    if (depth < TREELET_TASK_DEPTH)
+    {
+#pragma omp task shared(left_leaves)
+        left_leaves = optimize_subtree(node->left, depth + 1);
+        right_leaves = optimize_subtree(node->right, depth + 1);
+#pragma omp taskwait
+    }
+    else
+    {
+        left_leaves = optimize_subtree(node->left, depth + 1);
+        right_leaves = optimize_subtree(node->right, depth + 1);
+    }
+
+    int leaves = left_leaves + right_leaves;
+    if (leaves >= BVH_TREELET_LEAVES)
+        restructure_treelet(node);
+    return leaves;
+}
+
+void bvh_optimize_treelets(BVHNode *root, int passes, int num_threads)
+{
+    if (root == NULL || is_leaf(root))
+        return;
+
+    BVHBuildParams params = bvh_default_build_params();
+    params.num_threads = num_threads;
+
+#pragma omp parallel num_threads(bvh_thread_count(&params))
+#pragma omp single
+    {
+        for (int pass = 0; pass < passes; pass++)
+        {
+            optimize_subtree(root, 0);
+        }
+    }
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// Insertion-based optimization (Bittner, Hapala and Havran 2013)
+// Repairs trees degraded by refits or built by the fast Morton code builders. Every pass
+// - ranks the internal nodes by how badly they bound their children: the product of the node's
+//   area, its area over the mean child area and its area over the smaller child area,
+// - takes the worst batch_fraction of them and, one at a time, removes the node and its parent
+//   from the tree (the sibling takes the parent's place),
+// - reinserts the two orphaned children, larger first, next to the node where the total area added
+//   to the tree is lowest. A branch and bound search over the tree finds that node: the area every
+//   ancestor has to grow by only increases on the way down, so whole subtrees are skipped.
+// Removed nodes are reused for the reinsertions, so the node count never changes. Optional tree
+// rotations (Kensler 2008) then swap a child with a grandchild wherever that shrinks the
+// grandchild's parent. Removal and reinsertion depend on each other and run serially.
+// The tree is optimized on index arrays with parent links. A pass is written back into the caller's
+// nodes, keeping the root at the same address, only if it lowers the SAH cost of the arrays;
+// the first pass that does not ends the optimization with the tree as it was before that pass.
+
+//----------------------------------------------------------------------------------------------------
+
+typedef struct InsertionTree
+{
+    BVHNode **objects;      // the caller's nodes, indexed like the arrays below
+    AABB *bounds;
+    int *left;              // -1 for leaves
+    int *right;
+    int *parent;            // -1 for the root
+    BVHHeapEntry *heap;     // branch and bound queue, also the candidate list by inefficiency
+    int root;
+    int root_object;        // index whose object is the caller's root node
+    int count;
+} InsertionTree;
+
+BVHInsertionParams bvh_default_insertion_params()
+{
+    return (BVHInsertionParams){
+        .max_passes = BVH_DEFAULT_INSERTION_PASSES,
+        .batch_fraction = BVH_DEFAULT_INSERTION_BATCH,
+        .rotations = 1,
+        .report = 0};
+}
+
+static int count_nodes(const BVHNode *node)
+{
+    return is_leaf(node) ? 1 : 1 + count_nodes(node->left) + count_nodes(node->right);
+}
+
+static int flatten_node(InsertionTree *tree, BVHNode *node, int parent, int *next)
+{
+    int index = (*next)++;
+    tree->objects[index] = node;
+    tree->bounds[index] = node->bounds;
+    tree->parent[index] = parent;
+    tree->left[index] = tree->right[index] = -1;
+    if (!is_leaf(node))
+    {
+        tree->left[index] = flatten_node(tree, node->left, index, next);
+        tree->right[index] = flatten_node(tree, node->right, index, next);
+    }
+    return index;
+}
+
+static void write_back(InsertionTree *tree)
+{
+    // Internal nodes are interchangeable, so the caller's root object moves to wherever the root is
+    if (tree->root != tree->root_object)
+    {
+        BVHNode *swap = tree->objects[tree->root_object];
+        tree->objects[tree->root_object] = tree->objects[tree->root];
+        tree->objects[tree->root] = swap;
+        tree->root_object = tree->root;
+    }
+
+    for (int i = 0; i < tree->count; i++)
+    {
+        if (tree->left[i] < 0)
+            continue;
+        BVHNode *node = tree->objects[i];
+        node->left = tree->objects[tree->left[i]];
+        node->right = tree->objects[tree->right[i]];
+        node->bounds = tree->bounds[i];
+    }
+}
+
+static float node_area(const InsertionTree *tree, int node)
+{
+    return get_aabb_surface_area(tree->bounds[node]);
+}
+
+// bvh_sah_cost() of the tree held by the arrays, the leaves are unchanged caller's nodes
+static float array_sah_cost(const InsertionTree *tree)
+{
+    BVHCostModel costs = bvh_cost_model();
+    float total = 0.0f;
+    for (int i = 0; i < tree->count; i++)
+    {
+        if (tree->left[i] >= 0)
+            total += costs.traversal_cost * node_area(tree, i);
+        else if (tree->objects[i]->sphere_count > 0)
+            total += costs.intersect_cost * node_area(tree, i) * tree->objects[i]->sphere_count;
+    }
+    float root_area = node_area(tree, tree->root);
+    return root_area > 0.0f ? total / root_area : 0.0f;
+}
+
+static void refit_upward(InsertionTree *tree, int node)
+{
+    while (node >= 0)
+    {
+        tree->bounds[node] = grow_aabb(tree->bounds[tree->left[node]], tree->bounds[tree->right[node]]);
+        node = tree->parent[node];
+    }
+}
+
+static void replace_child(InsertionTree *tree, int parent, int old_child, int new_child)
+{
+    tree->parent[new_child] = parent;
+    if (parent < 0)
+        tree->root = new_child;
+    else if (tree->left[parent] == old_child)
+        tree->left[parent] = new_child;
+    else
+        tree->right[parent] = new_child;
+}
+
+// Node whose new parent, holding it and box, adds the least area to the tree
+static int find_best_sibling(InsertionTree *tree, AABB box)
+{
+    BVHSiblingSearch search;
+    bvh_sibling_search_start(&search, tree->heap, tree->root, box);
+    int node;
+    while ((node = bvh_sibling_search_next(&search)) >= 0)
+    {
+        if (bvh_sibling_search_visit(&search, node, tree->bounds[node], tree->left[node] >= 0))
+        {
+            bvh_sibling_search_push(&search, tree->left[node]);
+            bvh_sibling_search_push(&search, tree->right[node]);
+        }
+    }
+    return search.best;
+}
+
+// Puts node back into the tree under the free internal node slot
+static void insert_node(InsertionTree *tree, int node, int slot)
+{
+    int sibling = find_best_sibling(tree, tree->bounds[node]);
+    replace_child(tree, tree->parent[sibling], sibling, slot);
+    tree->left[slot] = sibling;
+    tree->right[slot] = node;
+    tree->parent[sibling] = slot;
+    tree->parent[node] = slot;
+    refit_upward(tree, slot);
+}
+
+static void remove_and_reinsert(InsertionTree *tree, int node)
+{
+    int parent = tree->parent[node];
+    if (parent < 0)
+        return;
+
+    int sibling = tree->left[parent] == node ? tree->right[parent] : tree->left[parent];
+    int grandparent = tree->parent[parent];
+    replace_child(tree, grandparent, parent, sibling);
+    if (grandparent >= 0)
+        refit_upward(tree, grandparent);
+
+    int first = tree->left[node];
+    int second = tree->right[node];
+    if (node_area(tree, second) > node_area(tree, first))
+    {
+        first = tree->right[node];
+        second = tree->left[node];
+    }
+    insert_node(tree, first, node);
+    insert_node(tree, second, parent);
+}
+
+static int compare_inefficiency(const void *a, const void *b)
+{
+    const BVHHeapEntry *ea = (const BVHHeapEntry *)a;
+    const BVHHeapEntry *eb = (const BVHHeapEntry *)b;
+    if (ea->cost != eb->cost)
+        return ea->cost < eb->cost ? 1 : -1;
+    return ea->node - eb->node;
+}
+
+// Returns 0 if the batch could not be allocated, the tree is left untouched then
+static int insertion_pass(InsertionTree *tree, float batch_fraction)
+{
+    int candidates = 0;
+    for (int i = 0; i < tree->count; i++)
+    {
+        if (tree->left[i] < 0 || i == tree->root)
+            continue;
+        float area = node_area(tree, i);
+        float left_area = node_area(tree, tree->left[i]);
+        float right_area = node_area(tree, tree->right[i]);
+        float sum_ratio = area / max_f(0.5f * (left_area + right_area), 1e-20f);
+        float min_ratio = area / max_f(min_f(left_area, right_area), 1e-20f);
+        tree->heap[candidates++] = (BVHHeapEntry){area * sum_ratio * min_ratio, i};
+    }
+    qsort(tree->heap, candidates, sizeof(BVHHeapEntry), compare_inefficiency);
+
+    int batch = (int)(candidates * batch_fraction);
+    batch = batch < 1 ? 1 : (batch > candidates ? candidates : batch);
+
+    // The search below reuses the heap, so the batch is copied out first
+    int *selected = (int *)malloc(batch * sizeof(int));
+    if (!selected)
+    {
+        printf("Failed to allocate an insertion batch of %d nodes\n", batch);
+        return 0;
+    }
+    for (int i = 0; i < batch; i++)
+    {
+        selected[i] = tree->heap[i].node;
+    }
+    for (int i = 0; i < batch; i++)
+    {
+        remove_and_reinsert(tree, selected[i]);
+    }
+    free(selected);
+    return 1;
+}
+
+// Swaps a child of node with a grandchild below the other child, if that shrinks the other child
+static void rotate_node(InsertionTree *tree, int node)
+{
+    int children[2] = {tree->left[node], tree->right[node]};
+    AABB bounds[2], below[2][2];
+    const AABB *grandchildren[2];
+    for (int c = 0; c < 2; c++)
+    {
+        bounds[c] = tree->bounds[children[c]];
+        grandchildren[c] = NULL;
+        if (tree->left[children[c]] >= 0)
+        {
+            below[c][0] = tree->bounds[tree->left[children[c]]];
+            below[c][1] = tree->bounds[tree->right[children[c]]];
+            grandchildren[c] = below[c];
+        }
+    }
+
+    int side, g;
+    if (!bvh_best_rotation(bounds, grandchildren, &side, &g))
+        return;
+
+    int child = children[side];
+    int other = children[1 - side];
+    int grandchild = g == 0 ? tree->left[other] : tree->right[other];
+    replace_child(tree, node, child, grandchild);
+    replace_child(tree, other, grandchild, child);
+    tree->bounds[other] = grow_aabb(tree->bounds[tree->left[other]], tree->bounds[tree->right[other]]);
+}
+
+static void rotate_subtree(InsertionTree *tree, int node)
+{
+    if (tree->left[node] < 0)
+        return;
+    rotate_subtree(tree, tree->left[node]);
+    rotate_subtree(tree, tree->right[node]);
+    rotate_node(tree, node);
+}
+
+float bvh_optimize_insertion(BVHNode *root, const BVHInsertionParams *params)
+{
+    BVHInsertionParams defaults = bvh_default_insertion_params();
+    if (!params)
+        params = &defaults;
+    if (root == NULL || is_leaf(root))
+        return bvh_sah_cost(root);
+
+    int count = count_nodes(root);
+    InsertionTree tree = {
+        .objects = (BVHNode **)malloc(count * sizeof(BVHNode *)),
+        .bounds = (AABB *)malloc(count * sizeof(AABB)),
+        .left = (int *)malloc(count * sizeof(int)),
+        .right = (int *)malloc(count * sizeof(int)),
+        .parent = (int *)malloc(count * sizeof(int)),
+        .heap = (BVHHeapEntry *)malloc(count * sizeof(BVHHeapEntry)),
+        .root = 0,
+        .root_object = 0,
+        .count = count};
+
+    float cost = bvh_sah_cost(root);
+    if (tree.objects && tree.bounds && tree.left && tree.right && tree.parent && tree.heap)
+    {
+        int next = 0;
+        flatten_node(&tree, root, -1, &next);
+
+        float array_cost = array_sah_cost(&tree);
+        for (int pass = 0; pass < params->max_passes; pass++)
+        {
+            if (!insertion_pass(&tree, params->batch_fraction))
+                break;
+            if (params->rotations)
+                rotate_subtree(&tree, tree.root);
+
+            float new_cost = array_sah_cost(&tree);
+            if (params->report)
+                printf("Insertion pass %d: SAH cost %.2f -> %.2f%s\n", pass + 1, array_cost, new_cost,
+                       new_cost < array_cost ? "" : " (discarded)");
+            if (new_cost >= array_cost)
+                break;
+            write_back(&tree);
+            array_cost = new_cost;
+        }
+        cost = bvh_sah_cost(root);
+    }
+    else
+    {
+        printf("Failed to allocate insertion optimization data for %d nodes\n", count);
+    }
+
+    free(tree.objects);
+    free(tree.bounds);
+    free(tree.left);
+    free(tree.right);
+    free(tree.parent);
+    free(tree.heap);
+
+    return cost;
+}
@@ -0,0 +1,608 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <inttypes.h>
+#include "Custom/bvh_outofcore.h"
+#include "Custom/bvh_linear.h"
+#include "Custom/bvh_cache.h"
+#include "Custom/morton.h"
+
+#if defined(_WIN32) && !defined(PRIu64)
+#define PRIu64 "I64u"
+#endif
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+//----------------------------------------------------------------------------------------------------
+
+// Out-of-core BVH construction
+// Time Complexity - O( n log n ), with O( log n ) streaming passes over the sphere file
+// For scenes that do not fit into memory next to their tree. Every allocation of the build is
+// reserved against the memory budget first, and the build fails instead of going over it.
+// - Pass 1 streams the sphere file once for the count, the centroid bounds and the cache key.
+// - Partitioning is an external most significant digit radix sort on 63 bit Morton codes: a
+//   streaming pass scatters a file into 64 bucket files by the next 6 bits of the code (two octree
+//   levels). Buckets that still do not fit into the budget are partitioned again by the following
+//   bits. Buckets whose spheres share all bits are cut into pieces by count instead.
+// - Every bucket that fits is read in and built by the in-memory builder of the parameters, then
+//   its flattened nodes and its spheres in leaf order are appended to two scratch files.
+// - A binned SAH tree over the bucket bounds stitches the buckets together. It is streamed into a
+//   BVH cache file, copying every bucket's nodes into place with their offsets rebased, followed by
+//   the spheres. The result is mapped with bvh_cache_open() like any cached tree.
+// The budget covers every allocation of the build, the top tree's arena included. Where the resident
+// set can be measured (Linux), the build also fails if the process grew by more than the budget plus
+// BVH_OOC_RSS_ALLOWANCE (thread stacks, code and library pages touched for the first time).
+// - The key is the in-memory cache key of the spheres and parameters with the out-of-core build and
+//   its budget mixed in: the Morton bucketed top level and the bucket sizes make it another tree.
+
+//----------------------------------------------------------------------------------------------------
+
+#define OOC_BUCKETS 64
+#define OOC_DIGIT_BITS 6
+#define OOC_MORTON_LEVELS 10
+#define OOC_PATH_LENGTH 1024
+
+typedef struct OOCBucket
+{
+    long long node_start;   // position in the node scratch file, in nodes
+    int node_count;
+    int depth;
+    int sphere_start;       // first slot in the sphere scratch file
+    int sphere_count;
+    AABB bounds;
+} OOCBucket;
+
+typedef struct OOCBuild
+{
+    const BVHOutOfCoreParams *params;
+    AABB centroid_bounds;
+    uint64_t key;
+    size_t reserved;
+    size_t peak_reserved;
+    int bucket_spheres;     // most spheres an in-memory bucket build may take
+    int chunk_spheres;      // spheres per streaming read
+    FILE *nodes;
+    FILE *spheres;
+    char nodes_path[OOC_PATH_LENGTH];
+    char spheres_path[OOC_PATH_LENGTH];
+    long long nodes_written;
+    int spheres_written;
+    OOCBucket *buckets;
+    int bucket_count;
+    int bucket_capacity;
+    int next_file;
+    int partition_passes;
+} OOCBuild;
+
+BVHOutOfCoreParams bvh_out_of_core_default_params()
+{
+    return (BVHOutOfCoreParams){
+        .build = bvh_default_build_params(),
+        .memory_budget = BVH_OOC_DEFAULT_BUDGET,
+        .scratch_directory = NULL};
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// Memory accounting: every allocation is reserved first and released after it is freed
+
+static int reserve(OOCBuild *build, size_t bytes)
+{
+    if (build->reserved + bytes > build->params->memory_budget)
+    {
+        printf("Out-of-core build: %" PRIu64 " more bytes would exceed the memory budget of %" PRIu64 " bytes\n",
+               (uint64_t)bytes, (uint64_t)build->params->memory_budget);
+        return 0;
+    }
+    build->reserved += bytes;
+    if (build->reserved > build->peak_reserved)
+        build->peak_reserved = build->reserved;
+    return 1;
+}
+
+static void *reserve_alloc(OOCBuild *build, size_t bytes)
+{
+    if (!reserve(build, bytes))
+        return NULL;
+    void *memory = malloc(bytes > 0 ? bytes : 1);
+    if (!memory)
+        build->reserved -= bytes;
+    return memory;
+}
+
+static void release_free(OOCBuild *build, void *memory, size_t bytes)
+{
+    free(memory);
+    build->reserved -= bytes;
+}
+
+static int seek_file(FILE *file, long long offset)
+{
+#ifdef _WIN32
+    return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+static long long file_size(FILE *file)
+{
+#ifdef _WIN32
+    if (_fseeki64(file, 0, SEEK_END) != 0)
+        return -1;
+    long long size = _ftelli64(file);
+#else
+    if (fseeko(file, 0, SEEK_END) != 0)
+        return -1;
+    long long size = (long long)ftello(file);
+#endif
+    return seek_file(file, 0) ? size : -1;
+}
+
+static void scratch_path(const OOCBuild *build, char *path, const char *name, int id)
+{
+    const char *directory = build->params->scratch_directory ? build->params->scratch_directory : ".";
+    snprintf(path, OOC_PATH_LENGTH, "%s/bvh_ooc_%016llx_%s_%d.part", directory, (unsigned long long)build->key,
+             name, id);
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// Pass 1: count, centroid bounds and cache key of the whole file
+static int scan_spheres(OOCBuild *build, FILE *file, int count)
+{
+    size_t buffer_bytes = (size_t)build->chunk_spheres * sizeof(Sphere);
+    Sphere *buffer = (Sphere *)reserve_alloc(build, buffer_bytes);
+    if (!buffer)
+        return 0;
+
+    build->centroid_bounds = create_empty_aabb();
+    build->key = bvh_cache_key_begin(count, &build->params->build);
+    int ok = 1;
+    for (int done = 0; ok && done < count;)
+    {
+        int chunk = count - done < build->chunk_spheres ? count - done : build->chunk_spheres;
+        ok = fread(buffer, sizeof(Sphere), chunk, file) == (size_t)chunk;
+        for (int i = 0; ok && i < chunk; i++)
+        {
+            build->centroid_bounds = grow_aabb_point(build->centroid_bounds, buffer[i].center);
+        }
+        if (ok)
+            build->key = bvh_cache_key_append(build->key, buffer, chunk);
+        done += chunk;
+    }
+    if (ok)
+    {
+        uint64_t budget = build->params->memory_budget;
+        build->key = bvh_cache_key_mix(build->key, "out-of-core", sizeof("out-of-core"));
+        build->key = bvh_cache_key_mix(build->key, &budget, sizeof(budget));
+    }
+
+    release_free(build, buffer, buffer_bytes);
+    return ok;
+}
+
+// Spheres [first, first + count) of a file that fit into memory, built and appended to the scratch files
+static int build_bucket(OOCBuild *build, FILE *file, long long first, int count)
+{
+    if (!reserve(build, (size_t)count * BVH_OOC_BYTES_PER_SPHERE))
+        return 0;
+    if (build->bucket_count == build->bucket_capacity)
+    {
+        int capacity = build->bucket_capacity ? 2 * build->bucket_capacity : 256;
+        size_t grown = (size_t)(capacity - build->bucket_capacity) * sizeof(OOCBucket);
+        OOCBucket *buckets = NULL;
+        if (reserve(build, grown))
+            buckets = (OOCBucket *)realloc(build->buckets, capacity * sizeof(OOCBucket));
+        if (!buckets)
+        {
+            build->reserved -= (size_t)count * BVH_OOC_BYTES_PER_SPHERE;
+            return 0;
+        }
+        build->buckets = buckets;
+        build->bucket_capacity = capacity;
+    }
+
+    Sphere *spheres = (Sphere *)malloc((size_t)count * sizeof(Sphere));
+    int *sphere_indices = (int *)malloc((size_t)count * sizeof(int));
+    int ok = spheres && sphere_indices && seek_file(file, first * (long long)sizeof(Sphere)) &&
+             fread(spheres, sizeof(Sphere), count, file) == (size_t)count;
+
+    BVHNode *root = ok ? build_bvh(spheres, count, &build->params->build, sphere_indices) : NULL;
+    LinearBVH *bvh = root ? bvh_flatten(root, spheres, sphere_indices) : NULL;
+    free_bvh(root);
+    ok = bvh != NULL;
+
+    if (ok)
+    {
+        OOCBucket *bucket = &build->buckets[build->bucket_count++];
+        bucket->node_start = build->nodes_written;
+        bucket->node_count = bvh->node_count;
+        bucket->depth = bvh->depth;
+        bucket->sphere_start = build->spheres_written;
+        bucket->sphere_count = count;
+        bucket->bounds = (AABB){
+            {bvh->nodes[0].min[0], bvh->nodes[0].min[1], bvh->nodes[0].min[2]},
+            {bvh->nodes[0].max[0], bvh->nodes[0].max[1], bvh->nodes[0].max[2]}};
+
+        ok = fwrite(bvh->nodes, sizeof(LinearBVHNode), bvh->node_count, build->nodes) == (size_t)bvh->node_count;
+        for (int slot = 0; ok && slot < count; slot++)
+        {
+            ok = fwrite(&spheres[bvh->sphere_indices[slot]], sizeof(Sphere), 1, build->spheres) == 1;
+        }
+        build->nodes_written += bvh->node_count;
+        build->spheres_written += count;
+    }
+
+    free_linear_bvh(bvh);
+    free(sphere_indices);
+    free(spheres);
+    build->reserved -= (size_t)count * BVH_OOC_BYTES_PER_SPHERE;
+    return ok;
+}
+
+static int morton_digit(OOCBuild *build, const Sphere *sphere, int level)
+{
+    uint64_t code = morton_encode(sphere->center, build->centroid_bounds, MORTON_BITS_63);
+    return (int)((code >> (MORTON_BITS_63 - OOC_DIGIT_BITS * (level + 1))) & (OOC_BUCKETS - 1));
+}
+
+static int process_range(OOCBuild *build, FILE *file, long long first, int count, int level);
+
+// One streaming pass: scatters spheres [first, first + count) into 64 bucket files by their Morton
+// digit of this level, then processes every bucket in Morton order. The pass's buffers are freed
+// before the buckets are, so only the buckets' file ids stay behind on every level.
+static int partition_range(OOCBuild *build, FILE *file, long long first, int count, int level)
+{
+    // A quarter of the budget for the read buffer, another for the write buffers of the bucket files
+    size_t buffer_bytes = (size_t)build->chunk_spheres * sizeof(Sphere);
+    size_t file_buffer_bytes = buffer_bytes / OOC_BUCKETS;
+    size_t total_bytes = buffer_bytes + OOC_BUCKETS * file_buffer_bytes;
+    char *memory = (char *)reserve_alloc(build, total_bytes);
+    if (!memory)
+        return 0;
+    Sphere *buffer = (Sphere *)memory;
+    char *file_buffers = memory + buffer_bytes;
+
+    char path[OOC_PATH_LENGTH];
+    FILE *bucket_files[OOC_BUCKETS] = {0};
+    int bucket_ids[OOC_BUCKETS];
+    int bucket_counts[OOC_BUCKETS] = {0};
+    int ok = seek_file(file, first * (long long)sizeof(Sphere));
+    for (int b = 0; b < OOC_BUCKETS; b++)
+    {
+        bucket_ids[b] = build->next_file++;
+        if (!ok)
+            continue;
+        scratch_path(build, path, "bucket", bucket_ids[b]);
+        bucket_files[b] = fopen(path, "wb");
+        ok = bucket_files[b] != NULL &&
+             setvbuf(bucket_files[b], file_buffers + b * file_buffer_bytes, _IOFBF, file_buffer_bytes) == 0;
+    }
+    build->partition_passes++;
+
+    for (int done = 0; ok && done < count;)
+    {
+        int chunk = count - done < build->chunk_spheres ? count - done : build->chunk_spheres;
+        ok = fread(buffer, sizeof(Sphere), chunk, file) == (size_t)chunk;
+        for (int i = 0; ok && i < chunk; i++)
+        {
+            int b = morton_digit(build, &buffer[i], level);
+            ok = fwrite(&buffer[i], sizeof(Sphere), 1, bucket_files[b]) == 1;
+            bucket_counts[b]++;
+        }
+        done += chunk;
+    }
+    for (int b = 0; b < OOC_BUCKETS; b++)
+    {
+        if (bucket_files[b] && fclose(bucket_files[b]) != 0)
+            ok = 0;
+    }
+    release_free(build, memory, total_bytes);
+
+    for (int b = 0; b < OOC_BUCKETS; b++)
+    {
+        scratch_path(build, path, "bucket", bucket_ids[b]);
+        if (ok && bucket_counts[b] > 0)
+        {
+            FILE *bucket = fopen(path, "rb");
+            ok = bucket && process_range(build, bucket, 0, bucket_counts[b], level + 1);
+            if (bucket)
+                fclose(bucket);
+        }
+        remove(path);
+    }
+    return ok;
+}
+
+static int process_range(OOCBuild *build, FILE *file, long long first, int count, int level)
+{
+    if (count <= build->bucket_spheres)
+        return build_bucket(build, file, first, count);
+    if (level < OOC_MORTON_LEVELS)
+        return partition_range(build, file, first, count, level);
+
+    // Every Morton bit is shared, so any cut is as good as another
+    for (int done = 0; done < count; done += build->bucket_spheres)
+    {
+        int piece = count - done < build->bucket_spheres ? count - done : build->bucket_spheres;
+        if (!build_bucket(build, file, first + done, piece))
+            return 0;
+    }
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// Stitching: a binned SAH tree over the buckets, streamed in depth-first order with every bucket's
+// nodes copied in place of its leaf
+
+//----------------------------------------------------------------------------------------------------
+
+static long long stitched_node_count(const OOCBuild *build, const BVHNode *node)
+{
+    if (node->left == NULL)
+        return build->buckets[node->first].node_count;
+    return 1 + stitched_node_count(build, node->left) + stitched_node_count(build, node->right);
+}
+
+static int stitched_depth(const OOCBuild *build, const BVHNode *node, int depth)
+{
+    if (node->left == NULL)
+        return depth - 1 + build->buckets[node->first].depth;
+    int left = stitched_depth(build, node->left, depth + 1);
+    int right = stitched_depth(build, node->right, depth + 1);
+    return left > right ? left : right;
+}
+
+// Bucket nodes are stored with offsets local to the bucket, index is where its root lands
+static int copy_bucket_nodes(OOCBuild *build, BVHCacheWriter *writer, const OOCBucket *bucket, int index,
+                             LinearBVHNode *buffer, int buffer_nodes)
+{
+    if (!seek_file(build->nodes, bucket->node_start * (long long)sizeof(LinearBVHNode)))
+        return 0;
+    for (int done = 0; done < bucket->node_count;)
+    {
+        int chunk = bucket->node_count - done < buffer_nodes ? bucket->node_count - done : buffer_nodes;
+        if (fread(buffer, sizeof(LinearBVHNode), chunk, build->nodes) != (size_t)chunk)
+            return 0;
+        for (int i = 0; i < chunk; i++)
+        {
+            buffer[i].offset += buffer[i].count > 0 ? bucket->sphere_start : index;
+        }
+        if (!bvh_cache_write_nodes(writer, buffer, chunk))
+            return 0;
+        done += chunk;
+    }
+    return 1;
+}
+
+static int emit_stitched(OOCBuild *build, BVHCacheWriter *writer, const BVHNode *node, int index,
+                         LinearBVHNode *buffer, int buffer_nodes)
+{
+    if (node->left == NULL)
+        return copy_bucket_nodes(build, writer, &build->buckets[node->first], index, buffer, buffer_nodes);
+
+    int axis = linear_bvh_ordering_axis(node->left->bounds, node->right->bounds);
+    const BVHNode *first = node->left;
+    const BVHNode *second = node->right;
+    if (linear_bvh_children_swapped(first->bounds, second->bounds, axis))
+    {
+        first = node->right;
+        second = node->left;
+    }
+
+    int second_index = index + 1 + (int)stitched_node_count(build, first);
+    LinearBVHNode out = {
+        {node->bounds.min.x, node->bounds.min.y, node->bounds.min.z},
+        second_index,
+        {node->bounds.max.x, node->bounds.max.y, node->bounds.max.z},
+        0, (uint8_t)axis, 0};
+    return bvh_cache_write_nodes(writer, &out, 1) &&
+           emit_stitched(build, writer, first, index + 1, buffer, buffer_nodes) &&
+           emit_stitched(build, writer, second, second_index, buffer, buffer_nodes);
+}
+
+static int write_stitched(OOCBuild *build, const char *output_path, BVHOutOfCoreStats *stats)
+{
+    int count = build->bucket_count;
+    size_t top_bytes = (size_t)(count > 0 ? count : 1) * (2 * sizeof(BVHNode) + 2 * sizeof(BVHPrimRef) + sizeof(BVHNode *));
+    size_t buffer_bytes = (size_t)build->chunk_spheres * sizeof(Sphere);
+    char *memory = (char *)reserve_alloc(build, top_bytes + buffer_bytes);
+    if (!memory)
+        return 0;
+    BVHNode *leaves = (BVHNode *)memory;
+    BVHPrimRef *refs = (BVHPrimRef *)(leaves + count);
+    BVHNode **subtrees = (BVHNode **)(refs + count);
+    char *buffer = memory + top_bytes;
+
+    for (int i = 0; i < count; i++)
+    {
+        leaves[i].bounds = build->buckets[i].bounds;
+        leaves[i].left = leaves[i].right = NULL;
+        leaves[i].first = i;
+        leaves[i].sphere_count = build->buckets[i].sphere_count;
+        subtrees[i] = &leaves[i];
+        refs[i].bounds = leaves[i].bounds;
+        refs[i].centroid = vec3_multiply(vec3_add(leaves[i].bounds.min, leaves[i].bounds.max), 0.5f);
+        refs[i].index = i;
+    }
+
+    // The top tree's own nodes, fewer than one per bucket, come from an arena reserved up front
+    int threads = bvh_thread_count(&build->params->build);
+    size_t arena_bytes = bvh_arena_bytes_bound(count, threads);
+    if (!reserve(build, arena_bytes))
+    {
+        release_free(build, memory, top_bytes + buffer_bytes);
+        return 0;
+    }
+    BVHNodeArena *arena = bvh_arena_create(threads);
+    BVHNode *root = NULL;
+    if (count > 0 && arena)
+    {
+#pragma omp parallel num_threads(threads)
+#pragma omp single
+        root = bvh_build_binned_subtrees(arena, refs, count, subtrees, NULL, &build->params->build);
+    }
+
+    long long node_count = root ? stitched_node_count(build, root) : 0;
+    int depth = root ? stitched_depth(build, root, 1) : 0;
+    int ok = (root != NULL || count == 0) && node_count <= INT_MAX && depth <= LINEAR_BVH_MAX_DEPTH;
+    if (!ok)
+        printf("Out-of-core build: the stitched tree (%" PRIu64 " nodes, depth %d) does not fit the linear BVH\n",
+               (uint64_t)node_count, depth);
+
+    BVHCacheWriter *writer = ok ? bvh_cache_writer_open(output_path, (int)node_count, depth, build->spheres_written, build->key) : NULL;
+    ok = writer != NULL;
+    if (ok && root)
+        ok = emit_stitched(build, writer, root, 0, (LinearBVHNode *)buffer, (int)(buffer_bytes / sizeof(LinearBVHNode)));
+
+    // The spheres are already in the leaf order of the buckets, and the buckets' slots were rebased
+    int chunk_spheres = (int)(buffer_bytes / sizeof(Sphere));
+    ok = ok && seek_file(build->spheres, 0);
+    for (int done = 0; ok && done < build->spheres_written;)
+    {
+        int chunk = build->spheres_written - done < chunk_spheres ? build->spheres_written - done : chunk_spheres;
+        ok = fread(buffer, sizeof(Sphere), chunk, build->spheres) == (size_t)chunk &&
+             bvh_cache_write_spheres(writer, (const Sphere *)buffer, chunk);
+        done += chunk;
+    }
+    if (writer)
+        ok = bvh_cache_writer_close(writer) && ok;
+
+    if (stats)
+        stats->depth = depth;
+    bvh_arena_destroy(arena);
+    build->reserved -= arena_bytes;
+    release_free(build, memory, top_bytes + buffer_bytes);
+    return ok;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// Resident set enforcement: the growth of the peak resident set over the resident set at the start
+
+//----------------------------------------------------------------------------------------------------
+
+// Current resident set in KiB, -1 where unknown
+static long current_rss_kb()
+{
+#if defined(__linux__)
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (!file)
+        return -1;
+    long pages = -1, resident = -1;
+    int read = fscanf(file, "%ld %ld", &pages, &resident);
+    fclose(file);
+    return read == 2 ? resident * (sysconf(_SC_PAGESIZE) / 1024) : -1;
+#else
+    return -1;
+#endif
+}
+
+// Peak resident set of the process in KiB, 0 where unknown
+static long peak_rss_kb()
+{
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1024;
+#else
+        return usage.ru_maxrss;
+#endif
+    }
+#endif
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+int bvh_build_out_of_core(const char *sphere_path, const char *output_path, const BVHOutOfCoreParams *params,
+                          uint64_t *key, BVHOutOfCoreStats *stats)
+{
+    BVHOutOfCoreParams defaults = bvh_out_of_core_default_params();
+    if (!params)
+        params = &defaults;
+    if (params->memory_budget < BVH_OOC_MIN_BUDGET)
+    {
+        printf("Out-of-core build: a memory budget of %" PRIu64 " bytes is below the minimum of %" PRIu64 "\n",
+               (uint64_t)params->memory_budget, (uint64_t)BVH_OOC_MIN_BUDGET);
+        return 0;
+    }
+
+    FILE *input = fopen(sphere_path, "rb");
+    if (!input)
+    {
+        printf("Out-of-core build: cannot open %s\n", sphere_path);
+        return 0;
+    }
+    long long bytes = file_size(input);
+    if (bytes < 0 || bytes % sizeof(Sphere) != 0 || bytes / (long long)sizeof(Sphere) > INT_MAX)
+    {
+        printf("Out-of-core build: %s is not an array of at most %d spheres\n", sphere_path, INT_MAX);
+        fclose(input);
+        return 0;
+    }
+    int count = (int)(bytes / sizeof(Sphere));
+    long start_rss_kb = current_rss_kb();
+    long start_peak_kb = peak_rss_kb();
+
+    // A quarter of the budget per streaming buffer, the rest is left to the bucket builds
+    OOCBuild build = {.params = params};
+    build.chunk_spheres = (int)(params->memory_budget / 4 / sizeof(Sphere));
+    build.bucket_spheres = (int)(params->memory_budget / 2 / BVH_OOC_BYTES_PER_SPHERE);
+
+    int ok = scan_spheres(&build, input, count);
+    if (ok)
+    {
+        scratch_path(&build, build.nodes_path, "nodes", build.next_file++);
+        scratch_path(&build, build.spheres_path, "spheres", build.next_file++);
+        build.nodes = fopen(build.nodes_path, "w+b");
+        build.spheres = fopen(build.spheres_path, "w+b");
+        ok = build.nodes && build.spheres;
+    }
+    if (ok && count > 0)
+        ok = process_range(&build, input, 0, count, 0);
+    if (ok)
+        ok = write_stitched(&build, output_path, stats);
+
+    fclose(input);
+    if (build.nodes)
+        fclose(build.nodes);
+    if (build.spheres)
+        fclose(build.spheres);
+    remove(build.nodes_path);
+    remove(build.spheres_path);
+
+    // A peak below the one before the build hides the build's own peak, it is only checked above it
+    long end_peak_kb = peak_rss_kb();
+    long rss_growth_kb = start_rss_kb >= 0 && end_peak_kb > start_peak_kb ? end_peak_kb - start_rss_kb : -1;
+    if (ok && rss_growth_kb >= 0 &&
+        (uint64_t)rss_growth_kb * 1024 > (uint64_t)params->memory_budget + BVH_OOC_RSS_ALLOWANCE)
+    {
+        printf("Out-of-core build: the resident set grew by %ld KiB, above the memory budget of %" PRIu64 " bytes\n",
+               rss_growth_kb, (uint64_t)params->memory_budget);
+        remove(output_path);
+        ok = 0;
+    }
+
+    if (stats)
+    {
+        stats->sphere_count = count;
+        stats->bucket_count = build.bucket_count;
+        stats->partition_passes = build.partition_passes;
+        stats->peak_reserved = build.peak_reserved;
+        stats->peak_rss_kb = end_peak_kb;
+        stats->rss_growth_kb = rss_growth_kb;
+    }
+    if (key)
+        *key = build.key;
+    free(build.buckets);
+    return ok;
+}
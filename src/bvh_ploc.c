@@ -0,0 +1,258 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "Custom/bvh.h"
+#include "Custom/morton.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// Parallel Locally-Ordered Clustering (PLOC) BVH construction (Meister and Bittner 2018)
+// Time Complexity - O( n * radius ) per round, the cluster count roughly halves every round
+// Bottom-up construction: starts with one cluster per sphere, Morton sorted, and merges clusters
+// until a single one (the root) is left. Every round
+// - finds for each cluster the neighbour inside a window of ploc_radius clusters on either side
+//   whose merged bounding box has the smallest surface area,
+// - merges every pair of clusters that are each other's nearest neighbour into a new node,
+// - compacts the surviving clusters, keeping their Morton order.
+// Every step is a parallel loop over the clusters, so unlike the recursive top-down builders
+// the whole build parallelizes evenly, and greedy merging gives trees with a lower SAH cost than
+// top-down binning.
+// Merged clusters are not always neighbours in the Morton order, so at the end the sphere indices
+// are rewritten in the depth-first order of the leaves. Every subtree then covers a contiguous
+// range, as with the top-down builders, and sibling leaves can be merged into multi-sphere leaves
+// (bvh_collapse_leaves()).
+
+//----------------------------------------------------------------------------------------------------
+
+typedef struct PLOCBuild
+{
+    BVHNode **nodes;        // current clusters, in Morton order
+    AABB *bounds;           // bounds of the current clusters
+    int *nearest;
+    BVHNode **next_nodes;   // survivors of the current round
+    AABB *next_bounds;
+    int *chunk_offset;
+    int radius;
+    BVHNodeArena *arena;
+    int failed;             // a node allocation failed, the build is abandoned
+} PLOCBuild;
+
+// Orders pairs with equal merged areas (coincident spheres). It depends only on the pair, not on
+// which side asks, so the nearest neighbour relation stays free of cycles, and it prefers adjacent
+// clusters pairing up as (0, 1), (2, 3), ... so runs of coincident spheres merge in a logarithmic
+// number of rounds instead of one pair per round.
+static inline long long pair_tie_key(int i, int j)
+{
+    int low = i < j ? i : j;
+    int distance = i < j ? j - i : i - j;
+    return ((long long)distance << 32) | ((long long)(low & 1) << 31) | low;
+}
+
+static int find_nearest(const PLOCBuild *build, int i, int count)
+{
+    int first = i - build->radius > 0 ? i - build->radius : 0;
+    int last = i + build->radius < count - 1 ? i + build->radius : count - 1;
+
+    float best_area = INFINITY;
+    int best = -1;
+    for (int j = first; j <= last; j++)
+    {
+        if (j == i)
+            continue;
+        float area = get_aabb_surface_area(grow_aabb(build->bounds[i], build->bounds[j]));
+        if (area < best_area || (area == best_area && pair_tie_key(i, j) < pair_tie_key(i, best)))
+        {
+            best_area = area;
+            best = j;
+        }
+    }
+    return best;
+}
+
+static BVHNode *create_leaf(BVHNodeArena *arena, const Sphere *sphere, int slot)
+{
+    BVHNode *node = bvh_arena_alloc_node(arena);
+    if (node == NULL)
+        return NULL;
+    node->bounds = create_aabb_from_sphere(sphere);
+    node->left = node->right = NULL;
+    node->first = slot;
+    node->sphere_count = 1;
+    return node;
+}
+
+// Depth-first leaf numbering: the leaf in Morton slot i moves to the next slot of sphere_indices
+static int number_leaves(BVHNode *node, const int *sorted, int *sphere_indices, int next)
+{
+    if (node->left == NULL)
+    {
+        sphere_indices[next] = sorted[node->first];
+        node->first = next;
+        return next + 1;
+    }
+    next = number_leaves(node->left, sorted, sphere_indices, next);
+    return number_leaves(node->right, sorted, sphere_indices, next);
+}
+
+// One round of nearest neighbour search, merging and compaction, returns the new cluster count
+static int ploc_round(PLOCBuild *build, int count)
+{
+    int chunks = (count + BVH_PARALLEL_GRAIN - 1) / BVH_PARALLEL_GRAIN;
+
+#pragma omp taskloop grainsize(BVH_PARALLEL_GRAIN / 16)
+    for (int i = 0; i < count; i++)
+    {
+        build->nearest[i] = find_nearest(build, i, count);
+    }
+
+    // The lower index of a mutual pair creates the merged node, the higher one drops out
+#pragma omp taskloop grainsize(1)
+    for (int c = 0; c < chunks; c++)
+    {
+        int end = (c + 1) * BVH_PARALLEL_GRAIN < count ? (c + 1) * BVH_PARALLEL_GRAIN : count;
+        int survivors = 0;
+        for (int i = c * BVH_PARALLEL_GRAIN; i < end; i++)
+        {
+            int j = build->nearest[i];
+            if (build->nearest[j] == i)
+            {
+                if (i > j)
+                    continue;
+
+                // A failed merge leaves cluster i as it was and abandons the build
+                BVHNode *node = bvh_arena_alloc_node(build->arena);
+                if (node == NULL)
+                {
+#pragma omp atomic write
+                    build->failed = 1;
+                    survivors++;
+                    continue;
+                }
+                node->left = build->nodes[i];
+                node->right = build->nodes[j];
+                node->bounds = grow_aabb(build->bounds[i], build->bounds[j]);
+                node->first = 0;
+                node->sphere_count = 0;
+                build->nodes[i] = node;
+                build->bounds[i] = node->bounds;
+            }
+            survivors++;
+        }
+        build->chunk_offset[c] = survivors;
+    }
+
+    int offset = 0;
+    for (int c = 0; c < chunks; c++)
+    {
+        int survivors = build->chunk_offset[c];
+        build->chunk_offset[c] = offset;
+        offset += survivors;
+    }
+
+#pragma omp taskloop grainsize(1)
+    for (int c = 0; c < chunks; c++)
+    {
+        int end = (c + 1) * BVH_PARALLEL_GRAIN < count ? (c + 1) * BVH_PARALLEL_GRAIN : count;
+        int target = build->chunk_offset[c];
+        for (int i = c * BVH_PARALLEL_GRAIN; i < end; i++)
+        {
+            int j = build->nearest[i];
+            if (build->nearest[j] == i && i > j)
+                continue;
+            build->next_nodes[target] = build->nodes[i];
+            build->next_bounds[target] = build->bounds[i];
+            target++;
+        }
+    }
+
+    BVHNode **swap_nodes = build->nodes;
+    build->nodes = build->next_nodes;
+    build->next_nodes = swap_nodes;
+    AABB *swap_bounds = build->bounds;
+    build->bounds = build->next_bounds;
+    build->next_bounds = swap_bounds;
+
+    return offset;
+}
+
+BVHNode *build_bvh_ploc(const Sphere *spheres, int num_spheres, const BVHBuildParams *params, int *sphere_indices)
+{
+    if (num_spheres <= 0)
+        return NULL;
+
+    int chunks = (num_spheres + BVH_PARALLEL_GRAIN - 1) / BVH_PARALLEL_GRAIN;
+    PLOCBuild build = {
+        .nodes = (BVHNode **)malloc(num_spheres * sizeof(BVHNode *)),
+        .bounds = (AABB *)malloc(num_spheres * sizeof(AABB)),
+        .nearest = (int *)malloc(num_spheres * sizeof(int)),
+        .next_nodes = (BVHNode **)malloc(num_spheres * sizeof(BVHNode *)),
+        .next_bounds = (AABB *)malloc(num_spheres * sizeof(AABB)),
+        .chunk_offset = (int *)malloc(chunks * sizeof(int)),
+        .radius = params->ploc_radius > 0 ? params->ploc_radius : BVH_DEFAULT_PLOC_RADIUS,
+        .arena = NULL,
+        .failed = 0};
+    uint64_t *codes = (uint64_t *)malloc(num_spheres * sizeof(uint64_t));
+    int *order = (int *)malloc(num_spheres * sizeof(int));
+
+    BVHNode *root = NULL;
+    if (build.nodes && build.bounds && build.nearest && build.next_nodes && build.next_bounds &&
+        build.chunk_offset && codes && order)
+    {
+        int bits = params->morton_bits == MORTON_BITS_63 ? MORTON_BITS_63 : MORTON_BITS_30;
+        build.arena = bvh_arena_create(bvh_thread_count(params));
+
+#pragma omp parallel num_threads(bvh_thread_count(params))
+#pragma omp single
+        {
+            if (!morton_sort_spheres(spheres, num_spheres, bits, codes, order))
+            {
+                printf("Failed to allocate the PLOC Morton sort for %d spheres\n", num_spheres);
+                build.failed = 1;
+            }
+            else
+            {
+#pragma omp taskloop grainsize(BVH_PARALLEL_GRAIN)
+                for (int i = 0; i < num_spheres; i++)
+                {
+                    build.nodes[i] = create_leaf(build.arena, &spheres[order[i]], i);
+                    if (build.nodes[i] == NULL)
+                    {
+#pragma omp atomic write
+                        build.failed = 1;
+                        continue;
+                    }
+                    build.bounds[i] = build.nodes[i]->bounds;
+                }
+            }
+
+            int count = num_spheres;
+            while (count > 1 && !build.failed)
+            {
+                count = ploc_round(&build, count);
+            }
+
+            if (!build.failed)
+            {
+                root = build.nodes[0];
+                number_leaves(root, order, sphere_indices, 0);
+                bvh_collapse_leaves(build.arena, root, bvh_max_leaf_size(params));
+            }
+        }
+    }
+    else
+    {
+        printf("Failed to allocate PLOC build data for %d spheres\n", num_spheres);
+    }
+
+    free(build.nodes);
+    free(build.bounds);
+    free(build.nearest);
+    free(build.next_nodes);
+    free(build.next_bounds);
+    free(build.chunk_offset);
+    free(codes);
+    free(order);
+    bvh_arena_attach(build.arena, root);
+
+    return root;
+}
@@ -0,0 +1,224 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "Custom/bvh_rebuild.h"
+#include "Custom/bvh_memory.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// Background rebuild with a double-buffered acceleration structure
+// A rebuild on the render thread stalls the frame that triggered it. The rebuild service moves it
+// to a worker thread instead:
+// - bvh_rebuild_request() hands the worker a copy of the spheres, so the render thread can keep
+//   changing its own array while the tree is built. Requests made during a build are coalesced,
+//   only the newest one is built next.
+// - The worker builds a complete snapshot (tree, leaf ordered spheres, flattened BVH) with the
+//   builder's usual OpenMP threads and parks it as ready.
+// - Frames keep tracing the current snapshot until bvh_rebuild_swap() makes the ready one current
+//   at a frame boundary. A snapshot finished while another one was still waiting replaces it.
+// Reclamation: every frame takes a reference to the snapshot it traces (bvh_rebuild_acquire()) and
+// releases it when done, and the service holds one for its current snapshot. A swapped out
+// snapshot is freed by whoever drops the last reference, so a frame still in flight on another
+// thread never sees its tree disappear.
+
+//----------------------------------------------------------------------------------------------------
+
+BVHSnapshot *bvh_snapshot_build(const Sphere *spheres, int num_spheres, const BVHBuildParams *params)
+{
+    BVHSnapshot *snapshot = (BVHSnapshot *)calloc(1, sizeof(BVHSnapshot));
+    if (!snapshot)
+        return NULL;
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    snapshot->sphere_count = num_spheres;
+    snapshot->sphere_indices = (int *)malloc((num_spheres > 0 ? num_spheres : 1) * sizeof(int));
+    if (snapshot->sphere_indices)
+        snapshot->root = build_bvh(spheres, num_spheres, params, snapshot->sphere_indices);
+    if (snapshot->root)
+    {
+        snapshot->leaf_spheres = bvh_compact_spheres(spheres, snapshot->sphere_indices, num_spheres);
+        snapshot->build_cost = bvh_sah_cost(snapshot->root);
+    }
+    if (snapshot->leaf_spheres)
+        snapshot->bvh = bvh_flatten(snapshot->root, snapshot->leaf_spheres, NULL);
+    snapshot->build_time = (double)(SDL_GetPerformanceCounter() - start) / (double)SDL_GetPerformanceFrequency();
+    SDL_AtomicSet(&snapshot->references, 1);
+
+    if (!snapshot->bvh)
+    {
+        printf("Failed to build a BVH snapshot of %d spheres\n", num_spheres);
+        bvh_snapshot_release(snapshot);
+        return NULL;
+    }
+    return snapshot;
+}
+
+BVHSnapshot *bvh_snapshot_retain(BVHSnapshot *snapshot)
+{
+    if (snapshot)
+        SDL_AtomicIncRef(&snapshot->references);
+    return snapshot;
+}
+
+void bvh_snapshot_release(BVHSnapshot *snapshot)
+{
+    if (!snapshot || !SDL_AtomicDecRef(&snapshot->references))
+        return;
+
+    free_linear_bvh(snapshot->bvh);
+    free_bvh(snapshot->root);
+    bvh_free_large(snapshot->leaf_spheres);
+    free(snapshot->sphere_indices);
+    free(snapshot);
+}
+
+//----------------------------------------------------------------------------------------------------
+
+struct BVHRebuildService
+{
+    SDL_Thread *worker;
+    SDL_mutex *lock;            // guards every field below
+    SDL_cond *wake;             // signals the worker: new request or quit
+    BVHBuildParams params;
+    BVHSnapshot *current;       // traced by new frames, holds one reference
+    BVHSnapshot *ready;         // built but not yet swapped in, holds one reference
+    Sphere *requested;          // copy of the spheres of the waiting request, NULL if none
+    int requested_count;
+    int building;
+    int quit;
+};
+
+static int rebuild_worker(void *data)
+{
+    BVHRebuildService *service = (BVHRebuildService *)data;
+
+    SDL_LockMutex(service->lock);
+    while (1)
+    {
+        while (!service->requested && !service->quit)
+            SDL_CondWait(service->wake, service->lock);
+        if (service->quit)
+            break;
+
+        Sphere *spheres = service->requested;
+        int num_spheres = service->requested_count;
+        service->requested = NULL;
+        service->building = 1;
+        SDL_UnlockMutex(service->lock);
+
+        BVHSnapshot *snapshot = bvh_snapshot_build(spheres, num_spheres, &service->params);
+        free(spheres);
+
+        SDL_LockMutex(service->lock);
+        BVHSnapshot *stale = NULL;
+        if (snapshot)
+        {
+            stale = service->ready;
+            service->ready = snapshot;
+        }
+        service->building = 0;
+        SDL_UnlockMutex(service->lock);
+
+        bvh_snapshot_release(stale);
+        SDL_LockMutex(service->lock);
+    }
+    SDL_UnlockMutex(service->lock);
+    return 0;
+}
+
+BVHRebuildService *bvh_rebuild_service_create(BVHSnapshot *initial, const BVHBuildParams *params)
+{
+    BVHRebuildService *service = (BVHRebuildService *)calloc(1, sizeof(BVHRebuildService));
+    if (!service)
+        return NULL;
+
+    service->params = params ? *params : bvh_default_build_params();
+    service->current = initial;
+    service->lock = SDL_CreateMutex();
+    service->wake = SDL_CreateCond();
+    if (service->lock && service->wake)
+        service->worker = SDL_CreateThread(rebuild_worker, "bvh_rebuild", service);
+
+    if (!service->worker)
+    {
+        printf("Failed to start the BVH rebuild thread: %s\n", SDL_GetError());
+        if (service->wake)
+            SDL_DestroyCond(service->wake);
+        if (service->lock)
+            SDL_DestroyMutex(service->lock);
+        free(service);
+        return NULL;
+    }
+    return service;
+}
+
+void bvh_rebuild_service_destroy(BVHRebuildService *service)
+{
+    if (!service)
+        return;
+
+    SDL_LockMutex(service->lock);
+    service->quit = 1;
+    SDL_CondSignal(service->wake);
+    SDL_UnlockMutex(service->lock);
+    SDL_WaitThread(service->worker, NULL);
+
+    free(service->requested);
+    bvh_snapshot_release(service->ready);
+    bvh_snapshot_release(service->current);
+    SDL_DestroyCond(service->wake);
+    SDL_DestroyMutex(service->lock);
+    free(service);
+}
+
+int bvh_rebuild_request(BVHRebuildService *service, const Sphere *spheres, int num_spheres)
+{
+    Sphere *copy = (Sphere *)malloc((num_spheres > 0 ? num_spheres : 1) * sizeof(Sphere));
+    if (!copy)
+        return 0;
+    memcpy(copy, spheres, num_spheres * sizeof(Sphere));
+
+    SDL_LockMutex(service->lock);
+    Sphere *stale = service->requested;
+    service->requested = copy;
+    service->requested_count = num_spheres;
+    SDL_CondSignal(service->wake);
+    SDL_UnlockMutex(service->lock);
+
+    free(stale);
+    return 1;
+}
+
+int bvh_rebuild_pending(BVHRebuildService *service)
+{
+    SDL_LockMutex(service->lock);
+    int pending = service->requested != NULL || service->building || service->ready != NULL;
+    SDL_UnlockMutex(service->lock);
+    return pending;
+}
+
+int bvh_rebuild_swap(BVHRebuildService *service)
+{
+    SDL_LockMutex(service->lock);
+    BVHSnapshot *fresh = service->ready;
+    BVHSnapshot *retired = NULL;
+    if (fresh)
+    {
+        service->ready = NULL;
+        retired = service->current;
+        service->current = fresh;
+    }
+    SDL_UnlockMutex(service->lock);
+
+    // Frees the old tree unless a frame still holds it, that frame's release frees it then
+    bvh_snapshot_release(retired);
+    return fresh != NULL;
+}
+
+BVHSnapshot *bvh_rebuild_acquire(BVHRebuildService *service)
+{
+    SDL_LockMutex(service->lock);
+    BVHSnapshot *snapshot = bvh_snapshot_retain(service->current);
+    SDL_UnlockMutex(service->lock);
+    return snapshot;
+}
@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "Custom/bvh_refit.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// Refitting for moving spheres
+// Time Complexity - O( n ), every node is visited exactly once
+// When spheres move or change radius, the topology of the tree is kept and only the bounds are
+// updated, bottom-up: a leaf takes the bounds of its spheres, an interior node the union of its
+// children. This is far cheaper than a rebuild, but the tree was optimized for the old positions,
+// so its quality decays as the spheres drift apart from their original neighbours.
+// - The SAH cost is summed up in the same pass, so measuring the decay costs no extra traversal.
+// - BVHRefitTracker compares that cost with the cost right after the build and asks for a rebuild
+//   once it grew by more than the rebuild ratio.
+// - The top levels of the tree are refitted as OpenMP tasks, like the treelet optimizer.
+// Sphere indices and leaf ranges do not change, so the caller only has to update the spheres.
+
+//----------------------------------------------------------------------------------------------------
+
+// Refitting a node is one union of two boxes, far less work than spawning a task, so only the
+// first levels fork: up to 4096 tasks, each refitting a whole subtree, is enough to keep the
+// threads busy on unbalanced trees. Past that depth the recursion is plain serial code.
+#define REFIT_TASK_DEPTH 12
+
+static AABB leaf_bounds(const Sphere *spheres, const int *sphere_indices, int first, int count)
+{
+    AABB bounds = create_empty_aabb();
+    for (int i = first; i < first + count; i++)
+    {
+        bounds = grow_aabb(bounds, create_aabb_from_sphere(&spheres[bvh_leaf_sphere(sphere_indices, i)]));
+    }
+    return bounds;
+}
+
+// Returns the unnormalized SAH cost of the subtree
+static float refit_node(BVHNode *node, const Sphere *spheres, const int *sphere_indices, int depth)
+{
+    if (node->left == NULL)
+    {
+        // Empty leaves from build_bvh_node() keep inverted bounds and cost nothing
+        node->bounds = leaf_bounds(spheres, sphere_indices, node->first, node->sphere_count);
+        if (node->sphere_count <= 0)
+            return 0.0f;
+        return bvh_cost_model().intersect_cost * node->sphere_count * get_aabb_surface_area(node->bounds);
+    }
+
+    float left_cost, right_cost;
+    if (depth < REFIT_TASK_DEPTH)
+    {
+#pragma omp task shared(left_cost)
+        left_cost = refit_node(node->left, spheres, sphere_indices, depth + 1);
+        right_cost = refit_node(node->right, spheres, sphere_indices, depth + 1);
+#pragma omp taskwait
+    }
+    else
+    {
+        left_cost = refit_node(node->left, spheres, sphere_indices, depth + 1);
+        right_cost = refit_node(node->right, spheres, sphere_indices, depth + 1);
+    }
+
+    node->bounds = grow_aabb(node->left->bounds, node->right->bounds);
+    return bvh_cost_model().traversal_cost * get_aabb_surface_area(node->bounds) + left_cost + right_cost;
+}
+
+float bvh_refit(BVHNode *root, const Sphere *spheres, const int *sphere_indices, int num_threads)
+{
+    if (root == NULL)
+        return 0.0f;
+
+    BVHBuildParams params = bvh_default_build_params();
+    params.num_threads = num_threads;
+
+    float cost = 0.0f;
+#pragma omp parallel num_threads(bvh_thread_count(&params))
+#pragma omp single
+    cost = refit_node(root, spheres, sphere_indices, 0);
+
+    float area = get_aabb_surface_area(root->bounds);
+    return area > 0.0f ? cost / area : 0.0f;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// Same refit on the flattened layout: the left child of node i is node i + 1, the right child is
+// node offset. The child order chosen by bvh_flatten() is kept, it only steers the traversal.
+
+//----------------------------------------------------------------------------------------------------
+
+static AABB linear_node_bounds(const LinearBVHNode *node)
+{
+    return (AABB){
+        {node->min[0], node->min[1], node->min[2]},
+        {node->max[0], node->max[1], node->max[2]}};
+}
+
+static float refit_linear_node(LinearBVH *bvh, int index, int depth)
+{
+    LinearBVHNode *node = &bvh->nodes[index];
+    AABB bounds;
+    float cost;
+
+    if (node->count > 0)
+    {
+        bounds = leaf_bounds(bvh->spheres, bvh->sphere_indices, node->offset, node->count);
+        cost = bvh_cost_model().intersect_cost * node->count * get_aabb_surface_area(bounds);
+    }
+    else
+    {
+        float left_cost, right_cost;
+        if (depth < REFIT_TASK_DEPTH)
+        {
+#pragma omp task shared(left_cost)
+            left_cost = refit_linear_node(bvh, index + 1, depth + 1);
+            right_cost = refit_linear_node(bvh, node->offset, depth + 1);
+#pragma omp taskwait
+        }
+        else
+        {
+            left_cost = refit_linear_node(bvh, index + 1, depth + 1);
+            right_cost = refit_linear_node(bvh, node->offset, depth + 1);
+        }
+        bounds = grow_aabb(linear_node_bounds(&bvh->nodes[index + 1]), linear_node_bounds(&bvh->nodes[node->offset]));
+        cost = bvh_cost_model().traversal_cost * get_aabb_surface_area(bounds) + left_cost + right_cost;
+    }
+
+    node->min[0] = bounds.min.x;
+    node->min[1] = bounds.min.y;
+    node->min[2] = bounds.min.z;
+    node->max[0] = bounds.max.x;
+    node->max[1] = bounds.max.y;
+    node->max[2] = bounds.max.z;
+    return cost;
+}
+
+float bvh_refit_linear(LinearBVH *bvh, int num_threads)
+{
+    if (bvh == NULL || bvh->node_count <= 0)
+        return 0.0f;
+
+    BVHBuildParams params = bvh_default_build_params();
+    params.num_threads = num_threads;
+
+    float cost = 0.0f;
+#pragma omp parallel num_threads(bvh_thread_count(&params))
+#pragma omp single
+    cost = refit_linear_node(bvh, 0, 0);
+
+    float area = get_aabb_surface_area(linear_node_bounds(&bvh->nodes[0]));
+    return area > 0.0f ? cost / area : 0.0f;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+BVHRefitTracker bvh_refit_tracker(float build_cost, float rebuild_ratio)
+{
+    return (BVHRefitTracker){
+        .build_cost = build_cost,
+        .cost = build_cost,
+        .rebuild_ratio = rebuild_ratio > 1.0f ? rebuild_ratio : BVH_DEFAULT_REBUILD_RATIO,
+        .refits = 0};
+}
+
+int bvh_refit_needs_rebuild(BVHRefitTracker *tracker, float cost)
+{
+    tracker->cost = cost;
+    tracker->refits++;
+    return cost > tracker->build_cost * tracker->rebuild_ratio;
+}
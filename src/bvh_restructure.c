@@ -0,0 +1,110 @@
+#include <math.h>
+#include "Custom/bvh_restructure.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// Tree restructuring helpers
+// The heap, the insertion search and the rotation test of the insertion optimizer, shared with the
+// dynamic BVH, which inserts and rotates the same way on a pointer tree instead of index arrays.
+
+//----------------------------------------------------------------------------------------------------
+
+void bvh_heap_push(BVHHeapEntry *heap, int *size, BVHHeapEntry entry)
+{
+    int i = (*size)++;
+    while (i > 0 && heap[(i - 1) / 2].cost > entry.cost)
+    {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = entry;
+}
+
+BVHHeapEntry bvh_heap_pop(BVHHeapEntry *heap, int *size)
+{
+    BVHHeapEntry top = heap[0];
+    BVHHeapEntry last = heap[--(*size)];
+    int i = 0;
+    while (2 * i + 1 < *size)
+    {
+        int child = 2 * i + 1;
+        if (child + 1 < *size && heap[child + 1].cost < heap[child].cost)
+            child++;
+        if (heap[child].cost >= last.cost)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+void bvh_sibling_search_start(BVHSiblingSearch *search, BVHHeapEntry *heap, int root, AABB box)
+{
+    search->heap = heap;
+    search->size = 0;
+    search->box = box;
+    search->box_area = get_aabb_surface_area(box);
+    search->cost = 0.0f;
+    search->best_cost = INFINITY;
+    search->best = root;
+    bvh_heap_push(search->heap, &search->size, (BVHHeapEntry){0.0f, root});
+}
+
+int bvh_sibling_search_next(BVHSiblingSearch *search)
+{
+    if (search->size == 0)
+        return -1;
+    BVHHeapEntry entry = bvh_heap_pop(search->heap, &search->size);
+    if (entry.cost + search->box_area >= search->best_cost)
+        return -1;
+    search->cost = entry.cost;
+    return entry.node;
+}
+
+int bvh_sibling_search_visit(BVHSiblingSearch *search, int node, AABB bounds, int internal)
+{
+    float cost = search->cost + get_aabb_surface_area(grow_aabb(bounds, search->box));
+    if (cost < search->best_cost)
+    {
+        search->best_cost = cost;
+        search->best = node;
+    }
+
+    // Going further down, this node has to grow to hold the box as well
+    search->cost = cost - get_aabb_surface_area(bounds);
+    return internal && search->cost + search->box_area < search->best_cost;
+}
+
+void bvh_sibling_search_push(BVHSiblingSearch *search, int child)
+{
+    bvh_heap_push(search->heap, &search->size, (BVHHeapEntry){search->cost, child});
+}
+
+int bvh_best_rotation(const AABB children[2], const AABB *grandchildren[2], int *side, int *grandchild)
+{
+    float best_gain = 0.0f;
+    int found = 0;
+
+    for (int s = 0; s < 2; s++)
+    {
+        const AABB *below_other = grandchildren[1 - s];
+        if (below_other == NULL)
+            continue;
+
+        float other_area = get_aabb_surface_area(children[1 - s]);
+        for (int g = 0; g < 2; g++)
+        {
+            // The grandchild g moves up, the other child keeps its sibling and takes child s
+            float gain = other_area - get_aabb_surface_area(grow_aabb(children[s], below_other[1 - g]));
+            if (gain > best_gain)
+            {
+                best_gain = gain;
+                *side = s;
+                *grandchild = g;
+                found = 1;
+            }
+        }
+    }
+    return found;
+}
@@ -0,0 +1,774 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "Custom/bvh.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// Binned Surface Area Heurestics (SAH) BVH construction
+// Time Complexity - O( n log n ), with O( n ) work per tree level
+// Instead of rescanning every sphere for every candidate plane (as build_bvh_node does), each node
+// makes a single pass over its primitive references and drops every centroid into one of
+// bin_count equally sized bins per axis. The cost of all bin_count - 1 planes on an axis is then
+// found with a suffix sweep (right side) followed by a prefix sweep (left side) over the bins.
+// Bins span the centroid bounds of the node, not the node bounds, so no bins are wasted on the
+// sphere radii and no plane can leave one side empty.
+// Nodes of up to max_leaf_size spheres stop splitting when a leaf is cheaper than their best split.
+//
+// Parallel construction (OpenMP tasks)
+// - Subtrees with more than BVH_TASK_THRESHOLD primitives are spawned as tasks, idle threads pick
+//   them up from the OpenMP task pool.
+// - Nodes with more than BVH_PARALLEL_GRAIN primitives (the top levels) also compute their bounds,
+//   bin and partition in chunks of BVH_PARALLEL_GRAIN, one task per chunk. Their partition is
+//   stable and goes through a scratch array; smaller nodes swap in place. The scratch array and
+//   the per-chunk results are allocated once, before the build starts.
+// The chunking only depends on the primitive counts, so the tree is the same for any thread count.
+
+//----------------------------------------------------------------------------------------------------
+
+typedef struct SAHBin
+{
+    AABB bounds;
+    int count;
+} SAHBin;
+
+// Partial results of one BVH_PARALLEL_GRAIN chunk of a large node
+typedef struct BinnedChunk
+{
+    AABB bounds;
+    AABB centroid_bounds;
+    SAHBin bins[3][BVH_MAX_BINS];
+    int left_offset;        // chunk counts, then write positions, of the partition
+    int right_offset;
+} BinnedChunk;
+
+// Memory a build needs besides its nodes, allocated before it starts
+struct BVHBinnedScratch
+{
+    BVHPrimRef *refs;       // target of the stable partition in large nodes
+    BinnedChunk *chunks;    // see node_chunks()
+    int capacity;           // references it has room for
+};
+
+typedef struct BinnedBuild
+{
+    BVHPrimRef *refs;
+    BVHPrimRef *scratch;    // target of the stable partition in large nodes
+    BinnedChunk *chunks;
+    BVHNode **subtrees;     // if set, every reference is an existing subtree instead of a sphere
+    BVHNodeArena *arena;
+    int bin_count;
+    int max_depth;
+    int max_leaf_size;
+    int parallel;           // subtrees become tasks, 0 keeps every node allocation on the calling thread
+} BinnedBuild;
+
+typedef struct BinGrid
+{
+    float min[3];
+    float scale[3];         // bins per unit length, 0 if the centroids coincide on that axis
+    int bin_count;
+} BinGrid;
+
+static inline int bin_index(const BinGrid *grid, Vec3 centroid, int axis)
+{
+    int bin = (int)((axis_value(centroid, axis) - grid->min[axis]) * grid->scale[axis]);
+    return bin < grid->bin_count ? bin : grid->bin_count - 1;
+}
+
+static void compute_bounds(const BVHPrimRef *refs, int start, int end, AABB *bounds, AABB *centroid_bounds)
+{
+    *bounds = create_empty_aabb();
+    *centroid_bounds = create_empty_aabb();
+    for (int i = start; i < end; i++)
+    {
+        *bounds = grow_aabb(*bounds, refs[i].bounds);
+        *centroid_bounds = grow_aabb_point(*centroid_bounds, refs[i].centroid);
+    }
+}
+
+// Large nodes that run at the same time cover disjoint ranges of more than BVH_PARALLEL_GRAIN
+// references. Starting the chunks of each at slot 2 * (start / BVH_PARALLEL_GRAIN) keeps their slots
+// apart as well, and 2 * ceil(count / BVH_PARALLEL_GRAIN) slots are enough for every node of a build.
+static inline int chunk_slot_count(int count)
+{
+    return 2 * ((count + BVH_PARALLEL_GRAIN - 1) / BVH_PARALLEL_GRAIN);
+}
+
+static inline BinnedChunk *node_chunks(BinnedBuild *build, int start)
+{
+    return &build->chunks[2 * (start / BVH_PARALLEL_GRAIN)];
+}
+
+static void compute_bounds_parallel(const BVHPrimRef *refs, int start, int end, BinnedChunk *partial,
+                                    AABB *bounds, AABB *centroid_bounds)
+{
+    int chunks = (end - start + BVH_PARALLEL_GRAIN - 1) / BVH_PARALLEL_GRAIN;
+
+#pragma omp taskloop grainsize(1)
+    for (int c = 0; c < chunks; c++)
+    {
+        int chunk_start = start + c * BVH_PARALLEL_GRAIN;
+        int chunk_end = chunk_start + BVH_PARALLEL_GRAIN < end ? chunk_start + BVH_PARALLEL_GRAIN : end;
+        compute_bounds(refs, chunk_start, chunk_end, &partial[c].bounds, &partial[c].centroid_bounds);
+    }
+
+    *bounds = create_empty_aabb();
+    *centroid_bounds = create_empty_aabb();
+    for (int c = 0; c < chunks; c++)
+    {
+        *bounds = grow_aabb(*bounds, partial[c].bounds);
+        *centroid_bounds = grow_aabb(*centroid_bounds, partial[c].centroid_bounds);
+    }
+}
+
+static void clear_bins(SAHBin bins[3][BVH_MAX_BINS], int bin_count)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        for (int i = 0; i < bin_count; i++)
+        {
+            bins[axis][i].bounds = create_empty_aabb();
+            bins[axis][i].count = 0;
+        }
+    }
+}
+
+static void fill_bins(const BVHPrimRef *refs, int start, int end, const BinGrid *grid,
+                      SAHBin bins[3][BVH_MAX_BINS])
+{
+    for (int i = start; i < end; i++)
+    {
+        const BVHPrimRef *ref = &refs[i];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            int b = bin_index(grid, ref->centroid, axis);
+            bins[axis][b].bounds = grow_aabb(bins[axis][b].bounds, ref->bounds);
+            bins[axis][b].count++;
+        }
+    }
+}
+
+static void fill_bins_parallel(const BVHPrimRef *refs, int start, int end, const BinGrid *grid,
+                               BinnedChunk *partial, SAHBin bins[3][BVH_MAX_BINS])
+{
+    int chunks = (end - start + BVH_PARALLEL_GRAIN - 1) / BVH_PARALLEL_GRAIN;
+
+#pragma omp taskloop grainsize(1)
+    for (int c = 0; c < chunks; c++)
+    {
+        int chunk_start = start + c * BVH_PARALLEL_GRAIN;
+        int chunk_end = chunk_start + BVH_PARALLEL_GRAIN < end ? chunk_start + BVH_PARALLEL_GRAIN : end;
+        clear_bins(partial[c].bins, grid->bin_count);
+        fill_bins(refs, chunk_start, chunk_end, grid, partial[c].bins);
+    }
+
+    for (int c = 0; c < chunks; c++)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            for (int i = 0; i < grid->bin_count; i++)
+            {
+                bins[axis][i].bounds = grow_aabb(bins[axis][i].bounds, partial[c].bins[axis][i].bounds);
+                bins[axis][i].count += partial[c].bins[axis][i].count;
+            }
+        }
+    }
+}
+
+// Returns the SAH cost of the best split, INFINITY if the centroids coincide on every axis (no plane
+// can separate them)
+static float find_binned_split(BinnedBuild *build, int start, int end, const BinGrid *grid,
+                             int *best_axis, int *best_bin)
+{
+    SAHBin bins[3][BVH_MAX_BINS];
+    int bin_count = grid->bin_count;
+
+    clear_bins(bins, bin_count);
+    if (end - start > BVH_PARALLEL_GRAIN)
+        fill_bins_parallel(build->refs, start, end, grid, node_chunks(build, start), bins);
+    else
+        fill_bins(build->refs, start, end, grid, bins);
+
+    float best_cost = INFINITY;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (grid->scale[axis] == 0.0f)
+            continue;
+
+        float right_area[BVH_MAX_BINS];
+        int right_count[BVH_MAX_BINS];
+        AABB right_bounds = create_empty_aabb();
+        int count = 0;
+        for (int i = bin_count - 1; i > 0; i--)
+        {
+            right_bounds = grow_aabb(right_bounds, bins[axis][i].bounds);
+            count += bins[axis][i].count;
+            right_count[i - 1] = count;
+            right_area[i - 1] = count ? get_aabb_surface_area(right_bounds) : 0.0f;
+        }
+
+        AABB left_bounds = create_empty_aabb();
+        count = 0;
+        for (int i = 0; i < bin_count - 1; i++)
+        {
+            left_bounds = grow_aabb(left_bounds, bins[axis][i].bounds);
+            count += bins[axis][i].count;
+            if (count == 0 || right_count[i] == 0)
+                continue;
+
+            float cost = count * get_aabb_surface_area(left_bounds) + right_count[i] * right_area[i];
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                *best_axis = axis;
+                *best_bin = i;
+            }
+        }
+    }
+    return best_cost;
+}
+
+static int partition_refs(BVHPrimRef *refs, int start, int end, const BinGrid *grid, int axis, int split_bin)
+{
+    int i = start, j = end - 1;
+    while (i <= j)
+    {
+        if (bin_index(grid, refs[i].centroid, axis) <= split_bin)
+        {
+            i++;
+        }
+        else
+        {
+            BVHPrimRef temp = refs[i];
+            refs[i] = refs[j];
+            refs[j] = temp;
+            j--;
+        }
+    }
+    return i;
+}
+
+static int partition_refs_parallel(BinnedBuild *build, int start, int end, const BinGrid *grid,
+                                   int axis, int split_bin)
+{
+    int chunks = (end - start + BVH_PARALLEL_GRAIN - 1) / BVH_PARALLEL_GRAIN;
+    BinnedChunk *partial = node_chunks(build, start);
+
+#pragma omp taskloop grainsize(1)
+    for (int c = 0; c < chunks; c++)
+    {
+        int chunk_start = start + c * BVH_PARALLEL_GRAIN;
+        int chunk_end = chunk_start + BVH_PARALLEL_GRAIN < end ? chunk_start + BVH_PARALLEL_GRAIN : end;
+        int count = 0;
+        for (int i = chunk_start; i < chunk_end; i++)
+        {
+            count += bin_index(grid, build->refs[i].centroid, axis) <= split_bin;
+        }
+        partial[c].left_offset = count;
+        partial[c].right_offset = (chunk_end - chunk_start) - count;
+    }
+
+    // Exclusive prefix sums give every chunk its write positions on both sides
+    int left = start;
+    for (int c = 0; c < chunks; c++)
+    {
+        int count = partial[c].left_offset;
+        partial[c].left_offset = left;
+        left += count;
+    }
+    int mid = left;
+    int right = mid;
+    for (int c = 0; c < chunks; c++)
+    {
+        int count = partial[c].right_offset;
+        partial[c].right_offset = right;
+        right += count;
+    }
+
+#pragma omp taskloop grainsize(1)
+    for (int c = 0; c < chunks; c++)
+    {
+        int chunk_start = start + c * BVH_PARALLEL_GRAIN;
+        int chunk_end = chunk_start + BVH_PARALLEL_GRAIN < end ? chunk_start + BVH_PARALLEL_GRAIN : end;
+        int l = partial[c].left_offset, r = partial[c].right_offset;
+        for (int i = chunk_start; i < chunk_end; i++)
+        {
+            if (bin_index(grid, build->refs[i].centroid, axis) <= split_bin)
+                build->scratch[l++] = build->refs[i];
+            else
+                build->scratch[r++] = build->refs[i];
+        }
+    }
+
+#pragma omp taskloop grainsize(1)
+    for (int c = 0; c < chunks; c++)
+    {
+        int chunk_start = start + c * BVH_PARALLEL_GRAIN;
+        int chunk_end = chunk_start + BVH_PARALLEL_GRAIN < end ? chunk_start + BVH_PARALLEL_GRAIN : end;
+        memcpy(&build->refs[chunk_start], &build->scratch[chunk_start],
+               (chunk_end - chunk_start) * sizeof(BVHPrimRef));
+    }
+
+    return mid;
+}
+
+static BVHNode *build_binned_node(BinnedBuild *build, int start, int end, int depth)
+{
+    int num_spheres = end - start;
+    if (build->subtrees && num_spheres == 1)
+        return build->subtrees[build->refs[start].index];
+
+    BVHNode *node = bvh_arena_alloc_node(build->arena);
+    if (node == NULL)
+        return NULL;
+    int large = num_spheres > BVH_PARALLEL_GRAIN;
+
+    AABB centroid_bounds;
+    if (large)
+        compute_bounds_parallel(build->refs, start, end, node_chunks(build, start), &node->bounds, &centroid_bounds);
+    else
+        compute_bounds(build->refs, start, end, &node->bounds, &centroid_bounds);
+
+    // Subtrees cannot share a leaf, so their tops keep splitting past the depth limit
+    if (num_spheres <= 1 || (depth >= build->max_depth && !build->subtrees))
+    {
+        node->left = node->right = NULL;
+        node->first = start;
+        node->sphere_count = num_spheres;
+        return node;
+    }
+
+    // Small nodes do not need more bins than primitives, and the per-node sweep cost of a full
+    // set of bins would otherwise dominate near the leaves
+    BinGrid grid;
+    grid.bin_count = num_spheres < build->bin_count ? num_spheres : build->bin_count;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        grid.min[axis] = axis_value(centroid_bounds.min, axis);
+        float extent = axis_value(centroid_bounds.max, axis) - grid.min[axis];
+        grid.scale[axis] = extent > 0.0f ? grid.bin_count / extent : 0.0f;
+    }
+
+    int axis = 0, split_bin = 0;
+    float split_cost = find_binned_split(build, start, end, &grid, &axis, &split_bin);
+    if (!build->subtrees &&
+        bvh_sah_prefers_leaf(num_spheres, get_aabb_surface_area(node->bounds), split_cost, build->max_leaf_size))
+    {
+        node->left = node->right = NULL;
+        node->first = start;
+        node->sphere_count = num_spheres;
+        return node;
+    }
+
+    int mid;
+    if (split_cost < INFINITY)
+    {
+        if (large)
+            mid = partition_refs_parallel(build, start, end, &grid, axis, split_bin);
+        else
+            mid = partition_refs(build->refs, start, end, &grid, axis, split_bin);
+    }
+    else
+    {
+        // Coincident centroids, any split is as good as another
+        mid = start + num_spheres / 2;
+    }
+
+    if (num_spheres > BVH_TASK_THRESHOLD)
+    {
+#pragma omp task if (build->parallel)
+        node->left = build_binned_node(build, start, mid, depth + 1);
+        node->right = build_binned_node(build, mid, end, depth + 1);
+#pragma omp taskwait
+    }
+    else
+    {
+        node->left = build_binned_node(build, start, mid, depth + 1);
+        node->right = build_binned_node(build, mid, end, depth + 1);
+    }
+    // A failed allocation below fails the whole build, the arena takes the partial tree with it
+    if (node->left == NULL || node->right == NULL)
+        return NULL;
+    node->first = 0;
+    node->sphere_count = 0;
+
+    return node;
+}
+
+BVHNode *build_bvh_binned(const Sphere *spheres, int num_spheres, const BVHBuildParams *params, int *sphere_indices)
+{
+    if (num_spheres <= 0)
+        return NULL;
+
+    BVHBinnedScratch *scratch = bvh_binned_scratch_create(num_spheres);
+    BinnedBuild build = {
+        .refs = (BVHPrimRef *)malloc(num_spheres * sizeof(BVHPrimRef)),
+        .bin_count = params->bin_count,
+        .max_depth = params->max_depth,
+        .max_leaf_size = bvh_max_leaf_size(params),
+        .parallel = bvh_thread_count(params) > 1};
+
+    if (!build.refs || !scratch)
+    {
+        printf("Failed to allocate primitive references for %d spheres\n", num_spheres);
+        free(build.refs);
+        bvh_binned_scratch_free(scratch);
+        return NULL;
+    }
+    build.scratch = scratch->refs;
+    build.chunks = scratch->chunks;
+    if (build.bin_count < 2 || build.bin_count > BVH_MAX_BINS)
+        build.bin_count = BVH_DEFAULT_BINS;
+    build.arena = bvh_arena_create(bvh_thread_count(params));
+
+    BVHNode *root = NULL;
+#pragma omp parallel num_threads(bvh_thread_count(params))
+#pragma omp single
+    {
+        bvh_fill_prim_refs(build.refs, spheres, num_spheres);
+        root = build_binned_node(&build, 0, num_spheres, 0);
+
+        // Leaves cover ranges of the final reference order
+#pragma omp taskloop grainsize(BVH_PARALLEL_GRAIN)
+        for (int i = 0; i < num_spheres; i++)
+        {
+            sphere_indices[i] = build.refs[i].index;
+        }
+    }
+
+    free(build.refs);
+    bvh_binned_scratch_free(scratch);
+    bvh_arena_attach(build.arena, root);
+
+    return root;
+}
+
+BVHBinnedScratch *bvh_binned_scratch_create(int count)
+{
+    BVHBinnedScratch *scratch = (BVHBinnedScratch *)malloc(sizeof(BVHBinnedScratch));
+    if (scratch == NULL)
+        return NULL;
+
+    scratch->capacity = count > 0 ? count : 0;
+    scratch->refs = (BVHPrimRef *)malloc((count > 0 ? count : 1) * sizeof(BVHPrimRef));
+    scratch->chunks = (BinnedChunk *)malloc((count > BVH_PARALLEL_GRAIN ? chunk_slot_count(count) : 1) *
+                                            sizeof(BinnedChunk));
+    if (scratch->refs == NULL || scratch->chunks == NULL)
+    {
+        printf("Failed to allocate binned build scratch for %d references\n", count);
+        bvh_binned_scratch_free(scratch);
+        return NULL;
+    }
+    return scratch;
+}
+
+void bvh_binned_scratch_free(BVHBinnedScratch *scratch)
+{
+    if (scratch == NULL)
+        return;
+    free(scratch->refs);
+    free(scratch->chunks);
+    free(scratch);
+}
+
+// Upper levels of a tree whose bottom was built elsewhere: refs[i] describes subtrees[refs[i].index].
+// Used by the hybrid builders from inside their parallel region, and by the dynamic BVH. The new
+// nodes come from the given arena. Without a scratch of at least count references the build
+// allocates its own. With one, and num_threads 1, the build runs on the calling thread and takes
+// nothing but its count - 1 nodes from the arena.
+BVHNode *bvh_build_binned_subtrees(BVHNodeArena *arena, BVHPrimRef *refs, int count, BVHNode **subtrees,
+                                   BVHBinnedScratch *scratch, const BVHBuildParams *params)
+{
+    if (count <= 0)
+        return NULL;
+
+    BVHBinnedScratch *own = NULL;
+    if (scratch == NULL || scratch->capacity < count)
+    {
+        scratch = own = bvh_binned_scratch_create(count);
+        if (scratch == NULL)
+            return NULL;
+    }
+
+    BinnedBuild build = {
+        .refs = refs,
+        .scratch = scratch->refs,
+        .chunks = scratch->chunks,
+        .subtrees = subtrees,
+        .arena = arena,
+        .bin_count = params->bin_count,
+        .max_depth = params->max_depth,
+        .parallel = bvh_thread_count(params) > 1};
+    if (build.bin_count < 2 || build.bin_count > BVH_MAX_BINS)
+        build.bin_count = BVH_DEFAULT_BINS;
+
+    BVHNode *root = build_binned_node(&build, 0, count, 0);
+    bvh_binned_scratch_free(own);
+    return root;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+// Full sweep SAH BVH construction ("high quality" mode)
+// Time Complexity - O( n log n ) for the three initial sorts, then O( n ) work per tree level
+// The references are sorted by centroid once per axis. Every node sweeps each of its three sorted
+// lists from the right to store the exact suffix surface areas, then from the left to evaluate the
+// cost of every one of the n - 1 possible splits. After the split, the two other lists are
+// partitioned stably, so all three stay sorted inside both children without sorting again.
+// Considerably slower to build than binning, meant for static scenes that are built once.
+// Subtrees and, in large nodes, the three axis sweeps and partitions run as OpenMP tasks.
+// Nodes stop splitting under the same SAH leaf test as the binned builder.
+
+//----------------------------------------------------------------------------------------------------
+
+typedef struct SweepKey
+{
+    float key;
+    int id;
+} SweepKey;
+
+typedef struct SweepBuild
+{
+    BVHPrimRef *refs;
+    int *sorted[3];         // reference ids sorted by centroid, one list per axis
+    float *suffix_area[3];  // scratch: surface area of everything right of a split, per axis
+    int *scratch[3];        // scratch: stable partition of the lists, per axis
+    unsigned char *on_left; // scratch: side of every reference after a split
+    BVHNodeArena *arena;
+    int max_depth;
+    int max_leaf_size;
+} SweepBuild;
+
+typedef struct SweepSplit
+{
+    float cost;
+    int position;           // first index of the right child
+} SweepSplit;
+
+static int compare_sweep_keys(const void *a, const void *b)
+{
+    const SweepKey *ka = (const SweepKey *)a;
+    const SweepKey *kb = (const SweepKey *)b;
+    if (ka->key != kb->key)
+        return ka->key < kb->key ? -1 : 1;
+    return ka->id - kb->id;
+}
+
+static SweepSplit sweep_axis(SweepBuild *build, int start, int end, int axis)
+{
+    int *sorted = build->sorted[axis];
+    float *suffix_area = build->suffix_area[axis];
+    SweepSplit best = {INFINITY, start + (end - start) / 2};
+
+    AABB right_bounds = create_empty_aabb();
+    for (int i = end - 1; i > start; i--)
+    {
+        right_bounds = grow_aabb(right_bounds, build->refs[sorted[i]].bounds);
+        suffix_area[i] = get_aabb_surface_area(right_bounds);
+    }
+
+    // Equal costs (coincident spheres) prefer the split closest to the middle, so runs of equal
+    // spheres are halved instead of peeled off one at a time down to the depth limit
+    int middle = start + (end - start) / 2;
+    AABB left_bounds = create_empty_aabb();
+    for (int i = start + 1; i < end; i++)
+    {
+        left_bounds = grow_aabb(left_bounds, build->refs[sorted[i - 1]].bounds);
+        float cost = (i - start) * get_aabb_surface_area(left_bounds) + (end - i) * suffix_area[i];
+        if (cost < best.cost || (cost == best.cost && abs(i - middle) < abs(best.position - middle)))
+        {
+            best.cost = cost;
+            best.position = i;
+        }
+    }
+    return best;
+}
+
+static void partition_sorted(SweepBuild *build, int start, int end, int split, int axis)
+{
+    int *sorted = build->sorted[axis];
+    int *scratch = build->scratch[axis];
+    int left = start, right = split;
+    for (int i = start; i < end; i++)
+    {
+        if (build->on_left[sorted[i]])
+            scratch[left++] = sorted[i];
+        else
+            scratch[right++] = sorted[i];
+    }
+    memcpy(&sorted[start], &scratch[start], (end - start) * sizeof(int));
+}
+
+static BVHNode *build_sweep_node(SweepBuild *build, int start, int end, int depth)
+{
+    BVHNode *node = bvh_arena_alloc_node(build->arena);
+    if (node == NULL)
+        return NULL;
+    node->bounds = create_empty_aabb();
+
+    for (int i = start; i < end; i++)
+    {
+        node->bounds = grow_aabb(node->bounds, build->refs[build->sorted[0][i]].bounds);
+    }
+
+    int num_spheres = end - start;
+    if (num_spheres <= 1 || depth >= build->max_depth)
+    {
+        node->left = node->right = NULL;
+        node->first = start;
+        node->sphere_count = num_spheres;
+        return node;
+    }
+
+    // The three axes are independent sweeps, large nodes run them as separate tasks
+    int large = num_spheres > BVH_PARALLEL_GRAIN;
+    SweepSplit splits[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+#pragma omp task shared(splits) if (large)
+        splits[axis] = sweep_axis(build, start, end, axis);
+    }
+#pragma omp taskwait
+
+    int best_axis = 0;
+    for (int axis = 1; axis < 3; axis++)
+    {
+        if (splits[axis].cost < splits[best_axis].cost)
+            best_axis = axis;
+    }
+    if (bvh_sah_prefers_leaf(num_spheres, get_aabb_surface_area(node->bounds), splits[best_axis].cost,
+                             build->max_leaf_size))
+    {
+        node->left = node->right = NULL;
+        node->first = start;
+        node->sphere_count = num_spheres;
+        return node;
+    }
+    int best_split = splits[best_axis].position;
+
+    for (int i = start; i < end; i++)
+    {
+        build->on_left[build->sorted[best_axis][i]] = i < best_split;
+    }
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (axis == best_axis)
+            continue;
+#pragma omp task if (large)
+        partition_sorted(build, start, end, best_split, axis);
+    }
+#pragma omp taskwait
+
+    if (num_spheres > BVH_TASK_THRESHOLD)
+    {
+#pragma omp task
+        node->left = build_sweep_node(build, start, best_split, depth + 1);
+        node->right = build_sweep_node(build, best_split, end, depth + 1);
+#pragma omp taskwait
+    }
+    else
+    {
+        node->left = build_sweep_node(build, start, best_split, depth + 1);
+        node->right = build_sweep_node(build, best_split, end, depth + 1);
+    }
+    // A failed allocation below fails the whole build, the arena takes the partial tree with it
+    if (node->left == NULL || node->right == NULL)
+        return NULL;
+    node->first = 0;
+    node->sphere_count = 0;
+
+    return node;
+}
+
+static int sort_by_axis(SweepBuild *build, int num_spheres, int axis)
+{
+    SweepKey *keys = (SweepKey *)malloc(num_spheres * sizeof(SweepKey));
+    if (keys == NULL)
+        return 0;
+    for (int i = 0; i < num_spheres; i++)
+    {
+        keys[i].key = axis_value(build->refs[i].centroid, axis);
+        keys[i].id = i;
+    }
+    qsort(keys, num_spheres, sizeof(SweepKey), compare_sweep_keys);
+    for (int i = 0; i < num_spheres; i++)
+    {
+        build->sorted[axis][i] = keys[i].id;
+    }
+    free(keys);
+    return 1;
+}
+
+BVHNode *build_bvh_sweep(const Sphere *spheres, int num_spheres, const BVHBuildParams *params, int *sphere_indices)
+{
+    if (num_spheres <= 0)
+        return NULL;
+
+    SweepBuild build = {
+        .refs = (BVHPrimRef *)malloc(num_spheres * sizeof(BVHPrimRef)),
+        .on_left = (unsigned char *)malloc(num_spheres),
+        .max_depth = params->max_depth,
+        .max_leaf_size = bvh_max_leaf_size(params),
+        .arena = bvh_arena_create(bvh_thread_count(params))};
+
+    int ok = build.refs && build.on_left;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        build.sorted[axis] = (int *)malloc(num_spheres * sizeof(int));
+        build.suffix_area[axis] = (float *)malloc(num_spheres * sizeof(float));
+        build.scratch[axis] = (int *)malloc(num_spheres * sizeof(int));
+        ok = ok && build.sorted[axis] && build.suffix_area[axis] && build.scratch[axis];
+    }
+
+    BVHNode *root = NULL;
+    if (ok)
+    {
+#pragma omp parallel num_threads(bvh_thread_count(params))
+#pragma omp single
+        {
+            bvh_fill_prim_refs(build.refs, spheres, num_spheres);
+            int sorted[3];
+            for (int axis = 0; axis < 3; axis++)
+            {
+#pragma omp task shared(sorted)
+                sorted[axis] = sort_by_axis(&build, num_spheres, axis);
+            }
+#pragma omp taskwait
+
+            if (sorted[0] && sorted[1] && sorted[2])
+            {
+                root = build_sweep_node(&build, 0, num_spheres, 0);
+
+                // Leaf ranges are identical in all three lists, take the x-sorted one as the final order
+#pragma omp taskloop grainsize(BVH_PARALLEL_GRAIN)
+                for (int i = 0; i < num_spheres; i++)
+                {
+                    sphere_indices[i] = build.refs[build.sorted[0][i]].index;
+                }
+            }
+            else
+            {
+                printf("Failed to allocate sweep SAH sort keys for %d spheres\n", num_spheres);
+            }
+        }
+    }
+    else
+    {
+        printf("Failed to allocate sweep SAH build data for %d spheres\n", num_spheres);
+    }
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        free(build.sorted[axis]);
+        free(build.suffix_area[axis]);
+        free(build.scratch[axis]);
+    }
+    free(build.refs);
+    free(build.on_left);
+    bvh_arena_attach(build.arena, root);
+
+    return root;
+}
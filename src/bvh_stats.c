@@ -0,0 +1,336 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include "Custom/bvh_stats.h"
+
+#if defined(_WIN32) && !defined(PRIu64)
+#define PRIu64 "I64u"
+#endif
+
+//----------------------------------------------------------------------------------------------------
+
+// BVH quality and memory report
+// Tells tree quality apart from traversal speed: two trees with the same throughput gap and the
+// same SAH cost point at the kernel, a gap in SAH cost or EPO points at the builder.
+// - Both tree forms are first copied into one array of StatsNode, so every measure is computed
+//   once for pointer trees and flattened trees alike.
+// - SAH cost uses the active cost model and the normalization of bvh_sah_cost().
+// - EPO (end-point overlap) is the cost of the parts of spheres that lie inside a node without
+//   belonging to its subtree: a ray hitting them has to visit the node for nothing. Every node adds
+//   its own cost (traversal cost, or intersection cost times its spheres for a leaf) times the
+//   overlapping sphere area, over the total sphere area. The area of a sphere inside a box is
+//   approximated by the sphere's area times the share of its bounding box inside that box.
+// - Sibling overlap is the volume the two children of a node share, which rays inside it pay for
+//   twice.
+
+//----------------------------------------------------------------------------------------------------
+
+typedef struct StatsNode
+{
+    AABB bounds;
+    int left;               // -1 for leaves
+    int right;
+    int first;              // leaves: first sphere slot
+    int count;
+} StatsNode;
+
+typedef struct StatsTree
+{
+    StatsNode *nodes;
+    int node_count;
+    const Sphere *spheres;
+    const int *sphere_indices;
+    BVHCostModel costs;
+} StatsTree;
+
+static int pointer_node_count(const BVHNode *node)
+{
+    if (node->left == NULL)
+        return 1;
+    return 1 + pointer_node_count(node->left) + pointer_node_count(node->right);
+}
+
+static int copy_pointer_node(StatsTree *tree, const BVHNode *node, int *next)
+{
+    int index = (*next)++;
+    StatsNode *out = &tree->nodes[index];
+    out->bounds = node->bounds;
+    if (node->left == NULL)
+    {
+        out->left = out->right = -1;
+        out->first = node->first;
+        out->count = node->sphere_count > 0 ? node->sphere_count : 0;
+        return index;
+    }
+    out->first = out->count = 0;
+    int left = copy_pointer_node(tree, node->left, next);
+    int right = copy_pointer_node(tree, node->right, next);
+    tree->nodes[index].left = left;
+    tree->nodes[index].right = right;
+    return index;
+}
+
+static float box_volume(AABB box)
+{
+    float x = box.max.x - box.min.x, y = box.max.y - box.min.y, z = box.max.z - box.min.z;
+    return x > 0.0f && y > 0.0f && z > 0.0f ? x * y * z : 0.0f;
+}
+
+static AABB box_intersection(AABB a, AABB b)
+{
+    return (AABB){
+        {max_f(a.min.x, b.min.x), max_f(a.min.y, b.min.y), max_f(a.min.z, b.min.z)},
+        {min_f(a.max.x, b.max.x), min_f(a.max.y, b.max.y), min_f(a.max.z, b.max.z)}};
+}
+
+static int boxes_overlap(AABB a, AABB b)
+{
+    return a.min.x <= b.max.x && b.min.x <= a.max.x && a.min.y <= b.max.y && b.min.y <= a.max.y &&
+           a.min.z <= b.max.z && b.min.z <= a.max.z;
+}
+
+static float node_cost(const StatsTree *tree, const StatsNode *node)
+{
+    if (node->left < 0)
+        return tree->costs.intersect_cost * node->count;
+    return tree->costs.traversal_cost;
+}
+
+// Depth, histograms, SAH cost and overlap in one pass
+static void walk(const StatsTree *tree, int index, int depth, BVHStats *stats, double *sah, double *node_volume)
+{
+    const StatsNode *node = &tree->nodes[index];
+    float area = get_aabb_surface_area(node->bounds);
+    if (node->left < 0)
+    {
+        stats->leaf_count++;
+        if (depth > stats->depth)
+            stats->depth = depth;
+        if (node->count == 0)
+        {
+            stats->empty_leaf_count++;
+            return;
+        }
+        stats->depth_histogram[depth <= BVH_STATS_MAX_DEPTH ? depth - 1 : BVH_STATS_MAX_DEPTH - 1]++;
+        stats->leaf_histogram[node->count < BVH_STATS_LEAF_BINS ? node->count : BVH_STATS_LEAF_BINS - 1]++;
+        stats->sphere_count += node->count;
+        stats->mean_leaf_depth += (double)depth * node->count;
+        if (stats->min_leaf_size == 0 || node->count < stats->min_leaf_size)
+            stats->min_leaf_size = node->count;
+        if (node->count > stats->max_leaf_size)
+            stats->max_leaf_size = node->count;
+        *sah += tree->costs.intersect_cost * node->count * area;
+        return;
+    }
+
+    stats->interior_count++;
+    *sah += tree->costs.traversal_cost * area;
+    AABB left = tree->nodes[node->left].bounds, right = tree->nodes[node->right].bounds;
+    stats->overlap_volume += box_volume(box_intersection(left, right));
+    *node_volume += box_volume(node->bounds);
+    walk(tree, node->left, depth + 1, stats, sah, node_volume);
+    walk(tree, node->right, depth + 1, stats, sah, node_volume);
+}
+
+// EPO of one sphere stored in leaf target: returns 1 if target lies below index. Nodes the sphere
+// does not touch cannot hold target either, so the walk stops there.
+static int sphere_epo(const StatsTree *tree, int index, int target, AABB sphere_box, float box_volume_inv,
+                      double *epo)
+{
+    const StatsNode *node = &tree->nodes[index];
+    if (!boxes_overlap(node->bounds, sphere_box))
+        return 0;
+
+    int found = index == target;
+    if (node->left >= 0)
+    {
+        found |= sphere_epo(tree, node->left, target, sphere_box, box_volume_inv, epo);
+        found |= sphere_epo(tree, node->right, target, sphere_box, box_volume_inv, epo);
+    }
+    if (!found)
+        *epo += node_cost(tree, node) * box_volume(box_intersection(node->bounds, sphere_box)) * box_volume_inv;
+    return found;
+}
+
+static float tree_epo(const StatsTree *tree)
+{
+    double epo = 0.0, total_area = 0.0;
+    for (int i = 0; i < tree->node_count; i++)
+    {
+        const StatsNode *leaf = &tree->nodes[i];
+        if (leaf->left >= 0)
+            continue;
+        for (int slot = leaf->first; slot < leaf->first + leaf->count; slot++)
+        {
+            const Sphere *sphere = &tree->spheres[bvh_leaf_sphere(tree->sphere_indices, slot)];
+            AABB box = create_aabb_from_sphere(sphere);
+            float area = 4.0f * (float)M_PI * sphere->radius * sphere->radius;
+            float volume = box_volume(box);
+            total_area += area;
+            if (volume > 0.0f)
+            {
+                double overlap = 0.0;
+                sphere_epo(tree, 0, i, box, 1.0f / volume, &overlap);
+                epo += overlap * area;
+            }
+        }
+    }
+    return total_area > 0.0 ? (float)(epo / total_area) : 0.0f;
+}
+
+static void compute_stats(StatsTree *tree, BVHStats *stats)
+{
+    double sah = 0.0, node_volume = 0.0;
+    walk(tree, 0, 1, stats, &sah, &node_volume);
+    stats->node_count = tree->node_count;
+
+    float root_area = get_aabb_surface_area(tree->nodes[0].bounds);
+    int filled = stats->leaf_count - stats->empty_leaf_count;
+    stats->sah_cost = root_area > 0.0f ? (float)(sah / root_area) : 0.0f;
+    stats->epo = tree_epo(tree);
+    stats->overlap_ratio = node_volume > 0.0 ? stats->overlap_volume / node_volume : 0.0;
+    stats->mean_leaf_size = filled > 0 ? (double)stats->sphere_count / filled : 0.0;
+    stats->mean_leaf_depth = stats->sphere_count > 0 ? stats->mean_leaf_depth / stats->sphere_count : 0.0;
+}
+
+// Called once node_bytes and index_bytes are known
+static void finish_memory(BVHStats *stats)
+{
+    stats->total_bytes = stats->node_bytes + stats->index_bytes;
+    stats->bytes_per_sphere = stats->sphere_count > 0 ? (double)stats->total_bytes / stats->sphere_count : 0.0;
+}
+
+int bvh_stats(const BVHNode *root, const Sphere *spheres, const int *sphere_indices, BVHStats *stats)
+{
+    memset(stats, 0, sizeof(BVHStats));
+    if (root == NULL)
+        return 1;
+
+    StatsTree tree = {NULL, pointer_node_count(root), spheres, sphere_indices, bvh_cost_model()};
+    tree.nodes = (StatsNode *)malloc(tree.node_count * sizeof(StatsNode));
+    if (!tree.nodes)
+        return 0;
+    int next = 0;
+    copy_pointer_node(&tree, root, &next);
+
+    stats->node_bytes = (size_t)tree.node_count * sizeof(BVHNode);
+    compute_stats(&tree, stats);
+    stats->index_bytes = sphere_indices ? (size_t)stats->sphere_count * sizeof(int) : 0;
+    finish_memory(stats);
+
+    free(tree.nodes);
+    return 1;
+}
+
+int bvh_linear_stats(const LinearBVH *bvh, BVHStats *stats)
+{
+    memset(stats, 0, sizeof(BVHStats));
+    if (bvh == NULL || bvh->node_count == 0)
+        return 1;
+
+    StatsTree tree = {NULL, bvh->node_count, bvh->spheres, bvh->sphere_indices, bvh_cost_model()};
+    tree.nodes = (StatsNode *)malloc(tree.node_count * sizeof(StatsNode));
+    if (!tree.nodes)
+        return 0;
+    for (int i = 0; i < bvh->node_count; i++)
+    {
+        const LinearBVHNode *node = &bvh->nodes[i];
+        StatsNode *out = &tree.nodes[i];
+        out->bounds = (AABB){{node->min[0], node->min[1], node->min[2]}, {node->max[0], node->max[1], node->max[2]}};
+        out->left = node->count > 0 ? -1 : i + 1;
+        out->right = node->count > 0 ? -1 : node->offset;
+        out->first = node->count > 0 ? node->offset : 0;
+        out->count = node->count;
+    }
+
+    stats->node_bytes = (size_t)tree.node_count * sizeof(LinearBVHNode);
+    compute_stats(&tree, stats);
+    stats->index_bytes = bvh->sphere_indices ? (size_t)stats->sphere_count * sizeof(int) : 0;
+    finish_memory(stats);
+
+    free(tree.nodes);
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+void bvh_stats_print(FILE *out, const char *label, const BVHStats *stats)
+{
+    fprintf(out, "BVH stats%s%s:\n", label ? " - " : "", label ? label : "");
+    fprintf(out, "Nodes: %d (%d interior, %d leaves, %d empty), depth %d\n", stats->node_count,
+            stats->interior_count, stats->leaf_count, stats->empty_leaf_count, stats->depth);
+    fprintf(out, "SAH cost: %.2f, EPO: %.2f, sibling overlap: %.4g (%.2f%% of the interior node volume)\n",
+            stats->sah_cost, stats->epo, stats->overlap_volume, 100.0 * stats->overlap_ratio);
+    fprintf(out, "Leaves: %.2f spheres on average (%d to %d), spheres at depth %.1f on average\n",
+            stats->mean_leaf_size, stats->min_leaf_size, stats->max_leaf_size, stats->mean_leaf_depth);
+    fprintf(out, "Memory: %" PRIu64 " bytes of nodes, %" PRIu64 " bytes of sphere indices, %.1f bytes per sphere\n",
+            (uint64_t)stats->node_bytes, (uint64_t)stats->index_bytes, stats->bytes_per_sphere);
+
+    fprintf(out, "Leaves per depth:");
+    for (int d = 0; d < BVH_STATS_MAX_DEPTH; d++)
+    {
+        if (stats->depth_histogram[d] > 0)
+            fprintf(out, " %d%s:%d", d + 1, d == BVH_STATS_MAX_DEPTH - 1 ? "+" : "", stats->depth_histogram[d]);
+    }
+    fprintf(out, "\nLeaves per sphere count:");
+    for (int c = 0; c < BVH_STATS_LEAF_BINS; c++)
+    {
+        if (stats->leaf_histogram[c] > 0)
+            fprintf(out, " %d%s:%d", c, c == BVH_STATS_LEAF_BINS - 1 ? "+" : "", stats->leaf_histogram[c]);
+    }
+    fprintf(out, "\n\n");
+}
+
+static void print_json_array(FILE *out, const char *name, const int *values, int count)
+{
+    fprintf(out, ", \"%s\": [", name);
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(out, "%s%d", i > 0 ? ", " : "", values[i]);
+    }
+    fprintf(out, "]");
+}
+
+// Quotes, backslashes and control characters escaped, so any label gives a valid JSON string
+static void print_json_string(FILE *out, const char *text)
+{
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char *)text; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            fprintf(out, "\\%c", *c);
+        else if (*c == '\n')
+            fputs("\\n", out);
+        else if (*c == '\t')
+            fputs("\\t", out);
+        else if (*c < 0x20)
+            fprintf(out, "\\u%04x", *c);
+        else
+            fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+void bvh_stats_print_json(FILE *out, const char *label, const BVHStats *stats)
+{
+    // The depth histogram ends at the deepest leaf
+    int depth_bins = stats->depth < BVH_STATS_MAX_DEPTH ? stats->depth : BVH_STATS_MAX_DEPTH;
+
+    fprintf(out, "{\"label\": ");
+    print_json_string(out, label ? label : "");
+    fprintf(out, ", ");
+    fprintf(out, "\"node_count\": %d, \"interior_count\": %d, \"leaf_count\": %d, \"empty_leaf_count\": %d, ",
+            stats->node_count, stats->interior_count, stats->leaf_count, stats->empty_leaf_count);
+    fprintf(out, "\"sphere_count\": %d, \"depth\": %d, ", stats->sphere_count, stats->depth);
+    fprintf(out, "\"sah_cost\": %.6g, \"epo\": %.6g, \"overlap_volume\": %.6g, \"overlap_ratio\": %.6g, ",
+            stats->sah_cost, stats->epo, stats->overlap_volume, stats->overlap_ratio);
+    fprintf(out, "\"min_leaf_size\": %d, \"max_leaf_size\": %d, \"mean_leaf_size\": %.6g, \"mean_leaf_depth\": %.6g, ",
+            stats->min_leaf_size, stats->max_leaf_size, stats->mean_leaf_size, stats->mean_leaf_depth);
+    fprintf(out, "\"node_bytes\": %" PRIu64 ", \"index_bytes\": %" PRIu64 ", \"total_bytes\": %" PRIu64 ", \"bytes_per_sphere\": %.6g",
+            (uint64_t)stats->node_bytes, (uint64_t)stats->index_bytes, (uint64_t)stats->total_bytes, stats->bytes_per_sphere);
+    print_json_array(out, "depth_histogram", stats->depth_histogram, depth_bins);
+    print_json_array(out, "leaf_histogram", stats->leaf_histogram, BVH_STATS_LEAF_BINS);
+    fprintf(out, "}\n");
+}
@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "Custom/bvh_wide.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// bvh_collapse_wide() - Collapses the binary tree of any builder into a 4-wide or 8-wide BVH
+// - Every wide node starts from the two children of a binary node and keeps opening the child
+//   with the largest surface area (the one most rays would enter) until it has width children or
+//   only leaves are left. The opened binary nodes disappear, so the tree is about half as deep.
+// - Child bounds are stored SoA (see bvh_wide.h), so the traversal tests all children of a node
+//   with one SIMD slab test, and unused slots get inverted bounds that can never be hit.
+// - Leaves keep an offset/count range of sphere slots, as in bvh_flatten(), empty leaves of
+//   build_bvh_node() are dropped.
+// Nodes are stored depth-first, the pointer tree is left untouched.
+
+//----------------------------------------------------------------------------------------------------
+
+typedef struct WideBuild
+{
+    WideBVH *bvh;
+    const int *sphere_indices;
+    int next;
+    int next_slot;
+} WideBuild;
+
+static int is_empty_leaf(const BVHNode *node)
+{
+    return node->left == NULL && node->sphere_count <= 0;
+}
+
+static int interior_node_count(const BVHNode *node)
+{
+    if (node->left == NULL)
+        return 0;
+    return 1 + interior_node_count(node->left) + interior_node_count(node->right);
+}
+
+static int gather_children(const BVHNode *node, int width, const BVHNode **children)
+{
+    if (node->left == NULL)
+    {
+        children[0] = node;
+        return 1;
+    }
+
+    int count = 2;
+    children[0] = node->left;
+    children[1] = node->right;
+    while (count < width)
+    {
+        int largest = -1;
+        float largest_area = -1.0f;
+        for (int i = 0; i < count; i++)
+        {
+            if (children[i]->left == NULL)
+                continue;
+            float area = get_aabb_surface_area(children[i]->bounds);
+            if (area > largest_area)
+            {
+                largest_area = area;
+                largest = i;
+            }
+        }
+        if (largest < 0)
+            break;
+
+        const BVHNode *opened = children[largest];
+        children[largest] = opened->left;
+        children[count++] = opened->right;
+    }
+
+    int kept = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (!is_empty_leaf(children[i]))
+            children[kept++] = children[i];
+    }
+    return kept;
+}
+
+static void set_child_bounds(WideBuild *build, int index, int slot, AABB box)
+{
+    int width = build->bvh->width;
+    float *bounds = build->bvh->bounds + (size_t)index * 6 * width;
+    bounds[0 * width + slot] = box.min.x;
+    bounds[1 * width + slot] = box.min.y;
+    bounds[2 * width + slot] = box.min.z;
+    bounds[3 * width + slot] = box.max.x;
+    bounds[4 * width + slot] = box.max.y;
+    bounds[5 * width + slot] = box.max.z;
+}
+
+static int emit_wide_node(WideBuild *build, const BVHNode *node, int depth)
+{
+    int width = build->bvh->width;
+    int index = build->next++;
+    if (depth > build->bvh->depth)
+        build->bvh->depth = depth;
+
+    const BVHNode *children[WIDE_BVH_MAX_WIDTH];
+    int count = gather_children(node, width, children);
+
+    for (int slot = 0; slot < width; slot++)
+    {
+        WideBVHSlot *out = &build->bvh->slots[(size_t)index * width + slot];
+        if (slot >= count)
+        {
+            set_child_bounds(build, index, slot, create_empty_aabb());
+            out->child = -1;
+            out->count = WIDE_BVH_EMPTY;
+            continue;
+        }
+
+        const BVHNode *child = children[slot];
+        set_child_bounds(build, index, slot, child->bounds);
+        if (child->left == NULL)
+        {
+            out->child = child->first;
+            out->count = child->sphere_count;
+            if (build->sphere_indices)
+            {
+                memcpy(&build->bvh->sphere_indices[build->next_slot], &build->sphere_indices[child->first],
+                       child->sphere_count * sizeof(int));
+                out->child = build->next_slot;
+                build->next_slot += child->sphere_count;
+            }
+        }
+        else
+        {
+            out->count = WIDE_BVH_INTERIOR;
+            out->child = emit_wide_node(build, child, depth + 1);
+        }
+    }
+    return index;
+}
+
+WideBVH *bvh_collapse_wide(const BVHNode *root, Sphere *spheres, const int *sphere_indices, int width)
+{
+    if (width != 4 && width != 8)
+    {
+        printf("Unsupported wide BVH width %d, use 4 or 8\n", width);
+        return NULL;
+    }
+
+    // Every wide node consumes at least one binary interior node
+    int max_nodes = root ? interior_node_count(root) : 0;
+    max_nodes = max_nodes > 0 ? max_nodes : 1;
+    int slots = bvh_sphere_count(root);
+
+    WideBVH *bvh = (WideBVH *)malloc(sizeof(WideBVH));
+    if (!bvh)
+        return NULL;
+    *bvh = (WideBVH){
+        .width = width,
+        .node_count = 0,
+        .depth = 0,
+        .bounds = (float *)malloc((size_t)max_nodes * 6 * width * sizeof(float)),
+        .slots = (WideBVHSlot *)malloc((size_t)max_nodes * width * sizeof(WideBVHSlot)),
+        .spheres = spheres,
+        .sphere_indices = sphere_indices ? (int *)malloc((size_t)(slots > 0 ? slots : 1) * sizeof(int)) : NULL};
+    if (!bvh->bounds || !bvh->slots || (sphere_indices && !bvh->sphere_indices))
+    {
+        printf("Failed to allocate %d wide BVH nodes\n", max_nodes);
+        free_wide_bvh(bvh);
+        return NULL;
+    }
+
+    if (root && !is_empty_leaf(root))
+    {
+        WideBuild build = {.bvh = bvh, .sphere_indices = sphere_indices, .next = 0, .next_slot = 0};
+        emit_wide_node(&build, root, 1);
+        bvh->node_count = build.next;
+    }
+
+    // Every visited node pushes at most width - 1 children besides the one visited next
+    if (bvh->depth * (width - 1) + 1 > WIDE_BVH_STACK_SIZE)
+    {
+        printf("Wide BVH depth %d exceeds the traversal stack\n", bvh->depth);
+        free_wide_bvh(bvh);
+        return NULL;
+    }
+    return bvh;
+}
+
+void free_wide_bvh(WideBVH *bvh)
+{
+    if (!bvh)
+        return;
+    free(bvh->bounds);
+    free(bvh->slots);
+    free(bvh->sphere_indices);
+    free(bvh);
+}
@@ -2,7 +2,15 @@
 #include "Custom/vec3.h"
 #include "Custom/constants.h"
 #include "Custom/bvh.h"
+#include "Custom/bvh_linear.h"
+#include "Custom/bvh_wide.h"
+#include "Custom/bvh_compressed.h"
+#include "Custom/bvh_instance.h"
 #include <math.h>
+#include <string.h>
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
 
 //--------------------------------------------------------------------------------------------------
 
@@ -82,28 +90,512 @@ int ray_aabb_intersect(Ray ray, AABB box) {
 }
 //--------------------------------------------------------------------------------------------------
 
-// ray_bvh_intersect() - Returns the hitrecord for the given ray
-// Main function for intersection test by traversing Bounding Volume Hierarchies (BVH) using DFS
+// ray_bvh_node_intersect() - Returns the hitrecord for the given ray
+// Intersection test by traversing the pointer tree of the builders using DFS
+// Every sphere of a leaf is tested, the leaf's slots are looked up in sphere_indices (or index
+// spheres directly if sphere_indices is NULL)
 
 //--------------------------------------------------------------------------------------------------
 
 
-HitRecord ray_bvh_intersect(Ray ray, BVHNode* node) {
+HitRecord ray_bvh_node_intersect(Ray ray, BVHNode* node, Sphere* spheres, const int* sphere_indices) {
     HitRecord rec = {0};
     
     if (!ray_aabb_intersect(ray, node->bounds)) {
         return rec;
     }
     
-    if (node->sphere != NULL) {
-        return ray_sphere_intersect(ray, node->sphere);
+    if (node->left == NULL) {
+        for (int i = 0; i < node->sphere_count; i++) {
+            HitRecord hit = ray_sphere_intersect(ray, &spheres[bvh_leaf_sphere(sphere_indices, node->first + i)]);
+            if (hit.hit_something && (!rec.hit_something || hit.t < rec.t)) {
+                rec = hit;
+            }
+        }
+        return rec;
     }
     
-    HitRecord left_hit = ray_bvh_intersect(ray, node->left);
-    HitRecord right_hit = ray_bvh_intersect(ray, node->right);
+    HitRecord left_hit = ray_bvh_node_intersect(ray, node->left, spheres, sphere_indices);
+    HitRecord right_hit = ray_bvh_node_intersect(ray, node->right, spheres, sphere_indices);
     
     if (!left_hit.hit_something) return right_hit;
     if (!right_hit.hit_something) return left_hit;
     
     return (left_hit.t < right_hit.t) ? left_hit : right_hit;
 }
+
+//--------------------------------------------------------------------------------------------------
+
+// ray_bvh_intersect() - Returns the hitrecord for the given ray
+// Main function for intersection test, traverses the flattened BVH (bvh_flatten()) iteratively
+// - The inverse ray direction is computed once per ray, so the slab test only multiplies.
+// - Interior nodes visit the child on the ray's side of their ordering axis first and push the other.
+// - Nodes starting beyond the closest hit found so far are skipped.
+// - Every sphere of a leaf is tested.
+// ray_bvh_intersect_counted() is the same traversal counting node and sphere tests, for the SAH
+// cost calibration.
+
+//--------------------------------------------------------------------------------------------------
+
+// Inverse of a ray direction component. Zero components are replaced by a tiny value of the same
+// sign, so the slab tests never compute 0 * infinity.
+static inline float safe_inverse(float d) {
+    return 1.0f / (fabsf(d) > 1e-20f ? d : copysignf(1e-20f, d));
+}
+
+static inline int ray_linear_node_intersect(const LinearBVHNode* node, const float origin[3],
+                                            const float inv_dir[3], float t_max) {
+    float t_near = EPSILON, t_far = t_max;
+    for (int axis = 0; axis < 3; axis++) {
+        float t0 = (node->min[axis] - origin[axis]) * inv_dir[axis];
+        float t1 = (node->max[axis] - origin[axis]) * inv_dir[axis];
+        t_near = max_f(t_near, min_f(t0, t1));
+        t_far = min_f(t_far, max_f(t0, t1));
+    }
+    return t_near <= t_far;
+}
+
+// Closest hit nearer than t_max, the instanced traversal passes the closest hit of earlier instances.
+// counts is NULL outside of the cost calibration, the branches on it are folded away when inlined.
+static inline HitRecord linear_bvh_closest_hit(Ray ray, const LinearBVH* bvh, float t_max, BVHTraceCounts* counts) {
+    HitRecord closest = {0};
+    closest.t = t_max;
+    if (!bvh || bvh->node_count == 0) {
+        return closest;
+    }
+
+    float origin[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+    float inv_dir[3] = {safe_inverse(ray.direction.x), safe_inverse(ray.direction.y), safe_inverse(ray.direction.z)};
+    int dir_is_neg[3] = {inv_dir[0] < 0.0f, inv_dir[1] < 0.0f, inv_dir[2] < 0.0f};
+
+    int stack[LINEAR_BVH_MAX_DEPTH];
+    int stack_size = 0;
+    int index = 0;
+
+    while (1) {
+        const LinearBVHNode* node = &bvh->nodes[index];
+        if (counts) {
+            counts->node_tests++;
+        }
+        if (ray_linear_node_intersect(node, origin, inv_dir, closest.t)) {
+            if (node->count > 0) {
+                if (counts) {
+                    counts->sphere_tests += node->count;
+                }
+                for (int i = 0; i < node->count; i++) {
+                    HitRecord hit = ray_sphere_intersect(ray, &bvh->spheres[bvh_leaf_sphere(bvh->sphere_indices, node->offset + i)]);
+                    if (hit.hit_something && hit.t < closest.t) {
+                        closest = hit;
+                    }
+                }
+            } else if (dir_is_neg[node->axis]) {
+                stack[stack_size++] = index + 1;
+                index = node->offset;
+                continue;
+            } else {
+                stack[stack_size++] = node->offset;
+                index = index + 1;
+                continue;
+            }
+        }
+        if (stack_size == 0) {
+            break;
+        }
+        index = stack[--stack_size];
+    }
+    return closest;
+}
+
+HitRecord ray_bvh_intersect(Ray ray, const LinearBVH* bvh) {
+    return linear_bvh_closest_hit(ray, bvh, INFINITY, NULL);
+}
+
+HitRecord ray_bvh_intersect_counted(Ray ray, const LinearBVH* bvh, BVHTraceCounts* counts) {
+    return linear_bvh_closest_hit(ray, bvh, INFINITY, counts);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// ray_clustered_bvh_intersect() - Returns the hitrecord for the given ray
+// The traversal of ray_bvh_intersect() on a re-laid-out tree (bvh_cluster_layout()): the children
+// of an interior node are the pair at its offset, the first of them is the one ray_bvh_intersect()
+// would find at index + 1. Only the addressing of the children differs.
+
+//--------------------------------------------------------------------------------------------------
+
+HitRecord ray_clustered_bvh_intersect(Ray ray, const ClusteredBVH* bvh) {
+    HitRecord closest = {0};
+    closest.t = INFINITY;
+    if (!bvh || bvh->node_count == 0) {
+        return closest;
+    }
+
+    float origin[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+    float inv_dir[3] = {safe_inverse(ray.direction.x), safe_inverse(ray.direction.y), safe_inverse(ray.direction.z)};
+    int dir_is_neg[3] = {inv_dir[0] < 0.0f, inv_dir[1] < 0.0f, inv_dir[2] < 0.0f};
+
+    int stack[LINEAR_BVH_MAX_DEPTH];
+    int stack_size = 0;
+    int index = 0;
+
+    while (1) {
+        const LinearBVHNode* node = &bvh->nodes[index];
+        if (ray_linear_node_intersect(node, origin, inv_dir, closest.t)) {
+            if (node->count > 0) {
+                for (int i = 0; i < node->count; i++) {
+                    HitRecord hit = ray_sphere_intersect(ray, &bvh->spheres[bvh_leaf_sphere(bvh->sphere_indices, node->offset + i)]);
+                    if (hit.hit_something && hit.t < closest.t) {
+                        closest = hit;
+                    }
+                }
+            } else if (dir_is_neg[node->axis]) {
+                stack[stack_size++] = node->offset;
+                index = node->offset + 1;
+                continue;
+            } else {
+                stack[stack_size++] = node->offset + 1;
+                index = node->offset;
+                continue;
+            }
+        }
+        if (stack_size == 0) {
+            break;
+        }
+        index = stack[--stack_size];
+    }
+    return closest;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// ray_tlas_intersect() - Returns the hitrecord for the given ray, traversing a two level BVH of
+// instanced clusters (bvh_build_tlas())
+// - The top level is traversed like the flattened BVH, its leaves hold instances.
+// - At an instance, the ray is moved into the cluster's object space with the inverse transform and
+//   the cluster's own BVH is traversed. The direction is not renormalized, so t stays the world
+//   space distance parameter and hits of different instances compare directly.
+// - The closest hit so far bounds the traversal of every later instance.
+// - Hit point and normal are moved back into world space, object still points at the shared sphere.
+
+//--------------------------------------------------------------------------------------------------
+
+HitRecord ray_tlas_intersect(Ray ray, const TLAS* tlas) {
+    HitRecord closest = {0};
+    closest.t = INFINITY;
+    if (!tlas || tlas->node_count == 0) {
+        return closest;
+    }
+
+    float origin[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+    float inv_dir[3] = {safe_inverse(ray.direction.x), safe_inverse(ray.direction.y), safe_inverse(ray.direction.z)};
+    int dir_is_neg[3] = {inv_dir[0] < 0.0f, inv_dir[1] < 0.0f, inv_dir[2] < 0.0f};
+
+    int stack[LINEAR_BVH_MAX_DEPTH];
+    int stack_size = 0;
+    int index = 0;
+
+    while (1) {
+        const LinearBVHNode* node = &tlas->nodes[index];
+        if (ray_linear_node_intersect(node, origin, inv_dir, closest.t)) {
+            if (node->count > 0) {
+                for (int i = 0; i < node->count; i++) {
+                    const BVHInstance* instance = &tlas->instances[node->offset + i];
+                    Ray local = {
+                        transform_point(&instance->world_to_object, ray.origin),
+                        transform_vector(&instance->world_to_object, ray.direction)};
+                    HitRecord hit = linear_bvh_closest_hit(local, instance->blas->bvh, closest.t, NULL);
+                    if (hit.hit_something && hit.t < closest.t) {
+                        hit.point = vec3_add(ray.origin, vec3_multiply(ray.direction, hit.t));
+                        hit.normal = transform_normal(&instance->world_to_object, hit.normal);
+                        closest = hit;
+                    }
+                }
+            } else if (dir_is_neg[node->axis]) {
+                stack[stack_size++] = index + 1;
+                index = node->offset;
+                continue;
+            } else {
+                stack[stack_size++] = node->offset;
+                index = index + 1;
+                continue;
+            }
+        }
+        if (stack_size == 0) {
+            break;
+        }
+        index = stack[--stack_size];
+    }
+    return closest;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// ray_wide_bvh_intersect() - Returns the hitrecord for the given ray, traversing a wide BVH
+// (bvh_collapse_wide())
+// - All children of a node are slab tested at once: AVX for 8 children when compiled with AVX,
+//   SSE for groups of 4 children otherwise, and a scalar loop on targets without SSE.
+// - The slab test reads the near and far plane of each axis directly from the sign of the ray
+//   direction, so inverted bounds of unused slots are never hit.
+// - Children that are hit get sorted by entry distance and pushed far to near, so the nearest
+//   child is visited next. Entries farther away than the closest hit are dropped when popped.
+
+//--------------------------------------------------------------------------------------------------
+
+typedef struct WideRay {
+    float origin[3];
+    float inv_dir[3];
+    int near_row[3];        // row of the near plane of each axis, the far plane is in row + 3 mod 6
+} WideRay;
+
+typedef struct WideStackEntry {
+    int32_t child;
+    int32_t count;
+    float t_near;
+} WideStackEntry;
+
+// Entry distances of the children of one node, returns a bit mask of the children hit
+static inline int ray_wide_children_intersect(const float* bounds, int width, const WideRay* ray,
+                                              float t_max, float* t_near) {
+    int mask = 0;
+#if defined(__AVX__)
+    if (width == 8) {
+        __m256 t_enter = _mm256_set1_ps(EPSILON);
+        __m256 t_exit = _mm256_set1_ps(t_max);
+        for (int axis = 0; axis < 3; axis++) {
+            __m256 origin = _mm256_set1_ps(ray->origin[axis]);
+            __m256 inv_dir = _mm256_set1_ps(ray->inv_dir[axis]);
+            __m256 near_plane = _mm256_loadu_ps(bounds + ray->near_row[axis] * 8);
+            __m256 far_plane = _mm256_loadu_ps(bounds + ((ray->near_row[axis] + 3) % 6) * 8);
+            t_enter = _mm256_max_ps(t_enter, _mm256_mul_ps(_mm256_sub_ps(near_plane, origin), inv_dir));
+            t_exit = _mm256_min_ps(t_exit, _mm256_mul_ps(_mm256_sub_ps(far_plane, origin), inv_dir));
+        }
+        _mm256_storeu_ps(t_near, t_enter);
+        return _mm256_movemask_ps(_mm256_cmp_ps(t_enter, t_exit, _CMP_LE_OQ));
+    }
+#endif
+#if defined(__SSE__)
+    for (int base = 0; base < width; base += 4) {
+        __m128 t_enter = _mm_set1_ps(EPSILON);
+        __m128 t_exit = _mm_set1_ps(t_max);
+        for (int axis = 0; axis < 3; axis++) {
+            __m128 origin = _mm_set1_ps(ray->origin[axis]);
+            __m128 inv_dir = _mm_set1_ps(ray->inv_dir[axis]);
+            __m128 near_plane = _mm_loadu_ps(bounds + ray->near_row[axis] * width + base);
+            __m128 far_plane = _mm_loadu_ps(bounds + ((ray->near_row[axis] + 3) % 6) * width + base);
+            t_enter = _mm_max_ps(t_enter, _mm_mul_ps(_mm_sub_ps(near_plane, origin), inv_dir));
+            t_exit = _mm_min_ps(t_exit, _mm_mul_ps(_mm_sub_ps(far_plane, origin), inv_dir));
+        }
+        _mm_storeu_ps(t_near + base, t_enter);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(t_enter, t_exit)) << base;
+    }
+#else
+    for (int slot = 0; slot < width; slot++) {
+        float t_enter = EPSILON, t_exit = t_max;
+        for (int axis = 0; axis < 3; axis++) {
+            float near_plane = bounds[ray->near_row[axis] * width + slot];
+            float far_plane = bounds[((ray->near_row[axis] + 3) % 6) * width + slot];
+            t_enter = max_f(t_enter, (near_plane - ray->origin[axis]) * ray->inv_dir[axis]);
+            t_exit = min_f(t_exit, (far_plane - ray->origin[axis]) * ray->inv_dir[axis]);
+        }
+        t_near[slot] = t_enter;
+        mask |= (t_enter <= t_exit) << slot;
+    }
+#endif
+    return mask;
+}
+
+HitRecord ray_wide_bvh_intersect(Ray ray, const WideBVH* bvh) {
+    HitRecord closest = {0};
+    closest.t = INFINITY;
+    if (!bvh || bvh->node_count == 0) {
+        return closest;
+    }
+
+    WideRay wide_ray;
+    float direction[3] = {ray.direction.x, ray.direction.y, ray.direction.z};
+    float origin[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+    for (int axis = 0; axis < 3; axis++) {
+        wide_ray.origin[axis] = origin[axis];
+        wide_ray.inv_dir[axis] = safe_inverse(direction[axis]);
+        wide_ray.near_row[axis] = wide_ray.inv_dir[axis] < 0.0f ? axis + 3 : axis;
+    }
+
+    int width = bvh->width;
+    WideStackEntry stack[WIDE_BVH_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = (WideStackEntry){0, WIDE_BVH_INTERIOR, 0.0f};
+
+    while (stack_size > 0) {
+        WideStackEntry entry = stack[--stack_size];
+        if (entry.t_near > closest.t) {
+            continue;
+        }
+
+        if (entry.count > 0) {
+            for (int i = 0; i < entry.count; i++) {
+                HitRecord hit = ray_sphere_intersect(ray, &bvh->spheres[bvh_leaf_sphere(bvh->sphere_indices, entry.child + i)]);
+                if (hit.hit_something && hit.t < closest.t) {
+                    closest = hit;
+                }
+            }
+            continue;
+        }
+
+        const float* bounds = bvh->bounds + (size_t)entry.child * 6 * width;
+        const WideBVHSlot* slots = bvh->slots + (size_t)entry.child * width;
+        float t_near[WIDE_BVH_MAX_WIDTH];
+        int mask = ray_wide_children_intersect(bounds, width, &wide_ray, closest.t, t_near);
+
+        // Insertion sort of the children hit, farthest first, so the nearest ends up on top
+        int first = stack_size;
+        while (mask) {
+            int slot = __builtin_ctz(mask);
+            mask &= mask - 1;
+            WideStackEntry child = {slots[slot].child, slots[slot].count, t_near[slot]};
+            int i = stack_size++;
+            while (i > first && stack[i - 1].t_near < child.t_near) {
+                stack[i] = stack[i - 1];
+                i--;
+            }
+            stack[i] = child;
+        }
+    }
+    return closest;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// ray_compressed_bvh_intersect() - Returns the hitrecord for the given ray, traversing a
+// compressed BVH (bvh_compress())
+// - Instead of decoding child bounds, the ray is moved into the node's grid once per node: a plane
+//   at step q is entered at t = q * (scale / dir) + (origin - ray origin) / dir, one multiply-add
+//   per plane and child. SSE handles 4 children at a time, expanding the bytes to floats.
+// - Child bounds are rounded outwards when compressed, and the exit distances get a small margin
+//   for the different rounding of this formula, so no hit can be lost.
+// - Hit children are sorted and pushed like in ray_wide_bvh_intersect().
+
+//--------------------------------------------------------------------------------------------------
+
+
+// 2^exponent for exponents in [-126, 127], built from the float bits instead of calling ldexpf()
+static inline float exponent_to_scale(int exponent) {
+    uint32_t bits = (uint32_t)(exponent + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return scale;
+}
+
+#define COMPRESSED_EXIT_MARGIN 1.000001f
+
+#if defined(__SSE__)
+static inline __m128 load_quantized(const uint8_t* q) {
+    int32_t packed;
+    memcpy(&packed, q, sizeof(packed));
+    __m128i zero = _mm_setzero_si128();
+    __m128i bytes = _mm_cvtsi32_si128(packed);
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero));
+}
+#endif
+
+// Entry distances of the children of one node, returns a bit mask of the children hit
+static inline int ray_compressed_children_intersect(const CompressedBVHNode* node, const float origin[3],
+                                                    const float inv_dir[3], const int near_is_hi[3],
+                                                    float t_max, float* t_near) {
+    float step[3], offset[3];
+    for (int axis = 0; axis < 3; axis++) {
+        step[axis] = inv_dir[axis] * exponent_to_scale(node->exponent[axis]);
+        offset[axis] = (node->origin[axis] - origin[axis]) * inv_dir[axis];
+    }
+
+    int mask = 0;
+#if defined(__SSE__)
+    for (int base = 0; base < COMPRESSED_BVH_WIDTH; base += 4) {
+        __m128 t_enter = _mm_set1_ps(EPSILON);
+        __m128 t_exit = _mm_set1_ps(t_max);
+        for (int axis = 0; axis < 3; axis++) {
+            __m128 s = _mm_set1_ps(step[axis]);
+            __m128 o = _mm_set1_ps(offset[axis]);
+            __m128 lo = _mm_add_ps(_mm_mul_ps(load_quantized(node->lo[axis] + base), s), o);
+            __m128 hi = _mm_add_ps(_mm_mul_ps(load_quantized(node->hi[axis] + base), s), o);
+            t_enter = _mm_max_ps(t_enter, near_is_hi[axis] ? hi : lo);
+            t_exit = _mm_min_ps(t_exit, near_is_hi[axis] ? lo : hi);
+        }
+        t_exit = _mm_mul_ps(t_exit, _mm_set1_ps(COMPRESSED_EXIT_MARGIN));
+        _mm_storeu_ps(t_near + base, t_enter);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(t_enter, t_exit)) << base;
+    }
+#else
+    for (int slot = 0; slot < COMPRESSED_BVH_WIDTH; slot++) {
+        float t_enter = EPSILON, t_exit = t_max;
+        for (int axis = 0; axis < 3; axis++) {
+            float lo = node->lo[axis][slot] * step[axis] + offset[axis];
+            float hi = node->hi[axis][slot] * step[axis] + offset[axis];
+            t_enter = max_f(t_enter, near_is_hi[axis] ? hi : lo);
+            t_exit = min_f(t_exit, near_is_hi[axis] ? lo : hi);
+        }
+        t_near[slot] = t_enter;
+        mask |= (t_enter <= t_exit * COMPRESSED_EXIT_MARGIN) << slot;
+    }
+#endif
+    return mask;
+}
+
+HitRecord ray_compressed_bvh_intersect(Ray ray, const CompressedBVH* bvh) {
+    HitRecord closest = {0};
+    closest.t = INFINITY;
+    if (!bvh || bvh->node_count == 0) {
+        return closest;
+    }
+
+    float origin[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+    float inv_dir[3] = {safe_inverse(ray.direction.x), safe_inverse(ray.direction.y), safe_inverse(ray.direction.z)};
+    int near_is_hi[3] = {inv_dir[0] < 0.0f, inv_dir[1] < 0.0f, inv_dir[2] < 0.0f};
+
+    // Leaf entries hold their first sphere index in child and their sphere count in count
+    WideStackEntry stack[COMPRESSED_BVH_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = (WideStackEntry){0, WIDE_BVH_INTERIOR, 0.0f};
+
+    while (stack_size > 0) {
+        WideStackEntry entry = stack[--stack_size];
+        if (entry.t_near > closest.t) {
+            continue;
+        }
+
+        if (entry.count > 0) {
+            for (int i = 0; i < entry.count; i++) {
+                HitRecord hit = ray_sphere_intersect(ray, &bvh->spheres[bvh->indices[entry.child + i]]);
+                if (hit.hit_something && hit.t < closest.t) {
+                    closest = hit;
+                }
+            }
+            continue;
+        }
+
+        const CompressedBVHNode* node = &bvh->nodes[entry.child];
+        float t_near[COMPRESSED_BVH_WIDTH];
+        int mask = ray_compressed_children_intersect(node, origin, inv_dir, near_is_hi, closest.t, t_near);
+
+        int first = stack_size;
+        while (mask) {
+            int slot = __builtin_ctz(mask);
+            mask &= mask - 1;
+            WideStackEntry child;
+            if (node->meta[slot] == COMPRESSED_BVH_EMPTY_SLOT) {
+                continue;
+            }
+            if (node->interior_mask & (1 << slot)) {
+                child = (WideStackEntry){(int32_t)node->child_base + node->meta[slot], WIDE_BVH_INTERIOR, t_near[slot]};
+            } else {
+                child = (WideStackEntry){(int32_t)node->leaf_base + (node->meta[slot] >> 2), (node->meta[slot] & 3) + 1, t_near[slot]};
+            }
+            int i = stack_size++;
+            while (i > first && stack[i - 1].t_near < child.t_near) {
+                stack[i] = stack[i - 1];
+                i--;
+            }
+            stack[i] = child;
+        }
+    }
+    return closest;
+}
@@ -8,6 +8,10 @@
 #include "Custom/camera.h"
 #include "Custom/sphere.h"
 #include "Custom/bvh.h"
+#include "Custom/bvh_refit.h"
+#include "Custom/bvh_rebuild.h"
+#include "Custom/bvh_autotune.h"
+#include "Custom/bvh_memory.h"
 #include "Custom/ray.h"
 #include "Custom/renderer.h"
 #include "Custom/hit.h"
@@ -17,6 +21,8 @@
 
 #define NUM_SPHERES 20
 #define MAX_DEPTH 5
+#define ANIMATION_STEP 0.05f
+#define ANIMATION_AMPLITUDE 8.0f
 
 
 typedef struct
@@ -74,6 +80,17 @@ void display_plot_with_sdl(SDL_Renderer *renderer)
     IMG_Quit();
 }
 
+// Every sphere circles around its starting position, with its own phase
+void animate_spheres(Sphere *spheres, const Vec3 *base_centers, int num_spheres, float time)
+{
+    for (int i = 0; i < num_spheres; i++)
+    {
+        float phase = time + i * 0.7f;
+        Vec3 offset = {ANIMATION_AMPLITUDE * sinf(phase), ANIMATION_AMPLITUDE * 0.5f * cosf(1.3f * phase), 0.0f};
+        spheres[i].center = vec3_add(base_centers[i], offset);
+    }
+}
+
 //----------------------------------------------------------------------------------------------------
 
 // MAIN
@@ -92,6 +109,8 @@ int SDL_main(int argc, char *argv[])
     printf("\nPlease proceed as follows :\n\n");
     printf("Press '1' for benchmark testing with graph plot.\n");
     printf("Press '2' for Realtime CPU Raytracing.\n");
+    printf("Press '3' for SAH cost calibration on this machine.\n");
+    printf("Press '4' for BVH build parameter autotuning.\n");
     printf("Waiting for the input : ");
 
     int input;
@@ -215,18 +234,50 @@ int SDL_main(int argc, char *argv[])
         // spheres[0] = create_sphere(((Vec3){0.0f, -100.0f, 30.0f}), 100.0f);
         // spheres[1] = create_sphere(((Vec3){0.0f, 3.0f, 30.0f}), 3.0f);
 
+        Vec3 base_centers[NUM_SPHERES];
+
         for (int i = 0; i < NUM_SPHERES; i++)
         {
             spheres[i] = create_random_sphere();
+            base_centers[i] = spheres[i].center;
         }
 
+        // Build parameters chosen by the autotuner (option 4) if it has been run, the defaults otherwise
+        BVHBuildParams build_params = bvh_default_build_params();
+        if (bvh_build_params_load(BVH_TUNED_PARAMS_PATH, &build_params))
+            printf("Using the tuned BVH build parameters of %s\n", BVH_TUNED_PARAMS_PATH);
+
         printf("Building BVH...\n");
-        double bvh_start = get_time();
-        BVHNode *root = build_bvh_node(spheres, 0, NUM_SPHERES, 0);
-        double bvh_end = get_time();
-        double bvh_build_time = bvh_end - bvh_start;
+        // spheres keeps its order, the BVH traces a copy laid out in leaf order
+        BVHSnapshot *initial_bvh = bvh_snapshot_build(spheres, NUM_SPHERES, &build_params);
+        if (!initial_bvh)
+        {
+            SDL_DestroyRenderer(renderer);
+            SDL_DestroyWindow(window);
+            SDL_Quit();
+            return 1;
+        }
+        double bvh_build_time = initial_bvh->build_time;
         printf("BVH built in %f seconds\n", bvh_build_time);
 
+        // Later rebuilds run on a worker thread, frames keep tracing the current BVH until the new
+        // one is swapped in at a frame boundary
+        BVHRefitTracker refit_tracker = bvh_refit_tracker(initial_bvh->build_cost, BVH_DEFAULT_REBUILD_RATIO);
+        BVHRebuildService *rebuilds = bvh_rebuild_service_create(initial_bvh, &build_params);
+        if (!rebuilds)
+        {
+            bvh_snapshot_release(initial_bvh);
+            SDL_DestroyRenderer(renderer);
+            SDL_DestroyWindow(window);
+            SDL_Quit();
+            return 1;
+        }
+
+        // Moving spheres refit the BVH every frame, it is only rebuilt once its SAH cost has decayed
+        int animate = 0;
+        float animation_time = 0.0f;
+        int bvh_rebuilds = 0;
+
         int quit = 0;
         SDL_Event e;
 
@@ -238,10 +289,15 @@ int SDL_main(int argc, char *argv[])
         int show_bvh_visualization = 0;
 
         int accumulated_frames = 1;
+        // One block for the whole framebuffer, on huge pages spread over the NUMA nodes like the BVH,
+        // indexed through column pointers
         FloatColor **accumulated_colors = (FloatColor **)malloc(WIDTH * sizeof(FloatColor *));
-        if (!accumulated_colors)
+        FloatColor *accumulated_pixels = (FloatColor *)bvh_alloc_large((size_t)WIDTH * HEIGHT * sizeof(FloatColor));
+        if (!accumulated_colors || !accumulated_pixels)
         {
             printf("Failed to allocate memory for accumulated_colors\n");
+            free(accumulated_colors);
+            bvh_free_large(accumulated_pixels);
             SDL_DestroyRenderer(renderer);
             SDL_DestroyWindow(window);
             SDL_Quit();
@@ -249,21 +305,7 @@ int SDL_main(int argc, char *argv[])
         }
         for (int i = 0; i < WIDTH; i++)
         {
-            accumulated_colors[i] = (FloatColor *)malloc(HEIGHT * sizeof(FloatColor));
-            if (!accumulated_colors[i])
-            {
-                printf("Failed to allocate memory for accumulated_colors[%d]\n", i);
-
-                for (int j = 0; j < i; j++)
-                {
-                    free(accumulated_colors[j]);
-                }
-                free(accumulated_colors);
-                SDL_DestroyRenderer(renderer);
-                SDL_DestroyWindow(window);
-                SDL_Quit();
-                return 1;
-            }
+            accumulated_colors[i] = &accumulated_pixels[i * HEIGHT];
             for (int j = 0; j < HEIGHT; j++)
             {
                 accumulated_colors[i][j].r = 0.0f;
@@ -322,6 +364,10 @@ int SDL_main(int argc, char *argv[])
                         show_bvh_visualization = !show_bvh_visualization;
                         printf("BVH visualization %s\n", show_bvh_visualization ? "enabled" : "disabled");
                         break;
+                    case SDLK_m:
+                        animate = !animate;
+                        printf("Animation %s\n", animate ? "enabled" : "disabled");
+                        break;
                     }
                 }
                 else if (e.type == SDL_MOUSEMOTION)
@@ -336,12 +382,50 @@ int SDL_main(int argc, char *argv[])
                     }
                 }
             }
+
+            // Frame boundary: a BVH finished in the background replaces the current one, the frame
+            // holds a reference to the BVH it traces until it is done
+            int swapped = bvh_rebuild_swap(rebuilds);
+            BVHSnapshot *frame_bvh = bvh_rebuild_acquire(rebuilds);
+            if (swapped)
+            {
+                printf("Swapped in the BVH rebuilt in the background (built in %f seconds)\n", frame_bvh->build_time);
+                refit_tracker = bvh_refit_tracker(frame_bvh->build_cost, BVH_DEFAULT_REBUILD_RATIO);
+                bvh_rebuilds++;
+            }
+
+            if (animate)
+            {
+                animation_time += ANIMATION_STEP;
+                animate_spheres(spheres, base_centers, NUM_SPHERES, animation_time);
+            }
+
+            // A swapped in BVH was built from the positions of a few frames ago, so it is refitted too
+            if (animate || swapped)
+            {
+                float cost = bvh_refit(frame_bvh->root, spheres, frame_bvh->sphere_indices, 1);
+                // The leaf ordered copy keeps its order, only the sphere data changes
+                for (int i = 0; i < NUM_SPHERES; i++)
+                {
+                    frame_bvh->leaf_spheres[i] = spheres[frame_bvh->sphere_indices[i]];
+                }
+                bvh_refit_linear(frame_bvh->bvh, 1);
+
+                if (bvh_refit_needs_rebuild(&refit_tracker, cost) && !bvh_rebuild_pending(rebuilds))
+                {
+                    printf("SAH cost %.2f after %d refits (%.2f when built), rebuilding BVH in the background\n",
+                           cost, refit_tracker.refits, refit_tracker.build_cost);
+                    bvh_rebuild_request(rebuilds, spheres, NUM_SPHERES);
+                }
+                camera.move = 1;
+            }
+
             if (show_bvh_visualization)
             {
                 SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
                 SDL_RenderClear(renderer);
 
-                render_debug_visualization(renderer, root, &camera);
+                render_debug_visualization(renderer, frame_bvh->root, &camera);
                 SDL_RenderPresent(renderer);
             }
             else
@@ -363,7 +447,7 @@ int SDL_main(int argc, char *argv[])
                             float v = (float)y / HEIGHT - 0.5f;
 
                             Ray ray = get_camera_ray(&camera, u, -v);
-                            SDL_Color color = trace_ray(ray, spheres, NUM_SPHERES, MAX_DEPTH, use_bvh ? root : NULL);
+                            SDL_Color color = trace_ray(ray, spheres, NUM_SPHERES, MAX_DEPTH, use_bvh ? frame_bvh->bvh : NULL);
 
                             accumulated_colors[x][y].r = (float)color.r / 255.0f;
                             accumulated_colors[x][y].g = (float)color.g / 255.0f;
@@ -389,7 +473,7 @@ int SDL_main(int argc, char *argv[])
                             float v = (float)y / HEIGHT - 0.5f;
 
                             Ray ray = get_camera_ray(&camera, u, -v);
-                            SDL_Color color = trace_ray(ray, spheres, NUM_SPHERES, MAX_DEPTH, use_bvh ? root : NULL);
+                            SDL_Color color = trace_ray(ray, spheres, NUM_SPHERES, MAX_DEPTH, use_bvh ? frame_bvh->bvh : NULL);
 
                             accumulated_colors[x][y].r += (float)color.r / 255.0f;
                             accumulated_colors[x][y].g += (float)color.g / 255.0f;
@@ -420,6 +504,7 @@ int SDL_main(int argc, char *argv[])
                            frame_count / total_render_time);
                 }
             }
+            bvh_snapshot_release(frame_bvh);
         }
 
         printf("\nFinal Performance Report:\n");
@@ -427,12 +512,11 @@ int SDL_main(int argc, char *argv[])
         printf("Average frame time: %f seconds\n", total_render_time / frame_count);
         printf("Average FPS: %.2f\n", frame_count / total_render_time);
         printf("BVH build time: %f seconds\n", bvh_build_time);
+        printf("BVH rebuilds while animating: %d\n", bvh_rebuilds);
 
-        for (int i = 0; i < WIDTH; i++)
-        {
-            free(accumulated_colors[i]);
-        }
         free(accumulated_colors);
+        bvh_free_large(accumulated_pixels);
+        bvh_rebuild_service_destroy(rebuilds);
 
         SDL_DestroyRenderer(renderer);
         SDL_DestroyWindow(window);
@@ -441,6 +525,31 @@ int SDL_main(int argc, char *argv[])
     }
         //------------------------------------------------------------------------------------------
 
+        // SAH cost calibration
+        // Measures node visit and sphere test costs with the traversal kernel on this machine and
+        // writes them to the profile every builder reads (BVH_COST_PROFILE_PATH), see benchmark.c
+
+        //------------------------------------------------------------------------------------------
+
+    case 3:
+        run_cost_calibration();
+        break;
+
+        //------------------------------------------------------------------------------------------
+
+        // BVH build parameter autotuning
+        // Searches builder, bin count, leaf size and depth limit for the fastest traversal of a
+        // benchmark scene and writes the winner to BVH_TUNED_PARAMS_PATH, which option 2 builds
+        // with, see bvh_autotune.c
+
+        //------------------------------------------------------------------------------------------
+
+    case 4:
+        run_autotune();
+        break;
+
+        //------------------------------------------------------------------------------------------
+
     default:
         printf("Please press only among the given options");
         break;
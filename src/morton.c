@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <string.h>
+#include "Custom/morton.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// Morton codes and their parallel radix sort, shared by the linear BVH builders.
+// A Morton code interleaves the bits of the quantized x, y and z coordinates, so sorting points by
+// their code lays them out along a Z-order space filling curve and spatially close points end up
+// close to each other in the sorted array.
+// The sort is a least significant digit radix sort with 8-bit digits: one pass per byte of the code.
+// Every pass counts digits per chunk, turns the counts into write offsets (digit-major, then chunk
+// order, which keeps the sort stable) and scatters every chunk in parallel.
+// Like the helpers in bvh.c, the loops are OpenMP task loops and only run in parallel when called
+// from inside a builder's parallel region.
+
+//----------------------------------------------------------------------------------------------------
+
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+
+// Spreads the lowest 10 bits of v so that two zero bits separate each of them
+static uint64_t expand_bits_10(uint64_t v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// Spreads the lowest 21 bits of v so that two zero bits separate each of them
+static uint64_t expand_bits_21(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | (v << 32)) & 0x1f00000000ffffULL;
+    v = (v | (v << 16)) & 0x1f0000ff0000ffULL;
+    v = (v | (v << 8)) & 0x100f00f00f00f00fULL;
+    v = (v | (v << 4)) & 0x10c30c30c30c30c3ULL;
+    v = (v | (v << 2)) & 0x1249249249249249ULL;
+    return v;
+}
+
+static uint64_t quantize(float value, float min, float extent, uint64_t cells)
+{
+    if (extent <= 0.0f)
+        return 0;
+    float t = (value - min) / extent * (float)cells;
+    if (t <= 0.0f)
+        return 0;
+    return t >= (float)(cells - 1) ? cells - 1 : (uint64_t)t;
+}
+
+uint64_t morton_encode(Vec3 point, AABB bounds, int bits)
+{
+    int axis_bits = bits == MORTON_BITS_63 ? 21 : 10;
+    uint64_t cells = 1ULL << axis_bits;
+
+    uint64_t x = quantize(point.x, bounds.min.x, bounds.max.x - bounds.min.x, cells);
+    uint64_t y = quantize(point.y, bounds.min.y, bounds.max.y - bounds.min.y, cells);
+    uint64_t z = quantize(point.z, bounds.min.z, bounds.max.z - bounds.min.z, cells);
+
+    if (axis_bits == 21)
+        return (expand_bits_21(x) << 2) | (expand_bits_21(y) << 1) | expand_bits_21(z);
+    return (expand_bits_10(x) << 2) | (expand_bits_10(y) << 1) | expand_bits_10(z);
+}
+
+void morton_encode_spheres(const Sphere *spheres, int num_spheres, AABB centroid_bounds, int bits, uint64_t *codes)
+{
+#pragma omp taskloop grainsize(BVH_PARALLEL_GRAIN)
+    for (int i = 0; i < num_spheres; i++)
+    {
+        codes[i] = morton_encode(spheres[i].center, centroid_bounds, bits);
+    }
+}
+
+AABB sphere_centroid_bounds(const Sphere *spheres, int num_spheres)
+{
+    int chunks = (num_spheres + BVH_PARALLEL_GRAIN - 1) / BVH_PARALLEL_GRAIN;
+    AABB *partial = (AABB *)malloc(chunks * sizeof(AABB));
+
+    // Without room for the per-chunk bounds, a single pass gives the same result
+    if (partial == NULL)
+    {
+        AABB bounds = create_empty_aabb();
+        for (int i = 0; i < num_spheres; i++)
+        {
+            bounds = grow_aabb_point(bounds, spheres[i].center);
+        }
+        return bounds;
+    }
+
+#pragma omp taskloop grainsize(1)
+    for (int c = 0; c < chunks; c++)
+    {
+        int end = (c + 1) * BVH_PARALLEL_GRAIN < num_spheres ? (c + 1) * BVH_PARALLEL_GRAIN : num_spheres;
+        partial[c] = create_empty_aabb();
+        for (int i = c * BVH_PARALLEL_GRAIN; i < end; i++)
+        {
+            partial[c] = grow_aabb_point(partial[c], spheres[i].center);
+        }
+    }
+
+    AABB bounds = create_empty_aabb();
+    for (int c = 0; c < chunks; c++)
+    {
+        bounds = grow_aabb(bounds, partial[c]);
+    }
+    free(partial);
+    return bounds;
+}
+
+int morton_radix_sort(uint64_t *codes, int *values, int count, int bits)
+{
+    int chunks = (count + BVH_PARALLEL_GRAIN - 1) / BVH_PARALLEL_GRAIN;
+    int passes = (bits + RADIX_BITS - 1) / RADIX_BITS;
+    uint64_t *codes_tmp = (uint64_t *)malloc(count * sizeof(uint64_t));
+    int *values_tmp = (int *)malloc(count * sizeof(int));
+    int(*offsets)[RADIX_SIZE] = malloc(chunks * sizeof(*offsets));
+    if (!codes_tmp || !values_tmp || !offsets)
+    {
+        free(codes_tmp);
+        free(values_tmp);
+        free(offsets);
+        return 0;
+    }
+
+    uint64_t *src_codes = codes, *dst_codes = codes_tmp;
+    int *src_values = values, *dst_values = values_tmp;
+
+    for (int pass = 0; pass < passes; pass++)
+    {
+        int shift = pass * RADIX_BITS;
+
+#pragma omp taskloop grainsize(1)
+        for (int c = 0; c < chunks; c++)
+        {
+            int end = (c + 1) * BVH_PARALLEL_GRAIN < count ? (c + 1) * BVH_PARALLEL_GRAIN : count;
+            memset(offsets[c], 0, sizeof(offsets[c]));
+            for (int i = c * BVH_PARALLEL_GRAIN; i < end; i++)
+            {
+                offsets[c][(src_codes[i] >> shift) & (RADIX_SIZE - 1)]++;
+            }
+        }
+
+        int position = 0;
+        for (int digit = 0; digit < RADIX_SIZE; digit++)
+        {
+            for (int c = 0; c < chunks; c++)
+            {
+                int digit_count = offsets[c][digit];
+                offsets[c][digit] = position;
+                position += digit_count;
+            }
+        }
+
+#pragma omp taskloop grainsize(1)
+        for (int c = 0; c < chunks; c++)
+        {
+            int end = (c + 1) * BVH_PARALLEL_GRAIN < count ? (c + 1) * BVH_PARALLEL_GRAIN : count;
+            for (int i = c * BVH_PARALLEL_GRAIN; i < end; i++)
+            {
+                int target = offsets[c][(src_codes[i] >> shift) & (RADIX_SIZE - 1)]++;
+                dst_codes[target] = src_codes[i];
+                dst_values[target] = src_values[i];
+            }
+        }
+
+        uint64_t *swap_codes = src_codes;
+        src_codes = dst_codes;
+        dst_codes = swap_codes;
+        int *swap_values = src_values;
+        src_values = dst_values;
+        dst_values = swap_values;
+    }
+
+    if (src_codes != codes)
+    {
+        memcpy(codes, src_codes, count * sizeof(uint64_t));
+        memcpy(values, src_values, count * sizeof(int));
+    }
+
+    free(codes_tmp);
+    free(values_tmp);
+    free(offsets);
+    return 1;
+}
+
+// Sorts the sphere indices by the Morton code of the sphere centers, the spheres are not moved.
+// codes and order receive the sorted codes and the index of the sphere each code belongs to.
+int morton_sort_spheres(const Sphere *spheres, int num_spheres, int bits, uint64_t *codes, int *order)
+{
+    AABB centroid_bounds = sphere_centroid_bounds(spheres, num_spheres);
+    morton_encode_spheres(spheres, num_spheres, centroid_bounds, bits, codes);
+
+#pragma omp taskloop grainsize(BVH_PARALLEL_GRAIN)
+    for (int i = 0; i < num_spheres; i++)
+    {
+        order[i] = i;
+    }
+    return morton_radix_sort(codes, order, num_spheres, bits);
+}
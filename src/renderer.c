@@ -18,7 +18,7 @@
 
 //--------------------------------------------------------------------------------------------------
 
-SDL_Color trace_ray(Ray ray, Sphere *spheres, int num_spheres, int depth, BVHNode *bvh)
+SDL_Color trace_ray(Ray ray, Sphere *spheres, int num_spheres, int depth, const LinearBVH *bvh)
 {
     if (depth <= 0)
         return (SDL_Color){0, 0, 0, 255};
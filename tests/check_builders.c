@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "Custom/bvh.h"
+#include "Custom/bvh_linear.h"
+#include "Custom/bvh_autotune.h"
+#include "Custom/bvh_dynamic.h"
+#include "Custom/bvh_optimize.h"
+#include "Custom/bvh_refit.h"
+#include "Custom/hit.h"
+
+//----------------------------------------------------------------------------------------------------
+
+// Builder check (make check)
+// Builds one fixed-seed scene with every builder and traces the same rays through the pointer tree
+// and the flattened tree, against a brute-force loop over all spheres. Both must report the same
+// closest hit for every ray. The scene mixes random spheres with runs of coincident ones, which
+// exercise the splits that cannot separate their primitives.
+// The binned tree is then optimized, refitted after the spheres moved, collapsed into the wide and
+// compressed layouts and clustered in all three node orders, each traced the same way. A two level
+// BVH over instanced clusters is traced against brute force over every instance expanded.
+// A dynamic BVH then goes through a sequence of removals, single insertions and batches, and after
+// every step traces the same rays against brute force over the spheres it holds at that point.
+// Exits with 1 when any tree fails to build or misses a closest hit.
+
+//----------------------------------------------------------------------------------------------------
+
+#define CHECK_SPHERES 4000
+#define CHECK_COINCIDENT 64     // every run of this many spheres shares one center
+#define CHECK_RAYS 2000
+#define CHECK_SEED 20241016u
+#define CHECK_WORLD_SIZE 200.0f
+#define CHECK_CLUSTERS 4
+#define CHECK_CLUSTER_SIZE 32
+#define CHECK_INSTANCES 64
+// Relative, the brute-force quadratic in world space loses about the square root of the float
+// precision at these distances, where the instance hits are found in object space
+#define CHECK_TLAS_TOLERANCE 1e-3f
+
+// Own generator, so the scene is the same whatever the C library's rand()
+static unsigned int check_state = CHECK_SEED;
+
+static float check_random()
+{
+    check_state = check_state * 1664525u + 1013904223u;
+    return (check_state >> 8) / 16777216.0f;
+}
+
+static Vec3 random_point(float size)
+{
+    return (Vec3){check_random() * size - size / 2, check_random() * size - size / 2,
+                  check_random() * size - size / 2};
+}
+
+// live marks the spheres to test, NULL tests all of them
+static HitRecord brute_force_hit(Ray ray, Sphere *spheres, const unsigned char *live, int num_spheres)
+{
+    HitRecord closest = {0};
+    closest.t = INFINITY;
+    for (int i = 0; i < num_spheres; i++)
+    {
+        if (live && !live[i])
+            continue;
+        HitRecord hit = ray_sphere_intersect(ray, &spheres[i]);
+        if (hit.hit_something && hit.t < closest.t)
+            closest = hit;
+    }
+    return closest;
+}
+
+static int same_hit(HitRecord a, HitRecord b)
+{
+    return a.hit_something == b.hit_something && (!a.hit_something || a.t == b.t);
+}
+
+// Traces every ray through the pointer tree and its flattened copy, returns 1 if both find the
+// expected hits and the tree holds sphere_count spheres
+static int check_tree(const char *name, BVHNode *root, Sphere *spheres, int *sphere_indices, int sphere_count,
+                      const Ray *rays, const HitRecord *expected)
+{
+    LinearBVH *bvh = root ? bvh_flatten(root, spheres, sphere_indices) : NULL;
+    if (!bvh)
+    {
+        printf("%-24s FAILED: the tree did not build or flatten\n", name);
+        return 0;
+    }
+
+    int tree_misses = 0, linear_misses = 0, hits = 0;
+    for (int i = 0; i < CHECK_RAYS; i++)
+    {
+        hits += expected[i].hit_something;
+        if (!same_hit(ray_bvh_node_intersect(rays[i], root, spheres, sphere_indices), expected[i]))
+            tree_misses++;
+        if (!same_hit(ray_bvh_intersect(rays[i], bvh), expected[i]))
+            linear_misses++;
+    }
+    free_linear_bvh(bvh);
+
+    int ok = tree_misses == 0 && linear_misses == 0 && bvh_sphere_count(root) == sphere_count;
+    printf("%-24s %s: %d of %d rays hit, %d pointer tree and %d linear tree mismatches\n", name,
+           ok ? "ok" : "FAILED", hits, CHECK_RAYS, tree_misses, linear_misses);
+    return ok;
+}
+
+// Prints the result of a traversal that is not a pointer tree, returns 1 if it had no mismatches
+static int report_traversal(const char *name, int built, int hits, int mismatches)
+{
+    if (!built)
+    {
+        printf("%-24s FAILED: the tree did not build\n", name);
+        return 0;
+    }
+    printf("%-24s %s: %d of %d rays hit, %d mismatches\n", name, mismatches == 0 ? "ok" : "FAILED", hits,
+           CHECK_RAYS, mismatches);
+    return mismatches == 0;
+}
+
+// The layouts of a binned tree, its optimized and refitted versions. Returns the number of failures.
+static int check_derived(Sphere *spheres, const Ray *rays, const HitRecord *expected)
+{
+    int *sphere_indices = malloc(CHECK_SPHERES * sizeof(int));
+    Sphere *moved = malloc(CHECK_SPHERES * sizeof(Sphere));
+    HitRecord *moved_expected = malloc(CHECK_RAYS * sizeof(HitRecord));
+    if (!sphere_indices || !moved || !moved_expected)
+    {
+        printf("Failed to allocate the derived tree check\n");
+        free(sphere_indices);
+        free(moved);
+        free(moved_expected);
+        return 1;
+    }
+
+    int failures = 0, hits = 0;
+    for (int i = 0; i < CHECK_RAYS; i++)
+    {
+        hits += expected[i].hit_something;
+    }
+
+    BVHBuildParams params = bvh_default_build_params();
+    params.builder = BVH_BUILDER_PLOC;
+    BVHNode *root = build_bvh(spheres, CHECK_SPHERES, &params, sphere_indices);
+    bvh_optimize_treelets(root, BVH_DEFAULT_TREELET_PASSES, 0);
+    failures += !check_tree("ploc+treelets", root, spheres, sphere_indices, CHECK_SPHERES, rays, expected);
+    free_bvh(root);
+
+    params.builder = BVH_BUILDER_LBVH;
+    root = build_bvh(spheres, CHECK_SPHERES, &params, sphere_indices);
+    if (root)
+        bvh_optimize_insertion(root, NULL);
+    failures += !check_tree("lbvh+insertion", root, spheres, sphere_indices, CHECK_SPHERES, rays, expected);
+    free_bvh(root);
+
+    params.builder = BVH_BUILDER_BINNED;
+    root = build_bvh(spheres, CHECK_SPHERES, &params, sphere_indices);
+    char name[64];
+    for (int width = 4; width <= WIDE_BVH_MAX_WIDTH; width *= 2)
+    {
+        WideBVH *wide = root ? bvh_collapse_wide(root, spheres, sphere_indices, width) : NULL;
+        int mismatches = 0;
+        for (int i = 0; wide && i < CHECK_RAYS; i++)
+        {
+            mismatches += !same_hit(ray_wide_bvh_intersect(rays[i], wide), expected[i]);
+        }
+        snprintf(name, sizeof(name), "binned wide %d", width);
+        failures += !report_traversal(name, wide != NULL, hits, mismatches);
+        free_wide_bvh(wide);
+    }
+
+    CompressedBVH *compressed = root ? bvh_compress(root, spheres, sphere_indices) : NULL;
+    int mismatches = 0;
+    for (int i = 0; compressed && i < CHECK_RAYS; i++)
+    {
+        mismatches += !same_hit(ray_compressed_bvh_intersect(rays[i], compressed), expected[i]);
+    }
+    failures += !report_traversal("binned compressed", compressed != NULL, hits, mismatches);
+    free_compressed_bvh(compressed);
+
+    LinearBVH *bvh = root ? bvh_flatten(root, spheres, sphere_indices) : NULL;
+    for (int layout = 0; layout < BVH_LAYOUT_COUNT; layout++)
+    {
+        ClusteredBVH *clustered = bvh ? bvh_cluster_layout(bvh, (BVHNodeLayout)layout) : NULL;
+        mismatches = 0;
+        for (int i = 0; clustered && i < CHECK_RAYS; i++)
+        {
+            mismatches += !same_hit(ray_clustered_bvh_intersect(rays[i], clustered), expected[i]);
+        }
+        snprintf(name, sizeof(name), "binned %s", bvh_layout_name((BVHNodeLayout)layout));
+        failures += !report_traversal(name, clustered != NULL, hits, mismatches);
+        free_clustered_bvh(clustered);
+    }
+    free_linear_bvh(bvh);
+
+    // Every sphere moves by up to about a radius, the coincident runs stay together
+    Vec3 offset = {0, 0, 0};
+    for (int i = 0; i < CHECK_SPHERES; i++)
+    {
+        if (i < CHECK_SPHERES * 3 / 4 || i % CHECK_COINCIDENT == 0)
+            offset = random_point(1.0f);
+        moved[i] = spheres[i];
+        moved[i].center = vec3_add(spheres[i].center, offset);
+    }
+    for (int i = 0; i < CHECK_RAYS; i++)
+    {
+        moved_expected[i] = brute_force_hit(rays[i], moved, NULL, CHECK_SPHERES);
+    }
+    if (root)
+        bvh_refit(root, moved, sphere_indices, 0);
+    failures += !check_tree("binned refit", root, moved, sphere_indices, CHECK_SPHERES, rays, moved_expected);
+    free_bvh(root);
+
+    free(sphere_indices);
+    free(moved);
+    free(moved_expected);
+    return failures;
+}
+
+// Instances of a few clusters, moved, turned and scaled, against brute force over every sphere of
+// every instance in world space. Returns 1 if the check fails.
+static int check_instancing()
+{
+    Sphere *cluster_spheres = malloc(CHECK_CLUSTERS * CHECK_CLUSTER_SIZE * sizeof(Sphere));
+    Sphere *expanded = malloc(CHECK_INSTANCES * CHECK_CLUSTER_SIZE * sizeof(Sphere));
+    BVHInstance *instances = malloc(CHECK_INSTANCES * sizeof(BVHInstance));
+    BLAS *clusters[CHECK_CLUSTERS] = {0};
+    if (!cluster_spheres || !expanded || !instances)
+    {
+        printf("Failed to allocate the instancing check\n");
+        free(cluster_spheres);
+        free(expanded);
+        free(instances);
+        return 1;
+    }
+
+    BVHBuildParams params = bvh_default_build_params();
+    int built = 1;
+    for (int c = 0; c < CHECK_CLUSTERS; c++)
+    {
+        for (int j = 0; j < CHECK_CLUSTER_SIZE; j++)
+        {
+            cluster_spheres[c * CHECK_CLUSTER_SIZE + j] = create_benchmark_sphere(random_point(10.0f));
+        }
+        clusters[c] = bvh_build_blas(&cluster_spheres[c * CHECK_CLUSTER_SIZE], CHECK_CLUSTER_SIZE, &params);
+        built = built && clusters[c];
+    }
+
+    TLAS *tlas = NULL;
+    if (built)
+    {
+        for (int i = 0; i < CHECK_INSTANCES; i++)
+        {
+            instances[i].blas = clusters[i % CHECK_CLUSTERS];
+            instances[i].object_to_world = transform_make(random_point(CHECK_WORLD_SIZE),
+                                                          check_random() * 6.2831853f, 0.5f + check_random());
+        }
+        tlas = bvh_build_tlas(instances, CHECK_INSTANCES, &params);
+    }
+
+    int mismatches = 0, hits = 0;
+    for (int i = 0; tlas && i < CHECK_INSTANCES; i++)
+    {
+        const BLAS *blas = instances[i].blas;
+        float scale = vec3_len(transform_vector(&instances[i].object_to_world, (Vec3){1, 0, 0}));
+        for (int j = 0; j < blas->sphere_count; j++)
+        {
+            Sphere sphere = blas->spheres[j];
+            sphere.center = transform_point(&instances[i].object_to_world, sphere.center);
+            sphere.radius *= scale;
+            expanded[i * CHECK_CLUSTER_SIZE + j] = sphere;
+        }
+    }
+    for (int i = 0; tlas && i < CHECK_RAYS; i++)
+    {
+        // Half of the rays aim at an instanced sphere
+        Vec3 origin = random_point(CHECK_WORLD_SIZE);
+        Vec3 target = i % 2 ? expanded[(int)(check_random() * CHECK_INSTANCES * CHECK_CLUSTER_SIZE)].center
+                            : random_point(CHECK_WORLD_SIZE);
+        Ray ray = {origin, vec3_normalize(vec3_sub(target, origin))};
+        HitRecord expected = brute_force_hit(ray, expanded, NULL, CHECK_INSTANCES * CHECK_CLUSTER_SIZE);
+        HitRecord hit = ray_tlas_intersect(ray, tlas);
+        hits += expected.hit_something;
+        if (hit.hit_something != expected.hit_something ||
+            (hit.hit_something && fabsf(hit.t - expected.t) > CHECK_TLAS_TOLERANCE * expected.t))
+            mismatches++;
+    }
+    int ok = report_traversal("tlas", tlas != NULL, hits, mismatches);
+
+    free_tlas(tlas);
+    for (int c = 0; c < CHECK_CLUSTERS; c++)
+    {
+        free_blas(clusters[c]);
+    }
+    free(cluster_spheres);
+    free(expanded);
+    free(instances);
+    return !ok;
+}
+
+// Checks the dynamic tree against brute force over the spheres marked live
+static int check_dynamic(const char *step, DynamicBVH *tree, Sphere *spheres, const unsigned char *live,
+                         const Ray *rays, HitRecord *expected)
+{
+    int live_count = 0;
+    for (int i = 0; i < CHECK_SPHERES; i++)
+    {
+        live_count += live[i];
+    }
+    for (int i = 0; i < CHECK_RAYS; i++)
+    {
+        expected[i] = brute_force_hit(rays[i], spheres, live, CHECK_SPHERES);
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "dynamic %s", step);
+    return check_tree(name, tree->root, spheres, tree->sphere_indices, live_count, rays, expected);
+}
+
+// Removals, single insertions, a small batch (inserted one by one) and a large one (rebuilds the
+// upper levels), starting from a binned build over the first half of the scene. Returns the
+// number of failed steps.
+static int check_dynamic_sequence(Sphere *spheres, const Ray *rays)
+{
+    unsigned char *live = calloc(CHECK_SPHERES, 1);
+    int *sphere_indices = malloc(CHECK_SPHERES * sizeof(int));
+    int *batch = malloc(CHECK_SPHERES * sizeof(int));
+    HitRecord *expected = malloc(CHECK_RAYS * sizeof(HitRecord));
+    if (!live || !sphere_indices || !batch || !expected)
+    {
+        printf("Failed to allocate the dynamic BVH check\n");
+        free(live);
+        free(sphere_indices);
+        free(batch);
+        free(expected);
+        return 1;
+    }
+
+    // The built half has no coincident spheres, the large batch brings them in
+    const int built = CHECK_SPHERES / 2;
+    const int singles_end = CHECK_SPHERES * 5 / 8;
+    BVHBuildParams params = bvh_default_build_params();
+    params.builder = BVH_BUILDER_BINNED;
+    BVHNode *root = build_bvh(spheres, built, &params, sphere_indices);
+    // A failed bvh_make_dynamic() frees the tree it was given
+    DynamicBVH *tree = root ? bvh_make_dynamic(root, sphere_indices) : NULL;
+    if (!tree)
+    {
+        printf("%-24s FAILED: the tree did not build\n", "dynamic");
+        free(live);
+        free(sphere_indices);
+        free(batch);
+        free(expected);
+        return 1;
+    }
+    for (int i = 0; i < built; i++)
+    {
+        live[i] = 1;
+    }
+
+    int failures = !check_dynamic("built", tree, spheres, live, rays, expected);
+
+    int ok = 1;
+    for (int i = 0; i < built; i += 3)
+    {
+        ok = ok && bvh_remove(tree, spheres, i);
+        live[i] = 0;
+    }
+    failures += !(check_dynamic("removed", tree, spheres, live, rays, expected) && ok);
+
+    for (int i = built; i < singles_end; i++)
+    {
+        ok = ok && bvh_insert(tree, spheres, i);
+        live[i] = 1;
+    }
+    failures += !(check_dynamic("inserted", tree, spheres, live, rays, expected) && ok);
+
+    int count = 0;
+    for (int i = 0; i < built / 8; i += 3)
+    {
+        batch[count++] = i;
+        live[i] = 1;
+    }
+    ok = ok && bvh_insert_batch(tree, spheres, batch, count);
+    failures += !(check_dynamic("small batch", tree, spheres, live, rays, expected) && ok);
+
+    count = 0;
+    for (int i = singles_end; i < CHECK_SPHERES; i++)
+    {
+        batch[count++] = i;
+        live[i] = 1;
+    }
+    ok = ok && bvh_insert_batch(tree, spheres, batch, count);
+    failures += !(check_dynamic("large batch", tree, spheres, live, rays, expected) && ok);
+
+    // Every other sphere of the coincident runs, leaves whose spheres share one center
+    for (int i = CHECK_SPHERES * 3 / 4; i < CHECK_SPHERES; i += 2)
+    {
+        ok = ok && bvh_remove(tree, spheres, i);
+        live[i] = 0;
+    }
+    failures += !(check_dynamic("coincident", tree, spheres, live, rays, expected) && ok);
+
+    free_dynamic_bvh(tree);
+    free(live);
+    free(sphere_indices);
+    free(batch);
+    free(expected);
+    return failures;
+}
+
+int main()
+{
+    Sphere *spheres = malloc(CHECK_SPHERES * sizeof(Sphere));
+    int *sphere_indices = malloc(CHECK_SPHERES * sizeof(int));
+    Ray *rays = malloc(CHECK_RAYS * sizeof(Ray));
+    HitRecord *expected = malloc(CHECK_RAYS * sizeof(HitRecord));
+    if (!spheres || !sphere_indices || !rays || !expected)
+    {
+        printf("Failed to allocate the check scene\n");
+        return 1;
+    }
+
+    Vec3 shared_center = {0, 0, 0};
+    for (int i = 0; i < CHECK_SPHERES; i++)
+    {
+        // The last quarter of the scene comes in coincident runs
+        if (i < CHECK_SPHERES * 3 / 4)
+        {
+            spheres[i] = create_benchmark_sphere(random_point(CHECK_WORLD_SIZE));
+            continue;
+        }
+        if (i % CHECK_COINCIDENT == 0)
+            shared_center = random_point(CHECK_WORLD_SIZE);
+        spheres[i] = create_benchmark_sphere(shared_center);
+    }
+    for (int i = 0; i < CHECK_RAYS; i++)
+    {
+        // Half of the rays aim at a sphere, the others anywhere
+        Vec3 origin = random_point(CHECK_WORLD_SIZE);
+        Vec3 target = i % 2 ? spheres[(int)(check_random() * CHECK_SPHERES)].center : random_point(CHECK_WORLD_SIZE);
+        rays[i] = (Ray){origin, vec3_normalize(vec3_sub(target, origin))};
+        expected[i] = brute_force_hit(rays[i], spheres, NULL, CHECK_SPHERES);
+    }
+
+    static const BVHBuilder builders[] = {BVH_BUILDER_PLANES, BVH_BUILDER_BINNED, BVH_BUILDER_SWEEP,
+                                          BVH_BUILDER_LBVH, BVH_BUILDER_HLBVH, BVH_BUILDER_PLOC};
+    const int builder_count = (int)(sizeof(builders) / sizeof(builders[0]));
+    int failures = 0;
+    for (int b = 0; b < builder_count; b++)
+    {
+        BVHBuildParams params = bvh_default_build_params();
+        params.builder = builders[b];
+        BVHNode *root = build_bvh(spheres, CHECK_SPHERES, &params, sphere_indices);
+        failures += !check_tree(bvh_builder_name(builders[b]), root, spheres, sphere_indices, CHECK_SPHERES,
+                                rays, expected);
+        free_bvh(root);
+    }
+
+    failures += check_derived(spheres, rays, expected);
+    failures += check_instancing();
+    failures += check_dynamic_sequence(spheres, rays);
+
+    free(expected);
+    free(rays);
+    free(sphere_indices);
+    free(spheres);
+    return failures > 0;
+}